@@ -0,0 +1,180 @@
+#include "road_network.h"
+#include "util.h"
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <memory>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace road_network;
+
+struct Workload
+{
+    string name;
+    vector<pair<NodeID,NodeID>> queries;
+};
+
+// evict index file from page cache, so the next mapping has to fault in all pages from disk
+static void drop_page_cache(const string &filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0 || fdatasync(fd) != 0 || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0)
+        cerr << "cannot drop page cache of " << filename << endl;
+    if (fd >= 0)
+        close(fd);
+}
+
+static double percentile(const vector<double> &sorted, double p)
+{
+    return sorted.empty() ? 0 : sorted[min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+}
+
+static void print_row(const string &workload, const string &path, const vector<double> &latencies, double seconds, size_t count, double hoplinks)
+{
+    cout << left << setw(10) << workload << setw(10) << path << right << setw(9) << count << fixed << setprecision(1)
+        << setw(11) << seconds * 1e9 / max<size_t>(count, 1);
+    if (latencies.empty())
+        cout << setw(10) << "-" << setw(10) << "-" << setw(10) << "-";
+    else
+        cout << setw(10) << percentile(latencies, 0.5) << setw(10) << percentile(latencies, 0.99) << setw(10) << percentile(latencies, 0.999);
+    cout << setw(13) << setprecision(0) << count / seconds << setw(10) << setprecision(1) << hoplinks << defaultfloat << endl;
+}
+
+int main(int argc, char** argv)
+{
+    // optional file receiving metrics in JSON format
+    string metrics_file = util::take_option(argc, argv, "metrics");
+    string bucket_option = util::take_option(argc, argv, "buckets");
+    string bucket_size_option = util::take_option(argc, argv, "bucket-size");
+    string min_dist_option = util::take_option(argc, argv, "min-distance");
+    string uniform_option = util::take_option(argc, argv, "uniform");
+    string seed_option = util::take_option(argc, argv, "seed");
+    string threads_option = util::take_option(argc, argv, "threads");
+    // optional size of result cache in MB, used by scalar and simd paths
+    string cache_option = util::take_option(argc, argv, "cache");
+    bool cold = util::take_flag(argc, argv, "cold");
+    // NUMA placement: interleave label data across nodes, and pin batched query threads to nodes
+    bool interleave = util::take_flag(argc, argv, "interleave");
+    util::numa::set_pinning(util::take_flag(argc, argv, "pin"));
+    if (argc < 3)
+    {
+        cerr << "usage: " << argv[0] << " graph_file index_file [--buckets=10] [--bucket-size=1000] [--min-distance=1000]"
+            << " [--uniform=100000] [--seed=1] [--threads=1] [--cache=MB] [--cold] [--interleave] [--pin] [--metrics=file]" << endl;
+        return 1;
+    }
+    size_t bucket_count = bucket_option.empty() ? 10 : stoul(bucket_option);
+    size_t bucket_size = bucket_size_option.empty() ? 1000 : stoul(bucket_size_option);
+    distance_t min_dist = min_dist_option.empty() ? 1000 : stoul(min_dist_option);
+    size_t uniform_count = uniform_option.empty() ? 100000 : stoul(uniform_option);
+    size_t threads = threads_option.empty() ? 1 : stoul(threads_option);
+    size_t cache_bytes = cache_option.empty() ? 0 : stoul(cache_option) << 20;
+    srand(seed_option.empty() ? 1 : stoul(seed_option));
+
+    Graph g;
+    read_graph(g, argv[1]);
+    // workloads are generated on the graph, which must use the node IDs of the index
+    vector<NodeID> new_id = read_renumbering(string(argv[2]) + string("_id"));
+    if (!new_id.empty())
+        g.renumber(new_id);
+    // workload distances are taken from the graph, which must reflect the deltas merged into a compacted index
+    read_weights(g, string(argv[2]) + string("_w"));
+    string index_file = string(argv[2]) + string("_cl");
+    auto con_index = make_unique<ContractionIndex>(index_file);
+    if (interleave)
+        con_index->interleave_labels();
+    con_index->enable_cache(cache_bytes);
+
+    // workloads are generated from the seed alone, so runs on the same graph and index are comparable
+    vector<Workload> workloads;
+    Workload uniform { "uniform", {} };
+    for (size_t i = 0; i < uniform_count; i++)
+        uniform.queries.push_back(make_pair(g.random_node(), g.random_node()));
+    workloads.push_back(uniform);
+    distance_t diameter = g.diameter(true);
+    if (min_dist_option.empty() && min_dist >= diameter)
+        min_dist = max<distance_t>(1, diameter / 100);
+    if (bucket_count > 0 && min_dist < diameter)
+    {
+        vector<vector<pair<NodeID,NodeID>>> buckets(bucket_count);
+        cout << "generating distance buckets from " << min_dist << " to " << diameter << " ";
+        g.random_pairs(buckets, min_dist, bucket_size, *con_index);
+        cout << endl;
+        for (size_t b = 0; b < bucket_count; b++)
+            workloads.push_back(Workload { string("Q").append(to_string(b + 1)), buckets[b] });
+    }
+    else if (bucket_count > 0)
+        cerr << "minimum distance exceeds diameter, skipping distance buckets" << endl;
+
+    ContractionIndex::use_simd(true);
+    cout << (cold ? "cold" : "warm") << " cache, simd kernel " << ContractionIndex::label_kernel() << ", " << threads << " threads for batched queries"
+        << (util::numa::pinning() ? " (pinned)" : "") << ", " << util::numa::node_count() << " NUMA nodes" << (interleave ? " (labels interleaved)" : "") << endl;
+    cout << left << setw(10) << "workload" << setw(10) << "path" << right << setw(9) << "queries" << setw(11) << "mean_ns"
+        << setw(10) << "p50_ns" << setw(10) << "p99_ns" << setw(10) << "p999_ns" << setw(13) << "queries/s" << setw(10) << "hoplinks" << endl;
+    size_t mismatches = 0;
+    for (const Workload &w : workloads)
+    {
+        double hoplinks = con_index->avg_hoplinks(w.queries);
+        vector<path_t> reference;
+        for (const string path : { "scalar", "simd", "batched" })
+        {
+            if (cold)
+            {
+                con_index.reset();
+                drop_page_cache(index_file);
+                con_index = make_unique<ContractionIndex>(index_file);
+                if (interleave)
+                    con_index->interleave_labels();
+                con_index->enable_cache(cache_bytes);
+            }
+            else
+            {
+                // warm up caches with one untimed pass
+                for (pair<NodeID,NodeID> q : w.queries)
+                    con_index->get_spc(q.first, q.second);
+            }
+            ContractionIndex::use_simd(path != "scalar");
+            vector<path_t> results(w.queries.size());
+            vector<double> latencies;
+            double seconds;
+            if (path == "batched")
+            {
+                util::start_timer();
+                con_index->batch_spc(w.queries, results, threads);
+                seconds = util::stop_timer();
+            }
+            else
+            {
+                latencies.reserve(w.queries.size());
+                util::start_timer();
+                for (size_t i = 0; i < w.queries.size(); i++)
+                {
+                    auto start = chrono::steady_clock::now();
+                    results[i] = con_index->get_spc(w.queries[i].first, w.queries[i].second);
+                    latencies.push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - start).count());
+                }
+                seconds = util::stop_timer();
+                sort(latencies.begin(), latencies.end());
+            }
+            print_row(w.name, path, latencies, seconds, w.queries.size(), hoplinks);
+            // all paths must agree on results
+            if (reference.empty())
+                reference = results;
+            else
+                for (size_t i = 0; i < results.size(); i++)
+                    mismatches += results[i] != reference[i];
+        }
+    }
+    if (mismatches > 0)
+        cerr << mismatches << " query results differ between paths" << endl;
+
+    if (!metrics_file.empty())
+    {
+        ofstream mfs(metrics_file);
+        metrics::write_json(mfs);
+        mfs << endl;
+    }
+    return mismatches > 0;
+}
@@ -3,6 +3,7 @@
 
 #include <iostream>
 #include <cstring>
+#include <fstream>
 
 using namespace std;
 using namespace road_network;
@@ -11,12 +12,19 @@ const size_t MB = 1024 * 1024;
 
 int main(int argc, char** argv)
 {
+    // optional file receiving metrics in JSON format
+    string metrics_file = util::take_option(argc, argv, "metrics");
+    // optionally renumber nodes by partition tree for better memory locality
+    bool renumber_nodes = util::take_flag(argc, argv, "renumber");
+    // optionally write labels in compressed format
+    bool compress = util::take_flag(argc, argv, "compress");
+
+    if (argc > 3)
+        Graph::set_thread_count(stoul(argv[3]));
 
      // read graph
-    ifstream ifs(argv[1]);
     Graph g;
-    read_graph(g, ifs);
-    ifs.close();
+    read_graph(g, argv[1]);
 
     util::start_timer();
     // degree 1 node contraction
@@ -26,6 +34,13 @@ int main(int argc, char** argv)
     // construct index
     vector<CutIndex> ci;
     g.create_cut_index(ci, 0.2);
+    vector<NodeID> new_id;
+    if (renumber_nodes)
+    {
+        new_id = partition_order(ci, closest);
+        renumber(ci, closest, new_id);
+        g.renumber(new_id);
+    }
     g.reset();
 
     ContractionHierarchy ch;
@@ -33,6 +48,11 @@ int main(int argc, char** argv)
     ContractionIndex con_index(ci, closest);
 
     cout << "created index of size " << con_index.size() / MB << " MB in " << util::stop_timer() << "s" << endl;
+    if (compress)
+    {
+        con_index.compress();
+        cout << "compressed index to " << con_index.size() / MB << " MB" << endl;
+    }
 
     // write index
     ofstream ofs(string(argv[2]) + string("_cl"));
@@ -41,6 +61,22 @@ int main(int argc, char** argv)
     ofs.open(string(argv[2]) + string("_gs"));
     ch.write(ofs);
     ofs.close();
+    // renumbering is stored with the index, replacing any left over from a previous index
+    string id_file = string(argv[2]) + string("_id");
+    if (renumber_nodes)
+    {
+        ofs.open(id_file);
+        write_renumbering(ofs, new_id);
+        ofs.close();
+    }
+    else
+        remove(id_file.c_str());
+    if (!metrics_file.empty())
+    {
+        ofstream mfs(metrics_file);
+        metrics::write_json(mfs);
+        mfs << endl;
+    }
 
     return 0;
 }
@@ -8,26 +8,58 @@ using namespace std;
 using namespace road_network;
 
 const size_t nr_queries = 1000000;
+const size_t MB = 1024 * 1024;
 
 int main(int argc, char** argv)
 {
+    // optional file receiving metrics in JSON format
+    string metrics_file = util::take_option(argc, argv, "metrics");
+    // optional delta files applied on top of the index, in the order written
+    vector<string> delta_files = util::split(util::take_option(argc, argv, "deltas"));
 
-    ifstream ifs(string(argv[1]) + string("_cl"));
-    ContractionIndex con_index(ifs);
-    ifs.close();
+    ContractionIndex con_index(string(argv[1]) + string("_cl"));
+    // deltas get applied to decompressed labels, which are compressed again afterwards
+    bool compressed_file = con_index.is_compressed();
+    // node IDs of query file need translating if index was built with renumbered nodes
+    vector<NodeID> new_id = read_renumbering(string(argv[1]) + string("_id"));
+    ifstream ifs;
+    for (const string &file : delta_files)
+    {
+        ifs.open(file);
+        con_index.apply_delta(ifs);
+        ifs.close();
+    }
 
     vector<pair<NodeID, NodeID> > queries; 
     NodeID a, b;
 
     ifs.open(argv[2]);
     while(ifs >> a >> b)
-        queries.push_back(make_pair(a, b));
+        queries.push_back(new_id.empty() ? make_pair(a, b) : make_pair(new_id[a], new_id[b]));
     ifs.close();
 
+    // optional number of query threads
+    size_t threads = argc > 3 ? stoul(argv[3]) : 1;
+    // optionally query compressed labels
+    if (!con_index.is_compressed() && (compressed_file || (argc > 4 && string(argv[4]) == "compress")))
+    {
+        size_t uncompressed_size = con_index.size();
+        con_index.compress();
+        cout << "compressed index from " << uncompressed_size / MB << " MB to " << con_index.size() / MB << " MB" << endl;
+    }
+    vector<path_t> results(queries.size());
+
     util::start_timer();
-    for (pair<NodeID, NodeID> q : queries)
-        con_index.get_spc(q.first, q.second);
-    cout << "ran " << queries.size() << " random queries in " << util::stop_timer() << "s" << endl;
+    con_index.batch_spc(queries, results, threads);
+    double duration = util::stop_timer();
+    cout << "ran " << queries.size() << " random queries in " << duration << "s using " << threads << " threads ("
+        << queries.size() / duration << " queries/s)" << endl;
+    if (!metrics_file.empty())
+    {
+        ofstream mfs(metrics_file);
+        metrics::write_json(mfs);
+        mfs << endl;
+    }
 
     return 0;
 }
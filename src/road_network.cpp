@@ -12,17 +12,31 @@
 #include <thread>
 #include <atomic>
 #include <cstring>
+#include <cstdio>
+#include <tuple>
 #include <random>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+#elif defined(__ARM_NEON)
+    #include <arm_neon.h>
+#endif
 
 using namespace std;
 
 #define DEBUG(X) //cerr << X << endl
 
 // algorithm config
-//#define CUT_REPEAT 3 // repeat whole cut computation multiple times (with random starting points for rough partition) and pick best result
+//#define CUT_REPEAT 3 // repeat whole cut computation multiple times (with random starting points for rough partition, searched in parallel) and pick best result
 #define MULTI_CUT // extract two different min-cuts from max-flow and pick more balanced result
 static const bool weighted_furthest = false; // use edge weights for finding distant nodes during rough partitioning
 static const bool weighted_diff = false; // use edge weights for computing rough partition
+static const size_t BFS_GRAIN = 1024; // minimum number of BFS level nodes expanded per task by parallel BFS
+static const size_t BUCKET_SPLIT = 1024; // label buckets of parallel maintenance with more updates get split by subtree
+static const size_t SPLIT_LEVELS = 3; // split buckets into the subtrees this many levels below the cut of their label
 
 namespace road_network {
 
@@ -30,15 +44,8 @@ static const NodeID NO_NODE = 0; // null value equivalent for integers identifyi
 static const SubgraphID NO_SUBGRAPH = 0; // used to indicate that node does not belong to any active subgraph
 static const uint16_t MAX_CUT_LEVEL = 58; // maximum height of decomposition tree; 58 bits to store binary path, plus 6 bits to store path length = 64 bit integer
 
-// profiling
-#ifndef NPROFILE
-    static atomic<double> t_partition, t_label, t_shortcut;
-    #define START_TIMER util::start_timer()
-    #define STOP_TIMER(var) var += util::stop_timer()
-#else
-    #define START_TIMER
-    #define STOP_TIMER(var)
-#endif
+// persistent pool executing parallel tasks of index construction, maintenance and batched queries
+static util::ThreadPool& thread_pool();
 
 // progress of 0 resets counter
 static bool log_progress_on = false;
@@ -85,7 +92,10 @@ uint16_t get_offset(const uint16_t *dist_index, size_t cut_level)
 
 //--------------------------- CutIndex ------------------------------
 
-CutIndex::CutIndex() : partition(0), cut_level(0)
+// arenas for cut index vectors during index construction, one per thread so construction tasks don't contend
+static util::thread_arena cut_index_arena;
+
+CutIndex::CutIndex() : partition(0), cut_level(0), dist_index(&cut_index_arena), distances(&cut_index_arena), paths(&cut_index_arena)
 {
 #ifdef PRUNING
     pruning_2hop = pruning_3hop = pruning_tail = 0;
@@ -238,30 +248,84 @@ bool is_ancestor(uint64_t bv_ancestor, uint64_t bv_descendant)
 
 // helper function for memory alignment
 template<typename T>
-size_t aligned(size_t size);
-
-template<>
-size_t aligned<uint32_t>(size_t size)
+size_t aligned(size_t size)
 {
-    size_t mod = size & 3ul;
-    return mod ? size + (4 - mod) : size;
+    size_t mod = size % alignof(T);
+    return mod ? size + (alignof(T) - mod) : size;
 }
 
+// labels must be aligned for both distances and path counts
+union LabelAlignment
+{
+    distance_t distance;
+    path_t path_count;
+};
+
 FlatCutIndex::FlatCutIndex() : data(nullptr)
 {
 }
 
-FlatCutIndex::FlatCutIndex(const CutIndex &ci)
+// label storage layout; 0 means distance and path count labels are stored in two separate arrays
+#ifdef LABEL_TILE
+static const size_t label_tile = LABEL_TILE;
+#else
+static const size_t label_tile = 0;
+#endif
+
+// bytes used by one tile (or array pair) holding count distance and path count labels
+static size_t label_block_size(size_t count)
+{
+    return aligned<LabelAlignment>(count * sizeof(distance_t)) + count * sizeof(path_t);
+}
+
+// offset between consecutive tiles
+static size_t label_tile_stride(size_t tile)
+{
+    return aligned<LabelAlignment>(label_block_size(tile));
+}
+
+// number of bytes used for all count labels
+static size_t label_size(size_t count, size_t tile)
+{
+    if (tile == 0)
+        return label_block_size(count);
+    return count / tile * label_tile_stride(tile) + label_block_size(count % tile);
+}
+
+// byte offsets of distance and path count label i (out of count labels), relative to the first distance label;
+// tiled labels are grouped into tiles holding tile distances followed by tile path counts, with the last tile truncated
+static size_t label_distance_offset(size_t i, size_t tile)
+{
+    if (tile == 0)
+        return i * sizeof(distance_t);
+    return i / tile * label_tile_stride(tile) + i % tile * sizeof(distance_t);
+}
+
+static size_t label_paths_offset(size_t i, size_t count, size_t tile)
+{
+    if (tile == 0)
+        return aligned<LabelAlignment>(count * sizeof(distance_t)) + i * sizeof(path_t);
+    size_t tile_start = i - i % tile;
+    return i / tile * label_tile_stride(tile) + aligned<LabelAlignment>(min(tile, count - tile_start) * sizeof(distance_t)) + i % tile * sizeof(path_t);
+}
+
+size_t FlatCutIndex::size(const CutIndex &ci)
+{
+    // partition bitvector, dist_index, paths count and distances
+    return sizeof(uint64_t) + aligned<LabelAlignment>(ci.dist_index.size() * sizeof(uint16_t)) + label_size(ci.distances.size(), label_tile);
+}
+
+FlatCutIndex::FlatCutIndex(const CutIndex &ci, char *data) : data(data)
 {
     assert(ci.is_consistent());
-    // allocate memory for partition bitvector, dist_index, paths count and distances
-    size_t data_size = sizeof(uint64_t) + aligned<distance_t>(ci.dist_index.size() * sizeof(uint16_t)) + ci.distances.size() * sizeof(distance_t) + ci.paths.size() * sizeof(uint16_t);
-    data = (char*)calloc(data_size, 1);
     // copy partition bitvector, dist_index, paths count and distances into data
     *partition_bitvector() = PBV::from(ci.partition, ci.cut_level); 
     memcpy(dist_index(), &ci.dist_index[0], ci.dist_index.size() * sizeof(uint16_t));  
-    memcpy(distances(), &ci.distances[0], ci.distances.size() * sizeof(distance_t)); 
-    memcpy(paths(), &ci.paths[0], ci.paths.size() * sizeof(uint16_t));
+    for (size_t i = 0; i < ci.distances.size(); i++)
+    {
+        distance_at(i) = ci.distances[i];
+        paths_at(i) = ci.paths[i];
+    }
 }
 
 bool FlatCutIndex::operator==(FlatCutIndex other) const
@@ -293,28 +357,52 @@ const uint16_t* FlatCutIndex::dist_index() const
     return (uint16_t*)(data + sizeof(uint64_t));
 }
 
-uint16_t* FlatCutIndex::paths()
+char* FlatCutIndex::labels() const
 {
     assert(!empty());
-    return (uint16_t*) (data + sizeof(uint64_t) + aligned<distance_t>((cut_level() + 1) * sizeof(uint16_t)) + label_count() * sizeof(distance_t));
+    return data + sizeof(uint64_t) + aligned<LabelAlignment>((cut_level() + 1) * sizeof(uint16_t));
 }
 
-const uint16_t* FlatCutIndex::paths() const
+distance_t& FlatCutIndex::distance_at(size_t i)
 {
-    assert(!empty());
-    return (uint16_t*)(data + sizeof(uint64_t) + aligned<distance_t>((cut_level() + 1) * sizeof(uint16_t)) + label_count() * sizeof(distance_t));
+    assert(i < label_count());
+    return *(distance_t*)(labels() + label_distance_offset(i, label_tile));
 }
 
-distance_t* FlatCutIndex::distances()
+const distance_t& FlatCutIndex::distance_at(size_t i) const
 {
-    assert(!empty());
-    return (distance_t*)(data + sizeof(uint64_t) + aligned<distance_t>((cut_level() + 1) * sizeof(uint16_t)));
+    assert(i < label_count());
+    return *(distance_t*)(labels() + label_distance_offset(i, label_tile));
 }
 
-const distance_t* FlatCutIndex::distances() const
+path_t& FlatCutIndex::paths_at(size_t i)
 {
-    assert(!empty());
-    return (distance_t*)(data + sizeof(uint64_t) + aligned<distance_t>((cut_level() + 1) * sizeof(uint16_t)));
+    assert(i < label_count());
+    return *(path_t*)(labels() + label_paths_offset(i, label_count(), label_tile));
+}
+
+const path_t& FlatCutIndex::paths_at(size_t i) const
+{
+    assert(i < label_count());
+    return *(path_t*)(labels() + label_paths_offset(i, label_count(), label_tile));
+}
+
+void FlatCutIndex::convert_layout(size_t from_tile, char *target) const
+{
+    size_t count = label_count(), labels_start = labels() - data;
+    if (from_tile == label_tile)
+    {
+        memcpy(target, data, size());
+        return;
+    }
+    memcpy(target, data, labels_start);
+    FlatCutIndex converted;
+    converted.data = target;
+    for (size_t i = 0; i < count; i++)
+    {
+        converted.distance_at(i) = *(distance_t*)(labels() + label_distance_offset(i, from_tile));
+        converted.paths_at(i) = *(path_t*)(labels() + label_paths_offset(i, count, from_tile));
+    }
 }
 
 uint64_t FlatCutIndex::partition() const
@@ -330,9 +418,8 @@ uint16_t FlatCutIndex::cut_level() const
 size_t FlatCutIndex::size() const
 {
     size_t total = sizeof(uint64_t);
-    total += aligned<distance_t>((cut_level() + 1) * sizeof(uint16_t));
-    total += dist_index()[cut_level()] * sizeof(distance_t);
-    total += dist_index()[cut_level()] * sizeof(uint16_t);
+    total += aligned<LabelAlignment>((cut_level() + 1) * sizeof(uint16_t));
+    total += label_size(label_count(), label_tile);
     return total;
 }
 
@@ -356,54 +443,27 @@ bool FlatCutIndex::empty() const
     return data == nullptr;
 }
 
-const distance_t* FlatCutIndex::cl_begin(size_t cl) const
-{
-    return distances() + get_offset(dist_index(), cl);
-}
-
-const distance_t* FlatCutIndex::cl_end(size_t cl) const
-{
-    return distances() + dist_index()[cl];
-}
-
-const uint16_t* FlatCutIndex::pl_begin(size_t cl) const
-{
-    return paths() + get_offset(dist_index(), cl);
-}
-
-const uint16_t* FlatCutIndex::pl_end(size_t cl) const
-{
-    return paths() + dist_index()[cl];
-}
-
 vector<vector<distance_t> > FlatCutIndex::unflatten() const
 {
     vector<vector<distance_t>> labels;
     for (size_t cl = 0; cl <= cut_level(); cl++)
     {
         vector<distance_t> cut_labels;
-        for (const distance_t *l = cl_begin(cl); l != cl_end(cl); l++)
-            cut_labels.push_back(*l);
+        for (size_t i = get_offset(dist_index(), cl); i < dist_index()[cl]; i++)
+            cut_labels.push_back(distance_at(i));
         labels.push_back(cut_labels);
     }
     return labels;
 }
 
-vector<vector<pair<distance_t, uint16_t> > > FlatCutIndex::unflatten_spc() const
+vector<vector<pair<distance_t, path_t> > > FlatCutIndex::unflatten_spc() const
 {
-    vector<vector<pair<distance_t, uint16_t> > > labels;
+    vector<vector<pair<distance_t, path_t> > > labels;
     for (size_t cl = 0; cl <= cut_level(); cl++)
     {
-        vector<uint16_t> path_labels;
-        for (const uint16_t *l = pl_begin(cl); l != pl_end(cl); l++)
-            path_labels.push_back(*l);
-	vector<distance_t> distance_labels;
-        for (const distance_t *l = cl_begin(cl); l != cl_end(cl); l++)
-            distance_labels.push_back(*l);
-
-	vector<pair<distance_t,uint16_t> > label_pairs;
-	for(size_t i = 0; i < distance_labels.size(); i++)
-            label_pairs.push_back(make_pair(distance_labels[i], path_labels[i]));
+	vector<pair<distance_t,path_t> > label_pairs;
+        for (size_t i = get_offset(dist_index(), cl); i < dist_index()[cl]; i++)
+            label_pairs.push_back(make_pair(distance_at(i), paths_at(i)));
 	labels.push_back(label_pairs);
     }
     return labels;
@@ -424,231 +484,1243 @@ size_t ContractionLabel::size() const
     return total;
 }
 
-//--------------------------- ContractionIndex ----------------------
+//--------------------------- label kernels -------------------------
 
-template<typename T>
-static void clear_and_shrink(vector<T> &v)
+// 2-hop scans over aligned label arrays; the scalar versions serve as reference implementations
+
+// number of labels stored contiguously from label i onwards
+static inline size_t label_run(size_t i)
 {
-    v.clear();
-    v.shrink_to_fit();
+#ifdef LABEL_TILE
+    return LABEL_TILE - i % LABEL_TILE;
+#else
+    return SIZE_MAX - i;
+#endif
 }
 
-ContractionIndex::ContractionIndex(vector<CutIndex> &ci, vector<Neighbor> &closest)
+// fold a single 2-hop candidate into running minimum and shortest-path count
+static inline void add_hop(distance_t d, path_t c, distance_t &min_dist, path_t &spc)
 {
-    assert(ci.size() == closest.size());
-    labels.resize(ci.size());
-    // handle core nodes
-    for (NodeID node = 1; node < closest.size(); node++)
+    if (d < min_dist)
     {
-        if (closest[node].node == node)
-        {
-            assert(closest[node].distance == 0);
-            labels[node].cut_index = FlatCutIndex(ci[node]);
-        }
-        // conserve memory
-        clear_and_shrink(ci[node].dist_index);
-	clear_and_shrink(ci[node].paths);
-        clear_and_shrink(ci[node].distances);
+        min_dist = d;
+        spc = c;
     }
-    // handle periferal nodes
-    for (NodeID node = 1; node < closest.size(); node++)
+    else if (d == min_dist)
+        spc += c;
+}
+
+static distance_t min_distance_scalar(FlatCutIndex a, size_t a_offset, FlatCutIndex b, size_t b_offset, size_t len)
+{
+    distance_t min_dist = infinity;
+    for (size_t i = 0; i < len; i++)
     {
-        Neighbor n = closest[node];
-        // isolated nodes got removed (n.node == NO_NODE)
-        if (n.node != node && n.node != NO_NODE)
-        {
-            assert(n.distance > 0);
-            // find root & distance
-            NodeID root = n.node;
-            distance_t root_dist = n.distance;
-            while (closest[root].node != root)
-            {
-                root_dist += closest[root].distance;
-                root = closest[root].node;
-            }
-            // copy index
-            assert(!labels[root].cut_index.empty());
-            labels[node].cut_index = labels[root].cut_index;
-            labels[node].distance_offset = root_dist;
-            labels[node].parent = n.node;
-        }
+        distance_t dist = a.distance_at(a_offset + i) + b.distance_at(b_offset + i);
+        if (dist < min_dist)
+            min_dist = dist;
     }
-    clear_and_shrink(ci);
-    clear_and_shrink(closest);
+    return min_dist;
 }
 
-ContractionIndex::ContractionIndex(std::vector<CutIndex> &ci)
+static path_t path_count_scalar(FlatCutIndex a, FlatCutIndex b, size_t len, distance_t &min_dist)
 {
-    labels.resize(ci.size());
-    for (NodeID node = 1; node < ci.size(); node++)
-        if (!ci[node].empty())
-        {
-            labels[node].cut_index = FlatCutIndex(ci[node]);
-            // conserve memory
-            clear_and_shrink(ci[node].dist_index);
-	    clear_and_shrink(ci[node].paths);
-            clear_and_shrink(ci[node].distances);
-        }
-    clear_and_shrink(ci);
+    min_dist = infinity;
+    path_t spc = 0;
+    for (size_t i = 0; i < len; i++)
+        add_hop(a.distance_at(i) + b.distance_at(i), a.paths_at(i) * b.paths_at(i), min_dist, spc);
+    return spc;
 }
 
-ContractionIndex::~ContractionIndex()
+// vectorized kernels keep a running minimum and count per lane; lanes are merged at the end using add_hop,
+// which yields the same result as the scalar loop since counts are only ever added and multiplied (mod 2^16 or 2^32);
+// labels are processed in contiguous runs, which cover all labels unless LABEL_TILE is set
+#if PATH_COUNT_BITS <= 32 && !defined(SATURATING_PATHS)
+    #define SIMD_PATH_COUNT // wider or saturating counts don't fit into 32-bit lanes and use scalar counting
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+// load 8 or 16 path counts into 32-bit lanes
+__attribute__((target("avx2")))
+static inline __m256i load_paths_avx2(const path_t *x)
 {
-    for (NodeID node = 1; node < labels.size(); node++)
-        // not all labels own their cut index data
-        if (!labels[node].cut_index.empty() && labels[node].distance_offset == 0)
-            free(labels[node].cut_index.data);
+#if PATH_COUNT_BITS == 16
+    return _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)x));
+#else
+    return _mm256_loadu_si256((const __m256i*)x);
+#endif
 }
 
-distance_t ContractionIndex::get_distance(NodeID v, NodeID w) const
+__attribute__((target("avx512f")))
+static inline __m512i load_paths_avx512(const path_t *x)
 {
-    ContractionLabel cv = labels[v], cw = labels[w];
-    assert(!cv.cut_index.empty() && !cw.cut_index.empty());
-    if (cv.cut_index == cw.cut_index)
+#if PATH_COUNT_BITS == 16
+    return _mm512_maskz_cvtepu16_epi32(0xFFFF, _mm256_loadu_si256((const __m256i*)x));
+#else
+    return _mm512_loadu_si512(x);
+#endif
+}
+
+__attribute__((target("avx2")))
+static distance_t min_distance_avx2(FlatCutIndex fa, size_t a_offset, FlatCutIndex fb, size_t b_offset, size_t len)
+{
+    __m256i v_min = _mm256_set1_epi32(infinity);
+    distance_t min_dist = infinity;
+    for (size_t r = 0, n; r < len; r += n)
     {
-        if (v == w)
-            return 0;
-        if (cv.distance_offset == 0)
-            return cw.distance_offset;
-        if (cw.distance_offset == 0)
-            return cv.distance_offset;
-        if (cv.parent == w)
-            return cv.distance_offset - cw.distance_offset;
-        if (cw.parent == v)
-            return cw.distance_offset - cv.distance_offset;
-        // find lowest common ancestor
-        NodeID v_anc = v, w_anc = w;
-        ContractionLabel cv_anc = cv, cw_anc = cw;
-        while (v_anc != w_anc)
+        // with different offsets, runs in a and b may end at different positions
+        n = min({ label_run(a_offset + r), label_run(b_offset + r), len - r });
+        const distance_t *a = &fa.distance_at(a_offset + r), *b = &fb.distance_at(b_offset + r);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8)
         {
-            if (cv_anc.distance_offset < cw_anc.distance_offset)
-            {
-                w_anc = cw_anc.parent;
-                cw_anc = labels[w_anc];
-            }
-            else if (cv_anc.distance_offset > cw_anc.distance_offset)
-            {
-                v_anc = cv_anc.parent;
-                cv_anc = labels[v_anc];
-            }
-            else
-            {
-                v_anc = cv_anc.parent;
-                w_anc = cw_anc.parent;
-                cv_anc = labels[v_anc];
-                cw_anc = labels[w_anc];
-            }
+            __m256i d = _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(b + i)));
+            v_min = _mm256_min_epu32(v_min, d);
         }
-        return cv.distance_offset + cw.distance_offset - 2 * cv_anc.distance_offset;
+        for (; i < n; i++)
+            min_dist = min(min_dist, a[i] + b[i]);
     }
-    return cv.distance_offset + cw.distance_offset + get_distance(cv.cut_index, cw.cut_index);
+    // reduce lanes
+    __m128i m = _mm_min_epu32(_mm256_castsi256_si128(v_min), _mm256_extracti128_si256(v_min, 1));
+    m = _mm_min_epu32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm_min_epu32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+    return min(min_dist, (distance_t)_mm_cvtsi128_si32(m));
+}
+
+#ifdef SIMD_PATH_COUNT
+__attribute__((target("avx2")))
+static path_t path_count_avx2(FlatCutIndex fa, FlatCutIndex fb, size_t len, distance_t &min_dist)
+{
+    __m256i v_min = _mm256_set1_epi32(infinity);
+    __m256i v_spc = _mm256_setzero_si256();
+    min_dist = infinity;
+    path_t spc = 0;
+    for (size_t r = 0, n; r < len; r += n)
+    {
+        n = min(label_run(r), len - r);
+        const distance_t *a = &fa.distance_at(r), *b = &fb.distance_at(r);
+        const path_t *x = &fa.paths_at(r), *y = &fb.paths_at(r);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256i d = _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(b + i)));
+            __m256i c = _mm256_mullo_epi32(load_paths_avx2(x + i), load_paths_avx2(y + i));
+            __m256i new_min = _mm256_min_epu32(v_min, d);
+            __m256i is_less = _mm256_andnot_si256(_mm256_cmpeq_epi32(new_min, v_min), _mm256_set1_epi32(-1));
+            __m256i is_equal = _mm256_cmpeq_epi32(d, v_min);
+            v_spc = _mm256_blendv_epi8(_mm256_add_epi32(v_spc, _mm256_and_si256(is_equal, c)), c, is_less);
+            v_min = new_min;
+        }
+        for (; i < n; i++)
+            add_hop(a[i] + b[i], x[i] * y[i], min_dist, spc);
+    }
+    alignas(32) uint32_t lane_min[8], lane_spc[8];
+    _mm256_store_si256((__m256i*)lane_min, v_min);
+    _mm256_store_si256((__m256i*)lane_spc, v_spc);
+    for (size_t l = 0; l < 8; l++)
+        add_hop(lane_min[l], lane_spc[l], min_dist, spc);
+    return spc;
 }
+#endif
 
-uint16_t ContractionIndex::get_spc(NodeID v, NodeID w) const
+__attribute__((target("avx512f")))
+static distance_t min_distance_avx512(FlatCutIndex fa, size_t a_offset, FlatCutIndex fb, size_t b_offset, size_t len)
 {
-    ContractionLabel cv = labels[v], cw = labels[w];
-    assert(!cv.cut_index.empty() && !cw.cut_index.empty());
-    if (cv.cut_index == cw.cut_index)
-        return 1;
-    return get_paths(cv.cut_index, cw.cut_index);
+    // full masks avoid gcc warnings about undefined pass-through values in unmasked intrinsics
+    const __mmask16 all = 0xFFFF;
+    __m512i v_min = _mm512_set1_epi32(infinity);
+    for (size_t r = 0, n; r < len; r += n)
+    {
+        n = min({ label_run(a_offset + r), label_run(b_offset + r), len - r });
+        const distance_t *a = &fa.distance_at(a_offset + r), *b = &fb.distance_at(b_offset + r);
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            __m512i d = _mm512_add_epi32(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+            v_min = _mm512_mask_min_epu32(v_min, all, v_min, d);
+        }
+        // masked tail avoids scalar clean-up loop
+        if (i < n)
+        {
+            __mmask16 tail = (1u << (n - i)) - 1;
+            __m512i d = _mm512_add_epi32(_mm512_maskz_loadu_epi32(tail, a + i), _mm512_maskz_loadu_epi32(tail, b + i));
+            v_min = _mm512_mask_min_epu32(v_min, tail, v_min, d);
+        }
+    }
+    alignas(64) uint32_t lane_min[16];
+    _mm512_store_si512(lane_min, v_min);
+    return *min_element(lane_min, lane_min + 16);
 }
 
-size_t ContractionIndex::get_hoplinks(NodeID v, NodeID w) const
+#ifdef SIMD_PATH_COUNT
+__attribute__((target("avx512f")))
+static path_t path_count_avx512(FlatCutIndex fa, FlatCutIndex fb, size_t len, distance_t &min_dist)
 {
-    FlatCutIndex cv = labels[v].cut_index, cw = labels[w].cut_index;
-    if (cv == cw)
-        return 0;
-    return get_hoplinks(cv, cw);
+    const __mmask16 all = 0xFFFF;
+    __m512i v_min = _mm512_set1_epi32(infinity);
+    __m512i v_spc = _mm512_setzero_si512();
+    min_dist = infinity;
+    path_t spc = 0;
+    for (size_t r = 0, n; r < len; r += n)
+    {
+        n = min(label_run(r), len - r);
+        const distance_t *a = &fa.distance_at(r), *b = &fb.distance_at(r);
+        const path_t *x = &fa.paths_at(r), *y = &fb.paths_at(r);
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            __m512i d = _mm512_add_epi32(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+            __m512i c = _mm512_mullo_epi32(load_paths_avx512(x + i), load_paths_avx512(y + i));
+            __mmask16 is_less = _mm512_cmplt_epu32_mask(d, v_min);
+            __mmask16 is_equal = _mm512_cmpeq_epi32_mask(d, v_min);
+            v_spc = _mm512_mask_add_epi32(v_spc, is_equal, v_spc, c);
+            v_spc = _mm512_mask_mov_epi32(v_spc, is_less, c);
+            v_min = _mm512_mask_min_epu32(v_min, all, v_min, d);
+        }
+        for (; i < n; i++)
+            add_hop(a[i] + b[i], x[i] * y[i], min_dist, spc);
+    }
+    alignas(64) uint32_t lane_min[16], lane_spc[16];
+    _mm512_store_si512(lane_min, v_min);
+    _mm512_store_si512(lane_spc, v_spc);
+    for (size_t l = 0; l < 16; l++)
+        add_hop(lane_min[l], lane_spc[l], min_dist, spc);
+    return spc;
+}
+#endif
+#elif defined(__ARM_NEON)
+static distance_t min_distance_neon(FlatCutIndex fa, size_t a_offset, FlatCutIndex fb, size_t b_offset, size_t len)
+{
+    uint32x4_t v_min = vdupq_n_u32(infinity);
+    distance_t min_dist = infinity;
+    for (size_t r = 0, n; r < len; r += n)
+    {
+        n = min({ label_run(a_offset + r), label_run(b_offset + r), len - r });
+        const distance_t *a = &fa.distance_at(a_offset + r), *b = &fb.distance_at(b_offset + r);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+            v_min = vminq_u32(v_min, vaddq_u32(vld1q_u32(a + i), vld1q_u32(b + i)));
+        for (; i < n; i++)
+            min_dist = min(min_dist, a[i] + b[i]);
+    }
+    return min(min_dist, (distance_t)vminvq_u32(v_min));
 }
 
-double ContractionIndex::avg_hoplinks(const std::vector<std::pair<NodeID,NodeID>> &queries) const
+#ifdef SIMD_PATH_COUNT
+// load 4 path counts into 32-bit lanes
+static inline uint32x4_t load_paths_neon(const path_t *x)
 {
-    size_t hop_count = 0;
-    for (pair<NodeID,NodeID> q : queries)
-        hop_count += get_hoplinks(q.first, q.second);
-    return hop_count / (double)queries.size();
+#if PATH_COUNT_BITS == 16
+    return vmovl_u16(vld1_u16(x));
+#else
+    return vld1q_u32(x);
+#endif
 }
 
-distance_t ContractionIndex::get_cut_level_distance(FlatCutIndex a, FlatCutIndex b, size_t cut_level)
+static path_t path_count_neon(FlatCutIndex fa, FlatCutIndex fb, size_t len, distance_t &min_dist)
 {
-    distance_t min_dist = infinity;
-    uint16_t a_offset = get_offset(a.dist_index(), cut_level);
-    uint16_t b_offset = get_offset(b.dist_index(), cut_level);
-    const distance_t* a_ptr = a.distances() + a_offset;
-    const distance_t* b_ptr = b.distances() + b_offset;
-    const distance_t* a_end = a_ptr + min(a.dist_index()[cut_level] - a_offset, b.dist_index()[cut_level] - b_offset);
-    // find min 2-hop distance within partition
-    while (a_ptr != a_end)
+    uint32x4_t v_min = vdupq_n_u32(infinity);
+    uint32x4_t v_spc = vdupq_n_u32(0);
+    min_dist = infinity;
+    path_t spc = 0;
+    for (size_t r = 0, n; r < len; r += n)
     {
-        distance_t dist = *a_ptr + *b_ptr;
-        if (dist < min_dist)
-            min_dist = dist;
-        a_ptr++;
-        b_ptr++;
+        n = min(label_run(r), len - r);
+        const distance_t *a = &fa.distance_at(r), *b = &fb.distance_at(r);
+        const path_t *x = &fa.paths_at(r), *y = &fb.paths_at(r);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            uint32x4_t d = vaddq_u32(vld1q_u32(a + i), vld1q_u32(b + i));
+            uint32x4_t c = vmulq_u32(load_paths_neon(x + i), load_paths_neon(y + i));
+            uint32x4_t is_less = vcltq_u32(d, v_min);
+            uint32x4_t is_equal = vceqq_u32(d, v_min);
+            v_spc = vbslq_u32(is_less, c, vaddq_u32(v_spc, vandq_u32(is_equal, c)));
+            v_min = vminq_u32(v_min, d);
+        }
+        for (; i < n; i++)
+            add_hop(a[i] + b[i], x[i] * y[i], min_dist, spc);
     }
-    return min_dist;
+    uint32_t lane_min[4], lane_spc[4];
+    vst1q_u32(lane_min, v_min);
+    vst1q_u32(lane_spc, v_spc);
+    for (size_t l = 0; l < 4; l++)
+        add_hop(lane_min[l], lane_spc[l], min_dist, spc);
+    return spc;
 }
+#endif
+#endif
 
-size_t ContractionIndex::get_cut_level_hoplinks(FlatCutIndex a, FlatCutIndex b, size_t cut_level)
+struct LabelKernels
 {
-    return min(a.cut_size(cut_level), b.cut_size(cut_level));
-}
+    const char *name;
+    distance_t (*min_distance)(FlatCutIndex a, size_t a_offset, FlatCutIndex b, size_t b_offset, size_t len);
+    // also returns minimum 2-hop distance
+    path_t (*path_count)(FlatCutIndex a, FlatCutIndex b, size_t len, distance_t &min_dist);
+};
 
-distance_t ContractionIndex::get_distance(FlatCutIndex a, FlatCutIndex b)
+static const LabelKernels scalar_kernels = { "scalar", min_distance_scalar, path_count_scalar };
+
+// pick fastest kernels supported by CPU
+static LabelKernels simd_kernels()
 {
-    // find lowest level at which partitions differ
-    size_t cut_level = PBV::lca_level(*a.partition_bitvector(), *b.partition_bitvector());
-#ifdef NO_SHORTCUTS
-    distance_t min_dist = infinity;
-#ifdef PRUNING
-    for (size_t cl = 0; cl <= cut_level; cl++)
-        min_dist = min(min_dist, get_cut_level_distance(a, b, cl));
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+#ifdef SIMD_PATH_COUNT
+    if (__builtin_cpu_supports("avx512f"))
+        return { "avx512", min_distance_avx512, path_count_avx512 };
+    if (__builtin_cpu_supports("avx2"))
+        return { "avx2", min_distance_avx2, path_count_avx2 };
 #else
-    // no pruning means we have a continuous block to check
-    const distance_t* a_ptr = a.distances();
-    const distance_t* b_ptr = b.distances();
-    const distance_t* a_end = a_ptr + min(a.dist_index()[cut_level], b.dist_index()[cut_level]);
-    while (a_ptr != a_end)
-    {
-        distance_t dist = *a_ptr + *b_ptr;
-        if (dist < min_dist)
-            min_dist = dist;
-        a_ptr++;
-        b_ptr++;
-    }
+    if (__builtin_cpu_supports("avx512f"))
+        return { "avx512", min_distance_avx512, path_count_scalar };
+    if (__builtin_cpu_supports("avx2"))
+        return { "avx2", min_distance_avx2, path_count_scalar };
 #endif
-    return min_dist;
+#elif defined(__ARM_NEON)
+#ifdef SIMD_PATH_COUNT
+    return { "neon", min_distance_neon, path_count_neon };
 #else
-    return get_cut_level_distance(a, b, cut_level);
+    return { "neon", min_distance_neon, path_count_scalar };
+#endif
 #endif
+    return scalar_kernels;
 }
 
-uint16_t ContractionIndex::get_paths(FlatCutIndex a, FlatCutIndex b)
+static LabelKernels label_kernels = simd_kernels();
+
+void ContractionIndex::use_simd(bool state)
 {
-    // find lowest level at which partitions differ
+    label_kernels = state ? simd_kernels() : scalar_kernels;
+}
+
+const char* ContractionIndex::label_kernel()
+{
+    return label_kernels.name;
+}
+
+//--------------------------- ContractionIndex ----------------------
+
+template<typename T, typename Alloc>
+static void clear_and_shrink(vector<T, Alloc> &v)
+{
+    v.clear();
+    v.shrink_to_fit();
+}
+
+// direct-mapped table of query results, keyed by the (unordered) pair of label-owning nodes, so queries between nodes
+// contracted into the same roots share entries; entries are guarded by one of several mutexes
+struct ContractionIndex::ResultCache
+{
+    struct Entry
+    {
+        NodeID v = NO_NODE, w = NO_NODE;
+        uint32_t epoch = 0; // epoch during which result was computed or last found valid
+        uint16_t prefix = 0; // number of labels examined
+        distance_t distance = 0;
+        path_t paths = 0;
+    };
+    static const size_t shard_count = 64;
+    // epochs are stored in 24 bits; once exhausted, all entries and changes are cleared
+    static const uint32_t max_epoch = (1u << 24) - 1;
+
+    CacheInvalidation mode;
+    std::vector<Entry> entries;
+    int shift;
+    std::array<std::mutex, shard_count> shards; // entry i is guarded by shards[i % shard_count]
+    // label-owning node of each node
+    std::vector<NodeID> roots;
+    // per label-owning node: last epoch in which labels changed (24 bits), previous such epoch (24 bits) and lowest
+    // label changed in last epoch (16 bits), accessed atomically
+    std::vector<uint64_t> changes;
+    uint32_t epoch = 1;
+    uint32_t valid_from = 1; // entries from earlier epochs are invalid
+
+    ResultCache(size_t bytes, CacheInvalidation mode, std::vector<NodeID> &&roots);
+    size_t index(NodeID v, NodeID w) const;
+    // whether labels examined by entry are unchanged since it was computed
+    bool is_valid(const Entry &e) const;
+    bool lookup(NodeID v, NodeID w, edata_t &result);
+    void insert(NodeID v, NodeID w, uint16_t prefix, edata_t result);
+    void record_change(NodeID v, uint16_t slot);
+    void next_epoch();
+};
+
+ContractionIndex::ResultCache::ResultCache(size_t bytes, CacheInvalidation mode, vector<NodeID> &&roots)
+    : mode(mode), roots(std::move(roots))
+{
+    // round entry count down to power of two, with at least one entry per shard
+    size_t count = bit_floor(max(bytes / sizeof(Entry), shard_count));
+    entries.resize(count);
+    shift = 64 - countr_zero(count);
+    if (mode == CacheInvalidation::precise)
+        changes.assign(this->roots.size(), 0);
+}
+
+size_t ContractionIndex::ResultCache::index(NodeID v, NodeID w) const
+{
+    // Fibonacci hashing
+    return (((uint64_t)v << 32 | w) * 0x9e3779b97f4a7c15ull) >> shift;
+}
+
+bool ContractionIndex::ResultCache::is_valid(const Entry &e) const
+{
+    if (e.epoch < valid_from)
+        return false;
+    if (mode == CacheInvalidation::epoch)
+        return true;
+    for (NodeID node : { e.v, e.w })
+    {
+        uint64_t c = atomic_ref<uint64_t>(const_cast<uint64_t&>(changes[node])).load(memory_order_relaxed);
+        uint32_t last = c >> 40, previous = (c >> 16) & max_epoch;
+        uint16_t lowest = c & 0xffff;
+        // valid if no changes since entry was computed, or only changes in one epoch not affecting examined labels
+        if (last > e.epoch && (previous > e.epoch || lowest < e.prefix))
+            return false;
+    }
+    return true;
+}
+
+bool ContractionIndex::ResultCache::lookup(NodeID v, NodeID w, edata_t &result)
+{
+    size_t i = index(v, w);
+    lock_guard<mutex> lock(shards[i % shard_count]);
+    Entry &e = entries[i];
+    if (e.v != v || e.w != w || !is_valid(e))
+        return false;
+    // entry is known to be valid now, so only later changes matter
+    e.epoch = epoch;
+    result = make_pair(e.distance, e.paths);
+    return true;
+}
+
+void ContractionIndex::ResultCache::insert(NodeID v, NodeID w, uint16_t prefix, edata_t result)
+{
+    size_t i = index(v, w);
+    lock_guard<mutex> lock(shards[i % shard_count]);
+    entries[i] = { v, w, epoch, prefix, result.first, result.second };
+}
+
+void ContractionIndex::ResultCache::record_change(NodeID v, uint16_t slot)
+{
+    if (mode == CacheInvalidation::epoch)
+        return;
+    atomic_ref<uint64_t> c(changes[roots[v]]);
+    uint64_t current = c.load(memory_order_relaxed), updated;
+    do
+    {
+        uint32_t last = current >> 40;
+        if (last == epoch)
+        {
+            if ((current & 0xffff) <= slot)
+                return;
+            updated = (current & ~0xffffull) | slot;
+        }
+        else
+            updated = (uint64_t)epoch << 40 | (uint64_t)last << 16 | slot;
+    } while (!c.compare_exchange_weak(current, updated, memory_order_relaxed));
+}
+
+void ContractionIndex::ResultCache::next_epoch()
+{
+    epoch++;
+    if (epoch == max_epoch)
+    {
+        for (Entry &e : entries)
+            e = Entry();
+        fill(changes.begin(), changes.end(), 0);
+        epoch = valid_from = 1;
+    }
+    if (mode == CacheInvalidation::epoch)
+        valid_from = epoch;
+}
+
+void ContractionIndex::enable_cache(size_t bytes, CacheInvalidation mode)
+{
+    if (bytes == 0)
+    {
+        cache.reset();
+        return;
+    }
+    vector<NodeID> roots(labels.size(), NO_NODE);
+    for (NodeID node = 1; node < labels.size(); node++)
+    {
+        NodeID root = node;
+        while (labels[root].distance_offset != 0)
+            root = labels[root].parent;
+        roots[node] = root;
+    }
+    cache = make_unique<ResultCache>(bytes, mode, std::move(roots));
+}
+
+void ContractionIndex::next_epoch()
+{
+    if (cache)
+        cache->next_epoch();
+}
+
+edata_t ContractionIndex::cached_query(NodeID v, NodeID w, FlatCutIndex a, FlatCutIndex b) const
+{
+    NodeID rv = cache->roots[v], rw = cache->roots[w];
+    if (rv > rw)
+    {
+        swap(rv, rw);
+        swap(a, b);
+    }
+    edata_t result;
+    if (cache->lookup(rv, rw, result))
+    {
+        metrics::add(metrics::Counter::cache_hits);
+        return result;
+    }
+    metrics::add(metrics::Counter::cache_misses);
+    size_t cut_level = PBV::lca_level(*a.partition_bitvector(), *b.partition_bitvector());
+    uint16_t prefix = min(a.dist_index()[cut_level], b.dist_index()[cut_level]);
+    if (compressed)
+        decompress_labels(a, b);
+    result.second = get_paths(a, b, result.first);
+    cache->insert(rv, rw, prefix, result);
+    return result;
+}
+
+// sort key ordering cut indexes by partition tree (pre-order)
+static uint64_t partition_tree_key(const CutIndex &ci)
+{
+    uint64_t path = 0;
+    for (uint8_t level = 0; level < ci.cut_level; level++)
+        if (ci.partition & (static_cast<uint64_t>(1) << level))
+            path |= static_cast<uint64_t>(1) << (63 - level);
+    // cut vertices precede nodes lower in the tree with the same path prefix
+    return path | ci.cut_level;
+}
+
+void ContractionIndex::flatten_labels(vector<CutIndex> &ci)
+{
+    // order blocks by partition tree (pre-order), so labels of nearby nodes are close in memory
+    vector<pair<uint64_t, NodeID>> order;
+    label_data_size = 0;
+    for (NodeID node = 1; node < ci.size(); node++)
+        if (!ci[node].empty())
+        {
+            order.push_back(pair(partition_tree_key(ci[node]), node));
+            label_data_size += aligned<uint64_t>(FlatCutIndex::size(ci[node]));
+        }
+    sort(order.begin(), order.end());
+    label_data = label_data_size == 0 ? nullptr : (char*)calloc(label_data_size, 1);
+    char *next = label_data;
+    for (auto [path, node] : order)
+    {
+        labels[node].cut_index = FlatCutIndex(ci[node], next);
+        next += aligned<uint64_t>(FlatCutIndex::size(ci[node]));
+        // conserve memory
+        clear_and_shrink(ci[node].dist_index);
+        clear_and_shrink(ci[node].paths);
+        clear_and_shrink(ci[node].distances);
+    }
+}
+
+ContractionIndex::ContractionIndex(vector<CutIndex> &ci, vector<Neighbor> &closest)
+{
+    assert(ci.size() == closest.size());
+    labels.resize(ci.size());
+    // handle core nodes
+    for (NodeID node = 1; node < closest.size(); node++)
+        if (closest[node].node != node)
+        {
+            // conserve memory
+            clear_and_shrink(ci[node].dist_index);
+            clear_and_shrink(ci[node].paths);
+            clear_and_shrink(ci[node].distances);
+        }
+        else
+            assert(closest[node].distance == 0);
+    flatten_labels(ci);
+    // handle periferal nodes
+    for (NodeID node = 1; node < closest.size(); node++)
+    {
+        Neighbor n = closest[node];
+        // isolated nodes got removed (n.node == NO_NODE)
+        if (n.node != node && n.node != NO_NODE)
+        {
+            assert(n.distance > 0);
+            // find root & distance
+            NodeID root = n.node;
+            distance_t root_dist = n.distance;
+            while (closest[root].node != root)
+            {
+                root_dist += closest[root].distance;
+                root = closest[root].node;
+            }
+            // copy index
+            assert(!labels[root].cut_index.empty());
+            labels[node].cut_index = labels[root].cut_index;
+            labels[node].distance_offset = root_dist;
+            labels[node].parent = n.node;
+        }
+    }
+    clear_and_shrink(ci);
+    clear_and_shrink(closest);
+}
+
+ContractionIndex::ContractionIndex(std::vector<CutIndex> &ci)
+{
+    labels.resize(ci.size());
+    flatten_labels(ci);
+    clear_and_shrink(ci);
+}
+
+ContractionIndex::ContractionIndex(const ContractionIndex *other) : labels(other->labels), label_data(other->label_data),
+    label_data_size(other->label_data_size), label_data_mapped(other->label_data_mapped), owns_blocks(false)
+{
+}
+
+ContractionIndex::~ContractionIndex()
+{
+    clear_saved();
+    if (!owns_blocks)
+        return;
+    // blocks copied on write live outside label_data
+    for (NodeID node = 1; node < labels.size(); node++)
+        // not all labels own their cut index data
+        if (!labels[node].cut_index.empty() && labels[node].distance_offset == 0 && owns_block(labels[node].cut_index.data))
+            free(labels[node].cut_index.data);
+    if (label_data_mapped)
+        munmap(label_data, label_data_size);
+    else if (label_data != nullptr)
+        free(label_data);
+}
+
+bool ContractionIndex::owns_block(const char* data) const
+{
+    return data < label_data || data >= label_data + label_data_size;
+}
+
+void ContractionIndex::index_trees()
+{
+    // find root of each contracted node
+    vector<NodeID> roots(labels.size(), NO_NODE);
+    tree_offsets.assign(labels.size() + 1, 0);
+    for (NodeID node = 1; node < labels.size(); node++)
+        if (is_contracted(node))
+        {
+            NodeID root = labels[node].parent;
+            while (is_contracted(root))
+                root = labels[root].parent;
+            roots[node] = root;
+            tree_offsets[root + 1]++;
+        }
+    for (NodeID node = 0; node < labels.size(); node++)
+        tree_offsets[node + 1] += tree_offsets[node];
+    tree_nodes.resize(tree_offsets.back());
+    vector<size_t> next(tree_offsets.begin(), tree_offsets.end() - 1);
+    for (NodeID node = 1; node < labels.size(); node++)
+        if (roots[node] != NO_NODE)
+            tree_nodes[next[roots[node]]++] = node;
+    block_copied.assign(labels.size(), 0);
+}
+
+void ContractionIndex::catch_up(ContractionIndex &source)
+{
+    // labels change without passing through get_mutable_cut_index, so cached results are invalidated here
+    if (cache && !source.changed_nodes.empty())
+        cache->next_epoch();
+    for (NodeID node : source.changed_nodes)
+    {
+        char* replaced = labels[node].cut_index.data;
+        if (cache && !is_contracted(node) && replaced != source.labels[node].cut_index.data)
+        {
+            // copies keep the block layout, so the lowest changed slot can be found by comparison
+            FlatCutIndex original, current = source.labels[node].cut_index;
+            original.data = replaced;
+            uint16_t slot = 0;
+            while (slot < current.label_count() && current.distance_at(slot) == original.distance_at(slot)
+                && current.paths_at(slot) == original.paths_at(slot))
+                slot++;
+            if (slot < current.label_count())
+                cache->record_change(node, slot);
+        }
+        labels[node] = source.labels[node];
+        // roots appear once per block copy
+        if (!is_contracted(node) && replaced != labels[node].cut_index.data && owns_block(replaced))
+            free(replaced);
+        source.block_copied[node] = 0;
+    }
+    source.changed_nodes.clear();
+}
+
+distance_t ContractionIndex::get_distance(NodeID v, NodeID w) const
+{
+    ContractionLabel cv = labels[v], cw = labels[w];
+    assert(!cv.cut_index.empty() && !cw.cut_index.empty());
+    if (cv.cut_index == cw.cut_index)
+    {
+        if (v == w)
+            return 0;
+        if (cv.distance_offset == 0)
+            return cw.distance_offset;
+        if (cw.distance_offset == 0)
+            return cv.distance_offset;
+        if (cv.parent == w)
+            return cv.distance_offset - cw.distance_offset;
+        if (cw.parent == v)
+            return cw.distance_offset - cv.distance_offset;
+        // find lowest common ancestor
+        NodeID v_anc = v, w_anc = w;
+        ContractionLabel cv_anc = cv, cw_anc = cw;
+        while (v_anc != w_anc)
+        {
+            if (cv_anc.distance_offset < cw_anc.distance_offset)
+            {
+                w_anc = cw_anc.parent;
+                cw_anc = labels[w_anc];
+            }
+            else if (cv_anc.distance_offset > cw_anc.distance_offset)
+            {
+                v_anc = cv_anc.parent;
+                cv_anc = labels[v_anc];
+            }
+            else
+            {
+                v_anc = cv_anc.parent;
+                w_anc = cw_anc.parent;
+                cv_anc = labels[v_anc];
+                cw_anc = labels[w_anc];
+            }
+        }
+        return cv.distance_offset + cw.distance_offset - 2 * cv_anc.distance_offset;
+    }
+    if (cache)
+        return cv.distance_offset + cw.distance_offset + cached_query(v, w, cv.cut_index, cw.cut_index).first;
+    if (compressed)
+        decompress_labels(cv.cut_index, cw.cut_index);
+    return cv.distance_offset + cw.distance_offset + get_distance(cv.cut_index, cw.cut_index);
+}
+
+path_t ContractionIndex::get_spc(NodeID v, NodeID w) const
+{
+    ContractionLabel cv = labels[v], cw = labels[w];
+    assert(!cv.cut_index.empty() && !cw.cut_index.empty());
+    if (cv.cut_index == cw.cut_index)
+        return 1;
+    if (cache)
+        return cached_query(v, w, cv.cut_index, cw.cut_index).second;
+    if (compressed)
+        decompress_labels(cv.cut_index, cw.cut_index);
+    return get_paths(cv.cut_index, cw.cut_index);
+}
+
+edata_t ContractionIndex::get_distance_spc(NodeID v, NodeID w) const
+{
+    ContractionLabel cv = labels[v], cw = labels[w];
+    assert(!cv.cut_index.empty() && !cw.cut_index.empty());
+    if (cv.cut_index == cw.cut_index)
+        return edata_t(get_distance(v, w), 1);
+    edata_t result;
+    if (cache)
+        result = cached_query(v, w, cv.cut_index, cw.cut_index);
+    else
+    {
+        if (compressed)
+            decompress_labels(cv.cut_index, cw.cut_index);
+        result.second = get_paths(cv.cut_index, cw.cut_index, result.first);
+    }
+    result.first += cv.distance_offset + cw.distance_offset;
+    return result;
+}
+
+void ContractionIndex::batch_spc(span<const pair<NodeID,NodeID>> queries, span<path_t> paths, size_t threads, span<distance_t> distances) const
+{
+    assert(paths.size() == queries.size() && (distances.empty() || distances.size() == queries.size()));
+    assert(queries.size() <= UINT32_MAX);
+    // sort query indices by source node, packed into a single key for faster sorting
+    vector<uint64_t> order(queries.size());
+    for (size_t i = 0; i < queries.size(); i++)
+        order[i] = (uint64_t)queries[i].first << 32 | i;
+    sort(order.begin(), order.end());
+    metrics::PhaseTimer timer(metrics::Phase::batch_spc);
+    // threads repeatedly grab the next chunk of sorted queries
+    const size_t chunk_size = 1024;
+    // time only every so many queries, keeping overhead of clock reads small
+    const size_t latency_sample = 16;
+    atomic<size_t> next_chunk = 0;
+    auto answer_queries = [&]() {
+        metrics::Tally tally;
+        for (size_t begin = next_chunk.fetch_add(chunk_size); begin < order.size(); begin = next_chunk.fetch_add(chunk_size))
+        {
+            size_t end = min(begin + chunk_size, order.size());
+            for (size_t k = begin; k < end; k++)
+            {
+                size_t i = order[k] & UINT32_MAX;
+                bool timed = k % latency_sample == 0;
+                chrono::steady_clock::time_point start;
+                if (timed)
+                    start = chrono::steady_clock::now();
+                // distance and path count come from a single scan over both labels
+                if (distances.empty())
+                    paths[i] = get_spc(queries[i].first, queries[i].second);
+                else
+                {
+                    edata_t result = get_distance_spc(queries[i].first, queries[i].second);
+                    distances[i] = result.first;
+                    paths[i] = result.second;
+                }
+                if (timed)
+                {
+                    metrics::record(metrics::Histogram::query_latency, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+                    // hoplinks are counted for timed queries only, scaled to estimate the total
+                    tally[metrics::Counter::hoplinks] += latency_sample * get_hoplinks(queries[i].first, queries[i].second);
+                }
+            }
+            tally[metrics::Counter::queries] += end - begin;
+        }
+    };
+    if (threads <= 1)
+    {
+        answer_queries();
+        return;
+    }
+    // workers of the pool are pinned to NUMA nodes when they start, if pinning is enabled
+    util::ThreadPool::TaskGroup group;
+    for (size_t t = 0; t < threads; t++)
+        thread_pool().run(group, answer_queries);
+    thread_pool().wait(group);
+}
+
+void ContractionIndex::spc_table(span<const NodeID> sources, span<const NodeID> targets, span<path_t> paths, size_t threads, span<distance_t> distances) const
+{
+    assert(paths.size() == sources.size() * targets.size() && (distances.empty() || distances.size() == paths.size()));
+    // table is computed in tiles, so target labels get re-used from cache across all sources of a tile
+    const size_t tile_rows = 16, tile_columns = 64;
+    const size_t row_tiles = (sources.size() + tile_rows - 1) / tile_rows;
+    const size_t column_tiles = (targets.size() + tile_columns - 1) / tile_columns;
+    atomic<size_t> next_tile = 0;
+    auto compute_tiles = [&]() {
+        for (size_t tile = next_tile++; tile < row_tiles * column_tiles; tile = next_tile++)
+        {
+            size_t row_begin = tile / column_tiles * tile_rows, row_end = min(row_begin + tile_rows, sources.size());
+            size_t column_begin = tile % column_tiles * tile_columns, column_end = min(column_begin + tile_columns, targets.size());
+            for (size_t row = row_begin; row < row_end; row++)
+            {
+                ContractionLabel cv = labels[sources[row]];
+                assert(!cv.cut_index.empty());
+                for (size_t column = column_begin; column < column_end; column++)
+                {
+                    size_t cell = row * targets.size() + column;
+                    ContractionLabel cw = labels[targets[column]];
+                    assert(!cw.cut_index.empty());
+                    if (cv.cut_index == cw.cut_index)
+                    {
+                        // nodes within the same contracted tree are connected by a single path
+                        paths[cell] = 1;
+                        if (!distances.empty())
+                            distances[cell] = get_distance(sources[row], targets[column]);
+                    }
+                    else
+                    {
+                        FlatCutIndex a = cv.cut_index, b = cw.cut_index;
+                        if (compressed)
+                            decompress_labels(a, b);
+                        if (distances.empty())
+                            paths[cell] = get_paths(a, b);
+                        else
+                        {
+                            distance_t distance;
+                            paths[cell] = get_paths(a, b, distance);
+                            distances[cell] = cv.distance_offset + cw.distance_offset + distance;
+                        }
+                    }
+                }
+            }
+        }
+    };
+    if (threads <= 1)
+    {
+        compute_tiles();
+        return;
+    }
+    util::ThreadPool::TaskGroup group;
+    for (size_t t = 0; t < threads; t++)
+        thread_pool().run(group, compute_tiles);
+    thread_pool().wait(group);
+}
+
+void ContractionIndex::spc_table(NodeID source, span<const NodeID> targets, span<path_t> paths, span<distance_t> distances) const
+{
+    spc_table(span<const NodeID>(&source, 1), targets, paths, 1, distances);
+}
+
+size_t ContractionIndex::get_hoplinks(NodeID v, NodeID w) const
+{
+    FlatCutIndex cv = labels[v].cut_index, cw = labels[w].cut_index;
+    if (cv == cw)
+        return 0;
+    return get_hoplinks(cv, cw);
+}
+
+double ContractionIndex::avg_hoplinks(const std::vector<std::pair<NodeID,NodeID>> &queries) const
+{
+    size_t hop_count = 0;
+    for (pair<NodeID,NodeID> q : queries)
+        hop_count += get_hoplinks(q.first, q.second);
+    return hop_count / (double)queries.size();
+}
+
+distance_t ContractionIndex::get_cut_level_distance(FlatCutIndex a, FlatCutIndex b, size_t cut_level)
+{
+    uint16_t a_offset = get_offset(a.dist_index(), cut_level);
+    uint16_t b_offset = get_offset(b.dist_index(), cut_level);
+    // find min 2-hop distance within partition
+    return label_kernels.min_distance(a, a_offset, b, b_offset, min(a.dist_index()[cut_level] - a_offset, b.dist_index()[cut_level] - b_offset));
+}
+
+size_t ContractionIndex::get_cut_level_hoplinks(FlatCutIndex a, FlatCutIndex b, size_t cut_level)
+{
+    return min(a.cut_size(cut_level), b.cut_size(cut_level));
+}
+
+distance_t ContractionIndex::get_distance(FlatCutIndex a, FlatCutIndex b)
+{
+    // find lowest level at which partitions differ
+    size_t cut_level = PBV::lca_level(*a.partition_bitvector(), *b.partition_bitvector());
+#ifdef NO_SHORTCUTS
+    distance_t min_dist = infinity;
+#ifdef PRUNING
+    for (size_t cl = 0; cl <= cut_level; cl++)
+        min_dist = min(min_dist, get_cut_level_distance(a, b, cl));
+#else
+    // no pruning means we have a continuous block to check
+    min_dist = label_kernels.min_distance(a, 0, b, 0, min(a.dist_index()[cut_level], b.dist_index()[cut_level]));
+#endif
+    return min_dist;
+#else
+    return get_cut_level_distance(a, b, cut_level);
+#endif
+}
+
+path_t ContractionIndex::get_paths(FlatCutIndex a, FlatCutIndex b)
+{
+    // find lowest level at which partitions differ
     size_t cut_level = PBV::lca_level(*a.partition_bitvector(), *b.partition_bitvector());
+    distance_t distance;
+    return label_kernels.path_count(a, b, min(a.dist_index()[cut_level], b.dist_index()[cut_level]), distance);
+}
+
+path_t ContractionIndex::get_paths(FlatCutIndex a, FlatCutIndex b, distance_t &distance)
+{
+    size_t cut_level = PBV::lca_level(*a.partition_bitvector(), *b.partition_bitvector());
+    path_t paths = label_kernels.path_count(a, b, min(a.dist_index()[cut_level], b.dist_index()[cut_level]), distance);
+#if !defined(NO_SHORTCUTS) || defined(PRUNING)
+    // distance computation examines different labels
+    distance = get_distance(a, b);
+#endif
+    return paths;
+}
+
+// compressed label blocks keep partition bitvector and dist_index in place, followed by the base distance of each
+// cut level, a width byte per cut level (low nibble: bytes per distance delta, high nibble: bytes per path count,
+// where 0 means all counts are 1), and finally the deltas and path counts of each cut level, without padding
+static size_t compressed_prefix_size(size_t cut_level)
+{
+    return sizeof(uint64_t) + aligned<LabelAlignment>((cut_level + 1) * sizeof(uint16_t));
+}
+
+// smallest of 0, 1, 2, 4 and 8 bytes able to store value
+static uint8_t byte_width(uint64_t value)
+{
+    if (value == 0)
+        return 0;
+    if (value <= UINT8_MAX)
+        return 1;
+    if (value <= UINT16_MAX)
+        return 2;
+    return value <= UINT32_MAX ? 4 : 8;
+}
+
+// compute base and widths of labels at given cut level
+static uint8_t level_widths(FlatCutIndex ci, size_t cl, distance_t &base)
+{
+    size_t begin = get_offset(ci.dist_index(), cl), end = ci.dist_index()[cl];
+    distance_t max_dist = 0;
+    path_base_t max_paths = 0;
+    bool unit_paths = true;
+    base = begin < end ? infinity : 0;
+    for (size_t i = begin; i < end; i++)
+    {
+        base = min(base, ci.distance_at(i));
+        max_dist = max(max_dist, ci.distance_at(i));
+        path_base_t paths = static_cast<path_base_t>(ci.paths_at(i));
+        max_paths = max(max_paths, paths);
+        unit_paths &= paths == 1;
+    }
+    uint8_t path_width = unit_paths ? 0 : max<uint8_t>(1, byte_width(max_paths));
+    return byte_width(max_dist - base) | path_width << 4;
+}
+
+static void store_value(char *target, uint64_t value, uint8_t width)
+{
+    switch (width)
+    {
+        case 1: { uint8_t v = value; memcpy(target, &v, 1); break; }
+        case 2: { uint16_t v = value; memcpy(target, &v, 2); break; }
+        case 4: { uint32_t v = value; memcpy(target, &v, 4); break; }
+        case 8: memcpy(target, &value, 8); break;
+    }
+}
+
+// decode run of n labels into contiguous distance and path count arrays
+template<typename D>
+static void decode_deltas(const char *source, distance_t base, distance_t *distances, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        D delta;
+        memcpy(&delta, source + i * sizeof(D), sizeof(D));
+        distances[i] = base + delta;
+    }
+}
+
+template<typename P>
+static void decode_paths(const char *source, path_t *paths, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        P count;
+        memcpy(&count, source + i * sizeof(P), sizeof(P));
+        paths[i] = path_t(static_cast<path_base_t>(count));
+    }
+}
+
+static void decode_run(const char *deltas, const char *counts, uint8_t widths, distance_t base, distance_t *distances, path_t *paths, size_t n)
+{
+    switch (widths & 15)
+    {
+        case 0: fill(distances, distances + n, base); break;
+        case 1: decode_deltas<uint8_t>(deltas, base, distances, n); break;
+        case 2: decode_deltas<uint16_t>(deltas, base, distances, n); break;
+        default: decode_deltas<uint32_t>(deltas, base, distances, n); break;
+    }
+    switch (widths >> 4)
+    {
+        case 0: fill(paths, paths + n, path_t(1)); break;
+        case 1: decode_paths<uint8_t>(counts, paths, n); break;
+        case 2: decode_paths<uint16_t>(counts, paths, n); break;
+        case 4: decode_paths<uint32_t>(counts, paths, n); break;
+        default: decode_paths<uint64_t>(counts, paths, n); break;
+    }
+}
+
+size_t ContractionIndex::compressed_size(FlatCutIndex ci)
+{
+    size_t levels = ci.cut_level() + 1;
+    size_t total = compressed_prefix_size(ci.cut_level()) + levels * (sizeof(distance_t) + 1);
+    for (size_t cl = 0; cl < levels; cl++)
+    {
+        distance_t base;
+        uint8_t widths = level_widths(ci, cl, base);
+        total += ci.cut_size(cl) * ((widths & 15) + (widths >> 4));
+    }
+    return total;
+}
+
+void ContractionIndex::compress_labels(FlatCutIndex ci, char *target)
+{
+    size_t levels = ci.cut_level() + 1;
+    size_t prefix_size = compressed_prefix_size(ci.cut_level());
+    memcpy(target, ci.data, prefix_size);
+    char *bases = target + prefix_size, *widths = bases + levels * sizeof(distance_t);
+    char *next = widths + levels;
+    for (size_t cl = 0; cl < levels; cl++)
+    {
+        distance_t base;
+        uint8_t w = level_widths(ci, cl, base);
+        memcpy(bases + cl * sizeof(distance_t), &base, sizeof(distance_t));
+        widths[cl] = w;
+        size_t begin = get_offset(ci.dist_index(), cl), end = ci.dist_index()[cl];
+        for (size_t i = begin; i < end; i++, next += w & 15)
+            store_value(next, ci.distance_at(i) - base, w & 15);
+        for (size_t i = begin; i < end; i++, next += w >> 4)
+            store_value(next, static_cast<path_base_t>(ci.paths_at(i)), w >> 4);
+    }
+}
+
+// number of bytes used by compressed block
+static size_t compressed_block_size(const char *data)
+{
+    size_t cut_level = PBV::cut_level(*reinterpret_cast<const uint64_t*>(data)), levels = cut_level + 1;
+    const uint16_t *dist_index = reinterpret_cast<const uint16_t*>(data + sizeof(uint64_t));
+    size_t prefix_size = compressed_prefix_size(cut_level);
+    const char *widths = data + prefix_size + levels * sizeof(distance_t);
+    size_t total = prefix_size + levels * (sizeof(distance_t) + 1);
+    for (size_t cl = 0; cl < levels; cl++)
+        total += (dist_index[cl] - get_offset(dist_index, cl)) * ((widths[cl] & 15) + (widths[cl] >> 4));
+    return total;
+}
+
+// number of bytes used by compressed block once decoded
+static size_t decompressed_block_size(const char *data)
+{
+    size_t cut_level = PBV::cut_level(*reinterpret_cast<const uint64_t*>(data));
+    const uint16_t *dist_index = reinterpret_cast<const uint16_t*>(data + sizeof(uint64_t));
+    return compressed_prefix_size(cut_level) + label_size(dist_index[cut_level], label_tile);
+}
+
+// decode first count labels of compressed block into target, laid out as an uncompressed block
+static void decompress_block(const char *data, size_t count, char *target)
+{
+    size_t cut_level = PBV::cut_level(*reinterpret_cast<const uint64_t*>(data)), levels = cut_level + 1;
+    const uint16_t *dist_index = reinterpret_cast<const uint16_t*>(data + sizeof(uint64_t));
+    size_t prefix_size = compressed_prefix_size(cut_level), label_count = dist_index[cut_level];
+    memcpy(target, data, prefix_size);
+    char *target_labels = target + prefix_size;
+    const char *bases = data + prefix_size, *widths = bases + levels * sizeof(distance_t);
+    const char *next = widths + levels;
+    for (size_t cl = 0; cl < levels && get_offset(dist_index, cl) < count; cl++)
+    {
+        distance_t base;
+        memcpy(&base, bases + cl * sizeof(distance_t), sizeof(distance_t));
+        uint8_t w = widths[cl];
+        size_t begin = get_offset(dist_index, cl), end = dist_index[cl];
+        const char *deltas = next, *counts = next + (end - begin) * (w & 15);
+        // decode in runs of labels contiguous in memory
+        for (size_t i = begin, n; i < min(end, count); i += n)
+        {
+            n = min(label_run(i), end - i);
+            distance_t *distances = reinterpret_cast<distance_t*>(target_labels + label_distance_offset(i, label_tile));
+            path_t *paths = reinterpret_cast<path_t*>(target_labels + label_paths_offset(i, label_count, label_tile));
+            decode_run(deltas + (i - begin) * (w & 15), counts + (i - begin) * (w >> 4), w, base, distances, paths, n);
+        }
+        next = counts + (end - begin) * (w >> 4);
+    }
+}
+
+// decode first count labels of compressed block into scratch memory
+static char* decompress_block(const char *data, size_t count, vector<uint64_t> &scratch)
+{
+    size_t block_size = decompressed_block_size(data);
+    if (scratch.size() * sizeof(uint64_t) < block_size)
+        scratch.resize((block_size + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+    char *target = reinterpret_cast<char*>(scratch.data());
+    decompress_block(data, count, target);
+    return target;
+}
+
+void ContractionIndex::decompress_labels(FlatCutIndex &a, FlatCutIndex &b)
+{
+    thread_local static vector<uint64_t> scratch_a, scratch_b;
+    size_t cut_level = PBV::lca_level(*a.partition_bitvector(), *b.partition_bitvector());
+    a.data = decompress_block(a.data, a.dist_index()[cut_level], scratch_a);
+    b.data = decompress_block(b.data, b.dist_index()[cut_level], scratch_b);
+}
+
+void ContractionIndex::compress()
+{
+    assert(!copy_on_write);
+    if (compressed)
+        return;
+    // place compressed blocks of label-owning nodes in a single new block
+    unordered_map<char*, size_t> offsets;
+    size_t data_size = 0;
+    for (NodeID node = 1; node < labels.size(); node++)
+    {
+        const ContractionLabel &cl = labels[node];
+        if (cl.distance_offset == 0 && !cl.cut_index.empty())
+        {
+            offsets[cl.cut_index.data] = data_size;
+            data_size += aligned<uint64_t>(compressed_size(cl.cut_index));
+        }
+    }
+    char *data = (char*)calloc(max<size_t>(data_size, 1), 1);
+    for (NodeID node = 1; node < labels.size(); node++)
+    {
+        const ContractionLabel &cl = labels[node];
+        if (cl.distance_offset == 0 && !cl.cut_index.empty())
+            compress_labels(cl.cut_index, data + offsets[cl.cut_index.data]);
+    }
+    // release uncompressed blocks, then point labels into new block
+    for (NodeID node = 1; node < labels.size(); node++)
+        if (!labels[node].cut_index.empty() && labels[node].distance_offset == 0 && owns_block(labels[node].cut_index.data))
+            free(labels[node].cut_index.data);
+    if (label_data_mapped)
+        munmap(label_data, label_data_size);
+    else if (label_data != nullptr)
+        free(label_data);
+    for (NodeID node = 1; node < labels.size(); node++)
+        if (!labels[node].cut_index.empty())
+            labels[node].cut_index.data = data + offsets.at(labels[node].cut_index.data);
+    label_data = data;
+    label_data_size = data_size;
+    label_data_mapped = false;
+    compressed = true;
+}
+
+void ContractionIndex::decompress()
+{
+    assert(!copy_on_write);
+    if (!compressed)
+        return;
+    // compressed blocks all lie within label_data, of which decoded blocks get a new one
+    unordered_map<char*, size_t> offsets;
+    size_t data_size = 0;
+    for (NodeID node = 1; node < labels.size(); node++)
+    {
+        const ContractionLabel &cl = labels[node];
+        if (cl.distance_offset == 0 && !cl.cut_index.empty())
+        {
+            offsets[cl.cut_index.data] = data_size;
+            data_size += aligned<uint64_t>(decompressed_block_size(cl.cut_index.data));
+        }
+    }
+    char *data = (char*)calloc(max<size_t>(data_size, 1), 1);
+    for (NodeID node = 1; node < labels.size(); node++)
+    {
+        const ContractionLabel &cl = labels[node];
+        if (cl.distance_offset == 0 && !cl.cut_index.empty())
+            decompress_block(cl.cut_index.data, cl.cut_index.label_count(), data + offsets[cl.cut_index.data]);
+    }
+    for (NodeID node = 1; node < labels.size(); node++)
+        if (!labels[node].cut_index.empty())
+            labels[node].cut_index.data = data + offsets.at(labels[node].cut_index.data);
+    if (label_data_mapped)
+        munmap(label_data, label_data_size);
+    else if (label_data != nullptr)
+        free(label_data);
+    label_data = data;
+    label_data_size = data_size;
+    label_data_mapped = false;
+    compressed = false;
+}
 
-    distance_t min_dist = infinity; uint16_t spc = 0;
-    const distance_t* a_ptr = a.distances();
-    const distance_t* b_ptr = b.distances();
-    const uint16_t* x_ptr = a.paths();
-    const uint16_t* y_ptr = b.paths();
-    const distance_t* a_end = a_ptr + min(a.dist_index()[cut_level], b.dist_index()[cut_level]);
-    while (a_ptr != a_end)
+void ContractionIndex::interleave_labels()
+{
+    assert(owns_blocks && !copy_on_write);
+    if (label_data == nullptr)
+        return;
+    // policy must be set before pages are first touched
+    char *data = (char*)mmap(nullptr, label_data_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED)
+    {
+        cerr << "cannot allocate interleaved label data" << endl;
+        return;
+    }
+    if (!util::numa::interleave(data, label_data_size))
+        cerr << "cannot interleave label data across NUMA nodes" << endl;
+    memcpy(data, label_data, label_data_size);
+    for (NodeID node = 1; node < labels.size(); node++)
     {
-        distance_t d = *a_ptr + *b_ptr;
-	uint16_t c = *x_ptr * *y_ptr;
-        if (d < min_dist) {
-            min_dist = d;
-	    spc = c;
-	} else if(d == min_dist) {
-	    spc = spc + c;
-	}
-        a_ptr++; b_ptr++;
-	x_ptr++; y_ptr++;
+        char *&block = labels[node].cut_index.data;
+        if (block != nullptr && !owns_block(block))
+            block = data + (block - label_data);
     }
+    if (label_data_mapped)
+        munmap(label_data, label_data_size);
+    else
+        free(label_data);
+    label_data = data;
+    label_data_mapped = true;
+}
 
-    return spc;
+bool ContractionIndex::is_compressed() const
+{
+    return compressed;
 }
 
 
@@ -673,21 +1745,93 @@ bool ContractionIndex::in_partition_subgraph(NodeID node, uint64_t partition_bit
 
 uint16_t ContractionIndex::dist_index(NodeID node) const
 {
+    assert(!compressed);
     FlatCutIndex const& ci = labels[node].cut_index;
     uint16_t index = get_offset(ci.dist_index(), ci.cut_level());
-    while (ci.distances()[index] != 0)
+    while (ci.distance_at(index) != 0)
         index++;
     return index;
 }
 
 ContractionLabel ContractionIndex::get_contraction_label(NodeID v) const
 {
-    return labels[v];
+    if (!copy_on_write)
+        return labels[v];
+    // block pointer may get replaced concurrently by get_mutable_cut_index
+    ContractionLabel cl = labels[v];
+    cl.cut_index.data = atomic_ref<char*>(const_cast<char*&>(labels[v].cut_index.data)).load(memory_order_acquire);
+    return cl;
+}
+
+FlatCutIndex ContractionIndex::get_mutable_cut_index(NodeID v, uint16_t slot)
+{
+    assert(!compressed);
+    if (cache)
+        cache->record_change(v, slot);
+    if (tracking && !atomic_ref<uint8_t>(block_saved[v]).load(memory_order_acquire))
+        save_block(v);
+    if (!copy_on_write)
+        return labels[v].cut_index;
+    assert(!is_contracted(v));
+    atomic_ref<char*> data(labels[v].cut_index.data);
+    if (!atomic_ref<uint8_t>(block_copied[v]).load(memory_order_acquire))
+    {
+        lock_guard<mutex> lock(copy_mutex);
+        if (!atomic_ref<uint8_t>(block_copied[v]).load(memory_order_relaxed))
+        {
+            FlatCutIndex original = labels[v].cut_index;
+            char* copy = (char*)malloc(original.size());
+            memcpy(copy, original.data, original.size());
+            data.store(copy, memory_order_release);
+            changed_nodes.push_back(v);
+            // contracted nodes share the block of their root
+            for (size_t i = tree_offsets[v]; i < tree_offsets[v + 1]; i++)
+            {
+                labels[tree_nodes[i]].cut_index.data = copy;
+                changed_nodes.push_back(tree_nodes[i]);
+            }
+            atomic_ref<uint8_t>(block_copied[v]).store(1, memory_order_release);
+        }
+    }
+    FlatCutIndex ci;
+    ci.data = data.load(memory_order_acquire);
+    return ci;
 }
 
 void ContractionIndex::update_distance_offset(NodeID n, distance_t d)
 {
+    if (tracking && !offset_saved[n])
+    {
+        offset_saved[n] = 1;
+        saved_offsets.push_back(make_pair(n, labels[n].distance_offset));
+    }
     labels[n].distance_offset = d;
+    if (copy_on_write)
+        changed_nodes.push_back(n);
+}
+
+void ContractionIndex::replace_labels(NodeID v, const CutIndex *ci)
+{
+    // delta checkpoints and shared versions rely on label blocks keeping their layout
+    assert(!compressed && !copy_on_write && !tracking);
+    assert(!is_contracted(v));
+    if (tree_offsets.empty())
+        index_trees();
+    if (cache)
+        cache->record_change(v, 0);
+    char* replaced = labels[v].cut_index.data;
+    char* data = nullptr;
+    if (ci != nullptr)
+    {
+        data = (char*)calloc(FlatCutIndex::size(*ci), 1);
+        FlatCutIndex(*ci, data);
+    }
+    labels[v].cut_index.data = data;
+    // contracted nodes share the block of their root
+    for (size_t i = tree_offsets[v]; i < tree_offsets[v + 1]; i++)
+        labels[tree_nodes[i]].cut_index.data = data;
+    if (replaced != nullptr && owns_block(replaced))
+        free(replaced);
 }
 
 size_t ContractionIndex::get_hoplinks(FlatCutIndex a, FlatCutIndex b)
@@ -717,8 +1861,16 @@ size_t ContractionIndex::size() const
     for (NodeID node = 1; node < labels.size(); node++)
     {
         // skip isolated nodes (subgraph)
-        if (!labels[node].cut_index.empty())
+        if (labels[node].cut_index.empty())
+            continue;
+        if (!compressed)
             total += labels[node].size();
+        else
+        {
+            total += sizeof(ContractionLabel);
+            if (labels[node].distance_offset == 0)
+                total += compressed_block_size(labels[node].cut_index.data);
+        }
     }
     return total;
 }
@@ -775,6 +1927,7 @@ size_t ContractionIndex::label_count() const
 
 size_t ContractionIndex::non_empty_cuts() const
 {
+    assert(!compressed);
     size_t total = 0;
     for (NodeID node = 1; node < labels.size(); node++)
     {
@@ -782,7 +1935,7 @@ size_t ContractionIndex::non_empty_cuts() const
             continue;
         // count nodes that come first within their cut
         FlatCutIndex const& ci = labels[node].cut_index;
-        if (ci.distances()[get_offset(ci.dist_index(), ci.cut_level())] == 0)
+        if (ci.distance_at(get_offset(ci.dist_index(), ci.cut_level())) == 0)
             total++;
     }
     return total;
@@ -791,9 +1944,9 @@ size_t ContractionIndex::non_empty_cuts() const
 bool ContractionIndex::check_query(std::pair<NodeID,NodeID> query, Graph &g) const
 {
     distance_t d_index = get_distance(query.first, query.second);
-    uint16_t p_index = get_spc(query.first, query.second);
+    path_t p_index = get_spc(query.first, query.second);
     distance_t d_dijkstra = g.get_distance(query.first, query.second, true);
-    uint16_t p_dijkstra = g.get_path_count(query.first, query.second, true);
+    path_t p_dijkstra = g.get_path_count(query.first, query.second, true);
     if (d_index != d_dijkstra)
     {
         cerr << "BUG: d_index=" << d_index << ", d_dijkstra=" << d_dijkstra << endl;
@@ -807,7 +1960,7 @@ bool ContractionIndex::check_query(std::pair<NodeID,NodeID> query, Graph &g) con
         cerr << "index[" << query.first << "]=" << labels[query.first] << endl;
         cerr << "index[" << query.second << "]=" << labels[query.second] << endl;
     }
-    return d_index == d_dijkstra;
+    return d_index == d_dijkstra && p_index == p_dijkstra;
 }
 
 pair<NodeID,NodeID> ContractionIndex::random_query() const
@@ -819,23 +1972,312 @@ pair<NodeID,NodeID> ContractionIndex::random_query() const
     return make_pair(a, b);
 }
 
-void ContractionIndex::write(ostream& os) const
+// binary index files start with a header recording their format; files without one (older format) are read as having
+// separate label arrays and 16-bit path counts, which works as their first field (node count) never matches a magic value
+// since version 4, shortcut graphs are stored as their CSR arrays rather than per node
+// since version 5, label and shortcut graph files end with a checksum per section, followed by checksum_magic
+// since version 7, compressed labels are written as such, in files with compressed_index_magic that otherwise match
+// the contiguous format; their blocks don't depend on the label layout
+static const uint64_t index_magic = 0x4c43445844494e00ull; // labels
+static const uint64_t compressed_index_magic = 0x4c4344585a494e00ull; // compressed labels
+static const uint64_t hierarchy_magic = 0x53474458444e4900ull; // shortcut graph
+static const uint64_t checksum_magic = 0x4b43484358444e00ull;
+static const uint32_t format_version = 7;
+static const size_t IO_CHUNK = 1 << 20; // sections are encoded and checksummed in parallel in chunks of this size (part of format)
+static const size_t IO_WINDOW = 64 * IO_CHUNK; // label data is assembled in buffers of this size before being written
+
+struct FileHeader
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t label_tile; // 0 for separate arrays
+    // representation of path counts
+    uint32_t path_bits;
+    uint32_t saturating_paths;
+
+    FileHeader(uint64_t magic);
+    // header describing this build
+    static FileHeader current(uint64_t magic);
+    // write header followed by node count
+    void write(ostream &os, size_t node_count) const;
+    // read header (if present) and node count, also accepting other_magic (then stored as magic); exits if path
+    // count representation differs from this build
+    size_t read(istream &is, uint64_t other_magic = 0);
+};
+
+FileHeader::FileHeader(uint64_t magic) : magic(magic), version(0), label_tile(0), path_bits(16), saturating_paths(0)
 {
-    size_t node_count = labels.size() - 1;
+}
+
+FileHeader FileHeader::current(uint64_t magic)
+{
+    FileHeader header(magic);
+    header.version = format_version;
+    header.label_tile = road_network::label_tile;
+    header.path_bits = PATH_COUNT_BITS;
+#ifdef SATURATING_PATHS
+    header.saturating_paths = 1;
+#endif
+    return header;
+}
+
+void FileHeader::write(ostream &os, size_t node_count) const
+{
+    os.write((char*)&magic, sizeof(uint64_t));
+    os.write((char*)&version, sizeof(uint32_t));
+    os.write((char*)&label_tile, sizeof(uint32_t));
+    os.write((char*)&path_bits, sizeof(uint32_t));
+    os.write((char*)&saturating_paths, sizeof(uint32_t));
     os.write((char*)&node_count, sizeof(size_t));
+}
+
+size_t FileHeader::read(istream &is, uint64_t other_magic)
+{
+    size_t node_count = 0;
+    is.read((char*)&node_count, sizeof(size_t));
+    if (node_count == magic || (other_magic != 0 && node_count == other_magic))
+    {
+        magic = node_count;
+        is.read((char*)&version, sizeof(uint32_t));
+        if (version == 0 || version > format_version)
+        {
+            cerr << "unsupported file version " << version << endl;
+            exit(EXIT_FAILURE);
+        }
+        is.read((char*)&label_tile, sizeof(uint32_t));
+        // version 1 only recorded label layout
+        if (version >= 2)
+        {
+            is.read((char*)&path_bits, sizeof(uint32_t));
+            is.read((char*)&saturating_paths, sizeof(uint32_t));
+        }
+        is.read((char*)&node_count, sizeof(size_t));
+    }
+    FileHeader expected = current(magic);
+    if (path_bits != expected.path_bits || saturating_paths != expected.saturating_paths)
+    {
+        cerr << "file stores " << (saturating_paths ? "saturating " : "") << path_bits << "-bit path counts, but build uses "
+            << (expected.saturating_paths ? "saturating " : "") << expected.path_bits << "-bit path counts" << endl;
+        exit(EXIT_FAILURE);
+    }
+    return node_count;
+}
+
+// checksums of file sections; the checksum of a section combines those of its chunks, so it doesn't depend on thread count
+class SectionChecksums
+{
+    vector<uint64_t> sums;
+    vector<uint64_t> chunk_sums; // of current section
+public:
+    // add data to current section; all parts but the last must consist of whole chunks
+    void add(const void *data, size_t size);
+    void end_section();
+    void add_section(const void *data, size_t size);
+    void write(ostream &os) const;
+    // compare against checksums read from stream; exits on mismatch
+    void verify(istream &is, const char *file_type) const;
+};
+
+void SectionChecksums::add(const void *data, size_t size)
+{
+    size_t first = chunk_sums.size(), chunks = (size + IO_CHUNK - 1) / IO_CHUNK;
+    chunk_sums.resize(first + chunks);
+    auto sum = [this, data, size, first](size_t i) {
+        size_t offset = i * IO_CHUNK;
+        chunk_sums[first + i] = util::checksum(static_cast<const char*>(data) + offset, min(IO_CHUNK, size - offset));
+    };
+    if (chunks > 1)
+    {
+        util::ThreadPool::TaskGroup group;
+        for (size_t i = 0; i < chunks; i++)
+            thread_pool().run(group, [&sum, i] { sum(i); });
+        thread_pool().wait(group);
+    }
+    else if (chunks == 1)
+        sum(0);
+}
+
+void SectionChecksums::end_section()
+{
+    sums.push_back(util::checksum(chunk_sums.data(), chunk_sums.size() * sizeof(uint64_t)));
+    chunk_sums.clear();
+}
+
+void SectionChecksums::add_section(const void *data, size_t size)
+{
+    add(data, size);
+    end_section();
+}
+
+void SectionChecksums::write(ostream &os) const
+{
+    os.write((char*)sums.data(), sums.size() * sizeof(uint64_t));
+    os.write((char*)&checksum_magic, sizeof(uint64_t));
+}
+
+void SectionChecksums::verify(istream &is, const char *file_type) const
+{
+    assert(chunk_sums.empty());
+    vector<uint64_t> stored(sums.size());
+    uint64_t magic = 0;
+    is.read((char*)stored.data(), stored.size() * sizeof(uint64_t));
+    is.read((char*)&magic, sizeof(uint64_t));
+    if (!is || magic != checksum_magic)
+    {
+        cerr << file_type << " file is truncated" << endl;
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < sums.size(); i++)
+        if (stored[i] != sums[i])
+        {
+            cerr << "checksum mismatch in section " << i << " of " << file_type << " file" << endl;
+            exit(EXIT_FAILURE);
+        }
+}
+
+// since version 3, header and node count are followed by the size of the label data, an offset table (with one entry
+// per node, including unused node 0) and cache-line aligned label data; blocks within label data are 8-byte aligned
+struct LabelEntry
+{
+    uint64_t data_offset; // start of label data, resolved to root for contracted nodes
+    distance_t distance_offset;
+    NodeID parent;
+};
+
+static const uint64_t NO_DATA = UINT64_MAX; // data_offset value of nodes without labels (isolated nodes)
+static const size_t label_table_offset = sizeof(uint64_t) + 4 * sizeof(uint32_t) + 2 * sizeof(size_t);
+
+// file offset of label data in contiguous format
+static size_t label_data_offset(size_t node_count)
+{
+    size_t table_end = label_table_offset + (node_count + 1) * sizeof(LabelEntry);
+    return (table_end + 63) & ~(size_t)63;
+}
+
+template<typename F>
+void ContractionIndex::write(ostream& os, F keep) const
+{
+    size_t node_count = labels.size() - 1;
+    // compressed blocks are written as they are
+    auto block_size = [this](FlatCutIndex ci) { return compressed ? compressed_block_size(ci.data) : ci.size(); };
+    // assign data offsets to label-owning nodes
+    vector<LabelEntry> table(labels.size(), { NO_DATA, 0, NO_NODE });
+    size_t data_size = 0;
+    vector<NodeID> kept;
     for (NodeID node = 1; node < labels.size(); node++)
     {
-        ContractionLabel cl = labels[node];
-        os.write((char*)&cl.distance_offset, sizeof(distance_t));
-        if (cl.distance_offset == 0)
+        const ContractionLabel &cl = labels[node];
+        table[node].distance_offset = cl.distance_offset;
+        table[node].parent = cl.parent;
+        if (cl.distance_offset == 0 && !cl.cut_index.empty() && keep(node))
         {
-            size_t data_size = cl.cut_index.size();
-            os.write((char*)&data_size, sizeof(size_t));
-            os.write(cl.cut_index.data, data_size);
+            kept.push_back(node);
+            table[node].data_offset = data_size;
+            data_size += aligned<uint64_t>(block_size(cl.cut_index));
         }
-        else
-            os.write((char*)&cl.parent, sizeof(NodeID));
     }
+    // contracted nodes share data of their root
+    for (NodeID node = 1; node < labels.size(); node++)
+        if (labels[node].distance_offset != 0)
+        {
+            NodeID root = labels[node].parent;
+            while (labels[root].distance_offset != 0)
+                root = labels[root].parent;
+            table[node].data_offset = table[root].data_offset;
+        }
+    FileHeader::current(compressed ? compressed_index_magic : index_magic).write(os, node_count);
+    SectionChecksums checksums;
+    os.write((char*)&data_size, sizeof(size_t));
+    checksums.add_section(&data_size, sizeof(size_t));
+    os.write((char*)&table[0], table.size() * sizeof(LabelEntry));
+    checksums.add_section(&table[0], table.size() * sizeof(LabelEntry));
+    const char padding[64] = {};
+    os.write(padding, label_data_offset(node_count) - label_table_offset - table.size() * sizeof(LabelEntry));
+    // label data gets assembled in windows, with chunks copied in parallel, so it can be written in large blocks
+    vector<char> buffer(min(data_size, IO_WINDOW));
+    auto encode = [this, &table, &kept, &buffer, &block_size](size_t window_begin, size_t begin, size_t end) {
+        char *out = buffer.data() + (begin - window_begin);
+        memset(out, 0, end - begin);
+        // start from last block beginning at or before chunk
+        size_t k = upper_bound(kept.begin(), kept.end(), begin, [&table](size_t offset, NodeID node) { return offset < table[node].data_offset; }) - kept.begin();
+        for (k = k > 0 ? k - 1 : 0; k < kept.size() && table[kept[k]].data_offset < end; k++)
+        {
+            const FlatCutIndex &block = labels[kept[k]].cut_index;
+            size_t block_begin = table[kept[k]].data_offset;
+            size_t from = max(begin, block_begin), to = min(end, block_begin + block_size(block));
+            if (from < to)
+                memcpy(out + (from - begin), block.data + (from - block_begin), to - from);
+        }
+    };
+    for (size_t window_begin = 0; window_begin < data_size; window_begin += IO_WINDOW)
+    {
+        size_t window_end = min(window_begin + IO_WINDOW, data_size);
+        util::ThreadPool::TaskGroup group;
+        for (size_t begin = window_begin; begin < window_end; begin += IO_CHUNK)
+            thread_pool().run(group, [&encode, window_begin, begin, window_end] { encode(window_begin, begin, min(begin + IO_CHUNK, window_end)); });
+        thread_pool().wait(group);
+        os.write(buffer.data(), window_end - window_begin);
+        checksums.add(buffer.data(), window_end - window_begin);
+    }
+    checksums.end_section();
+    checksums.write(os);
+}
+
+void ContractionIndex::write(ostream& os) const
+{
+    write(os, [](NodeID) { return true; });
+}
+
+void ContractionIndex::write_shard(ostream& os, const ShardMap &shards, uint16_t shard) const
+{
+    assert(shards.shards.size() == labels.size() && shard < shards.shard_count());
+    write(os, [&shards, shard](NodeID node) { return shards[node] == shard || shards[node] == ShardMap::ALL_SHARDS; });
+}
+
+vector<char> ContractionIndex::label_prefix(NodeID v, uint16_t shard_bits) const
+{
+    assert(shard_bits > 0);
+    const ContractionLabel &cl = labels[v];
+    assert(!cl.cut_index.empty() && cl.cut_index.cut_level() >= shard_bits);
+    // prefix holds cut levels 0 to shard_bits - 1, which become its own cut level
+    uint16_t cut_level = shard_bits - 1;
+    size_t count = cl.cut_index.dist_index()[cut_level];
+    FlatCutIndex source = cl.cut_index;
+    thread_local static vector<uint64_t> scratch;
+    if (compressed)
+        source.data = decompress_block(source.data, count, scratch);
+    size_t block_size = sizeof(uint64_t) + aligned<LabelAlignment>(shard_bits * sizeof(uint16_t)) + label_size(count, label_tile);
+    vector<char> prefix(sizeof(uint64_t) + block_size, 0);
+    memcpy(prefix.data(), &cl.distance_offset, sizeof(distance_t));
+    FlatCutIndex truncated;
+    truncated.data = prefix.data() + sizeof(uint64_t);
+    *truncated.partition_bitvector() = PBV::from(source.partition(), cut_level);
+    memcpy(truncated.dist_index(), source.dist_index(), shard_bits * sizeof(uint16_t));
+    for (size_t i = 0; i < count; i++)
+    {
+        truncated.distance_at(i) = source.distance_at(i);
+        truncated.paths_at(i) = source.paths_at(i);
+    }
+    return prefix;
+}
+
+edata_t ContractionIndex::query_prefix(span<const char> prefix, NodeID w) const
+{
+    assert(prefix.size() > sizeof(uint64_t) && (uintptr_t)prefix.data() % sizeof(uint64_t) == 0);
+    distance_t distance_offset;
+    memcpy(&distance_offset, prefix.data(), sizeof(distance_t));
+    FlatCutIndex a;
+    a.data = const_cast<char*>(prefix.data()) + sizeof(uint64_t);
+    const ContractionLabel &cw = labels[w];
+    assert(!cw.cut_index.empty());
+    // prefix is never compressed, so only labels of w may need decoding
+    FlatCutIndex b = cw.cut_index;
+    thread_local static vector<uint64_t> scratch;
+    if (compressed)
+        b.data = decompress_block(b.data, b.dist_index()[PBV::lca_level(*a.partition_bitvector(), *b.partition_bitvector())], scratch);
+    distance_t distance;
+    path_t paths = get_paths(a, b, distance);
+    return edata_t(distance_offset + cw.distance_offset + distance, paths);
 }
 
 void ContractionIndex::write_json(std::ostream& os) const
@@ -876,10 +2318,101 @@ void ContractionIndex::write_json(std::ostream& os) const
 
 ContractionIndex::ContractionIndex(istream& is)
 {
-    // read index data
-    size_t node_count = 0;
-    is.read((char*)&node_count, sizeof(size_t));
+    FileHeader header(index_magic);
+    size_t node_count = header.read(is, compressed_index_magic);
+    compressed = header.magic == compressed_index_magic;
+    read_labels(is, node_count, header.version, header.label_tile);
+}
+
+ContractionIndex::ContractionIndex(const string& filename)
+{
+    ifstream is(filename);
+    FileHeader header(index_magic);
+    size_t node_count = header.read(is, compressed_index_magic);
+    compressed = header.magic == compressed_index_magic;
+    // labels in older format or different layout need to be read and converted
+    if (!compressed && (header.version < 3 || header.label_tile != label_tile))
+    {
+        read_labels(is, node_count, header.version, header.label_tile);
+        return;
+    }
+    is.close();
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0)
+    {
+        cerr << "cannot open " << filename << endl;
+        exit(EXIT_FAILURE);
+    }
+    label_data_size = file_stat.st_size;
+    // private mapping allows in-place label updates without modifying the file
+    label_data = (char*)mmap(nullptr, label_data_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (label_data == MAP_FAILED)
+    {
+        cerr << "cannot map " << filename << endl;
+        exit(EXIT_FAILURE);
+    }
+    label_data_mapped = true;
     labels.resize(node_count + 1);
+    assign_labels(label_data + label_table_offset, label_data + label_data_offset(node_count), node_count);
+}
+
+void ContractionIndex::read_labels(istream& is, size_t node_count, uint32_t version, uint32_t from_tile)
+{
+    labels.resize(node_count + 1);
+    if (version >= 3)
+    {
+        SectionChecksums checksums;
+        size_t data_size = 0;
+        is.read((char*)&data_size, sizeof(size_t));
+        checksums.add_section(&data_size, sizeof(size_t));
+        vector<LabelEntry> table(node_count + 1);
+        is.read((char*)&table[0], table.size() * sizeof(LabelEntry));
+        checksums.add_section(&table[0], table.size() * sizeof(LabelEntry));
+        is.ignore(label_data_offset(node_count) - label_table_offset - table.size() * sizeof(LabelEntry));
+        if (from_tile == label_tile || compressed)
+        {
+            label_data_size = data_size;
+            label_data = (char*)malloc(data_size);
+            is.read(label_data, data_size);
+            checksums.add_section(label_data, data_size);
+            if (version >= 5)
+                checksums.verify(is, "label");
+        }
+        else
+        {
+            // converted label blocks may differ in size, so offsets must be re-assigned
+            vector<char> file_data(data_size);
+            is.read(&file_data[0], data_size);
+            checksums.add_section(file_data.data(), data_size);
+            if (version >= 5)
+                checksums.verify(is, "label");
+            unordered_map<uint64_t, uint64_t> new_offset;
+            for (NodeID node = 1; node < table.size(); node++)
+                if (table[node].distance_offset == 0 && table[node].data_offset != NO_DATA)
+                {
+                    FlatCutIndex file_ci;
+                    file_ci.data = &file_data[table[node].data_offset];
+                    new_offset[table[node].data_offset] = label_data_size;
+                    label_data_size += aligned<uint64_t>(file_ci.size());
+                }
+            label_data = (char*)malloc(label_data_size);
+            for (NodeID node = 1; node < table.size(); node++)
+                if (table[node].distance_offset == 0 && table[node].data_offset != NO_DATA)
+                {
+                    FlatCutIndex file_ci;
+                    file_ci.data = &file_data[table[node].data_offset];
+                    file_ci.convert_layout(from_tile, label_data + new_offset[table[node].data_offset]);
+                }
+            for (NodeID node = 1; node < table.size(); node++)
+                if (table[node].data_offset != NO_DATA)
+                    table[node].data_offset = new_offset[table[node].data_offset];
+        }
+        assign_labels((char*)&table[0], label_data, node_count);
+        return;
+    }
+    // older format stores labels individually, and parents rather than roots for contracted nodes
     for (NodeID node = 1; node < labels.size(); node++)
     {
         ContractionLabel &cl = labels[node];
@@ -890,6 +2423,13 @@ ContractionIndex::ContractionIndex(istream& is)
             is.read((char*)&data_size, sizeof(size_t));
             cl.cut_index.data = (char*)malloc(data_size);
             is.read(cl.cut_index.data, data_size);
+            if (from_tile != label_tile)
+            {
+                FlatCutIndex file_ci = cl.cut_index;
+                cl.cut_index.data = (char*)malloc(file_ci.size());
+                file_ci.convert_layout(from_tile, cl.cut_index.data);
+                free(file_ci.data);
+            }
         }
         else
             is.read((char*)&cl.parent, sizeof(NodeID));
@@ -900,10 +2440,350 @@ ContractionIndex::ContractionIndex(istream& is)
         ContractionLabel &cl = labels[node];
         if (cl.distance_offset != 0)
         {
-            NodeID root = cl.parent;
-            while (labels[root].distance_offset != 0)
-                root = labels[root].parent;
-            cl.cut_index = labels[root].cut_index;
+            NodeID root = cl.parent;
+            while (labels[root].distance_offset != 0)
+                root = labels[root].parent;
+            cl.cut_index = labels[root].cut_index;
+        }
+    }
+}
+
+void ContractionIndex::assign_labels(const char* table, char* data, size_t node_count)
+{
+    const LabelEntry *entries = (const LabelEntry*)table;
+    for (NodeID node = 1; node <= node_count; node++)
+    {
+        ContractionLabel &cl = labels[node];
+        cl.distance_offset = entries[node].distance_offset;
+        cl.parent = entries[node].parent;
+        if (entries[node].data_offset != NO_DATA)
+            cl.cut_index.data = data + entries[node].data_offset;
+    }
+}
+
+// delta files consist of a header with node count, followed by sections for changed labels, distance offsets and
+// shortcut edges, each preceded by their number of entries; label entries list the changed slots of a node, followed
+// by arrays of slot indices, distances and path counts
+static const uint64_t delta_magic = 0x41544c4544584e00ull;
+
+struct LabelDelta
+{
+    NodeID node;
+    uint32_t slot_count;
+};
+
+struct OffsetDelta
+{
+    NodeID node;
+    distance_t distance_offset;
+};
+
+struct EdgeDelta
+{
+    NodeID v, w;
+    distance_t distance;
+    path_base_t paths;
+};
+
+// since version 6, delta files end with a section holding the new weights of changed graph edges (in both directions)
+struct WeightDelta
+{
+    NodeID v, w;
+    distance_t distance;
+};
+
+template<typename T>
+static void write_section(ostream &os, const vector<T> &entries)
+{
+    uint64_t count = entries.size();
+    os.write((char*)&count, sizeof(uint64_t));
+    os.write((char*)entries.data(), entries.size() * sizeof(T));
+}
+
+template<typename T>
+static vector<T> read_section(istream &is)
+{
+    uint64_t count = 0;
+    is.read((char*)&count, sizeof(uint64_t));
+    if (!is)
+    {
+        cerr << "truncated delta file" << endl;
+        exit(EXIT_FAILURE);
+    }
+    vector<T> entries(count);
+    is.read((char*)entries.data(), count * sizeof(T));
+    return entries;
+}
+
+void ContractionIndex::save_block(NodeID v)
+{
+    lock_guard<mutex> lock(copy_mutex);
+    if (atomic_ref<uint8_t>(block_saved[v]).load(memory_order_relaxed))
+        return;
+    // block pointer only gets replaced by copy-on-write while holding copy_mutex
+    FlatCutIndex current = labels[v].cut_index;
+    char* copy = (char*)malloc(current.size());
+    memcpy(copy, current.data, current.size());
+    saved_blocks.push_back(make_pair(v, copy));
+    atomic_ref<uint8_t>(block_saved[v]).store(1, memory_order_release);
+}
+
+void ContractionIndex::clear_saved()
+{
+    for (pair<NodeID, char*> saved : saved_blocks)
+    {
+        free(saved.second);
+        block_saved[saved.first] = 0;
+    }
+    for (pair<NodeID, distance_t> saved : saved_offsets)
+        offset_saved[saved.first] = 0;
+    saved_blocks.clear();
+    saved_offsets.clear();
+}
+
+void ContractionIndex::track_changes(ContractionHierarchy &ch, bool state)
+{
+    // changes are made in place, which compressed labels don't allow
+    decompress();
+    clear_saved();
+    tracking = state;
+    block_saved.assign(state ? labels.size() : 0, 0);
+    offset_saved.assign(state ? labels.size() : 0, 0);
+    ch.tracking = state;
+    ch.changed_edges.clear();
+}
+
+void ContractionIndex::write_delta(ostream& os, ContractionHierarchy &ch, const vector<Edge> &weights)
+{
+    assert(tracking);
+    // compare labels against their saved values, so labels restored by later updates are not written
+    sort(saved_blocks.begin(), saved_blocks.end());
+    vector<LabelDelta> changed;
+    vector<uint16_t> slots;
+    vector<distance_t> distances;
+    vector<path_base_t> paths;
+    for (pair<NodeID, char*> saved : saved_blocks)
+    {
+        FlatCutIndex original, current = labels[saved.first].cut_index;
+        original.data = saved.second;
+        size_t first = slots.size();
+        for (size_t i = 0; i < current.label_count(); i++)
+            if (current.distance_at(i) != original.distance_at(i) || current.paths_at(i) != original.paths_at(i))
+            {
+                slots.push_back(i);
+                distances.push_back(current.distance_at(i));
+                paths.push_back((path_base_t)current.paths_at(i));
+            }
+        if (slots.size() > first)
+            changed.push_back({ saved.first, (uint32_t)(slots.size() - first) });
+    }
+    sort(saved_offsets.begin(), saved_offsets.end());
+    vector<OffsetDelta> offsets;
+    for (pair<NodeID, distance_t> saved : saved_offsets)
+        if (labels[saved.first].distance_offset != saved.second)
+            offsets.push_back({ saved.first, labels[saved.first].distance_offset });
+    util::make_set(ch.changed_edges);
+    vector<EdgeDelta> edges(ch.changed_edges.size());
+    for (size_t i = 0; i < edges.size(); i++)
+    {
+        edge_t e = ch.changed_edges[i];
+        const Neighbor *n = ch.up_neighbor(e.first, e.second);
+        assert(n != nullptr);
+        edges[i].v = e.first;
+        edges[i].w = e.second;
+        edges[i].distance = n->distance;
+        edges[i].paths = (path_base_t)n->path_count;
+    }
+
+    FileHeader::current(delta_magic).write(os, labels.size() - 1);
+    write_section(os, changed);
+    size_t first = 0;
+    for (const LabelDelta &d : changed)
+    {
+        os.write((char*)&slots[first], d.slot_count * sizeof(uint16_t));
+        os.write((char*)&distances[first], d.slot_count * sizeof(distance_t));
+        os.write((char*)&paths[first], d.slot_count * sizeof(path_base_t));
+        first += d.slot_count;
+    }
+    write_section(os, offsets);
+    write_section(os, edges);
+    vector<WeightDelta> weight_deltas;
+    for (const Edge &e : weights)
+        weight_deltas.push_back({ e.a, e.b, e.d });
+    write_section(os, weight_deltas);
+    clear_saved();
+    ch.changed_edges.clear();
+}
+
+void ContractionIndex::apply_delta(istream& is)
+{
+    apply_delta(is, nullptr, nullptr, nullptr);
+}
+
+void ContractionIndex::apply_delta(istream& is, ContractionHierarchy &ch)
+{
+    apply_delta(is, &ch, nullptr, nullptr);
+}
+
+void ContractionIndex::apply_delta(istream& is, ContractionHierarchy &ch, Graph &g)
+{
+    apply_delta(is, &ch, &g, nullptr);
+}
+
+bool ContractionIndex::apply_delta(istream& is, ContractionHierarchy &ch, vector<Edge> &weights)
+{
+    return apply_delta(is, &ch, nullptr, &weights);
+}
+
+bool ContractionIndex::apply_delta(istream& is, ContractionHierarchy *ch, Graph *g, vector<Edge> *weights_out)
+{
+    // label slots are changed in place, so compressed labels are decoded first
+    decompress();
+    FileHeader header(delta_magic);
+    size_t node_count = header.read(is);
+    if (header.version == 0 || node_count != labels.size() - 1)
+    {
+        cerr << "delta file does not match index" << endl;
+        exit(EXIT_FAILURE);
+    }
+    // changes are applied through the regular update functions, so they are tracked (and copied on write) as usual
+    next_epoch();
+    vector<uint16_t> slots;
+    vector<distance_t> distances;
+    vector<path_base_t> paths;
+    for (const LabelDelta &d : read_section<LabelDelta>(is))
+    {
+        slots.resize(d.slot_count);
+        distances.resize(d.slot_count);
+        paths.resize(d.slot_count);
+        is.read((char*)slots.data(), d.slot_count * sizeof(uint16_t));
+        is.read((char*)distances.data(), d.slot_count * sizeof(distance_t));
+        is.read((char*)paths.data(), d.slot_count * sizeof(path_base_t));
+        // slots are stored in increasing order
+        FlatCutIndex ci = get_mutable_cut_index(d.node, slots[0]);
+        for (size_t i = 0; i < d.slot_count; i++)
+        {
+            assert(slots[i] < ci.label_count());
+            ci.distance_at(slots[i]) = distances[i];
+            ci.paths_at(slots[i]) = path_t(paths[i]);
+        }
+    }
+    for (const OffsetDelta &d : read_section<OffsetDelta>(is))
+        update_distance_offset(d.node, d.distance_offset);
+    vector<EdgeDelta> edges = read_section<EdgeDelta>(is);
+    vector<WeightDelta> weights;
+    if (header.version >= 6)
+        weights = read_section<WeightDelta>(is);
+    if (!is)
+    {
+        cerr << "truncated delta file" << endl;
+        exit(EXIT_FAILURE);
+    }
+    // maintenance on top of the delta needs the graph in the state the delta was written from
+    if (g != nullptr && header.version < 6)
+    {
+        cerr << "delta file holds no graph weights; it can only be applied for queries or compaction" << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (g != nullptr)
+        for (const WeightDelta &d : weights)
+        {
+            g->update_edge(d.v, d.w, d.distance);
+            g->update_edge(d.w, d.v, d.distance);
+        }
+    if (weights_out != nullptr)
+        for (const WeightDelta &d : weights)
+            weights_out->push_back(Edge(d.v, d.w, d.distance));
+    if (ch == nullptr)
+        return header.version >= 6;
+    for (const EdgeDelta &d : edges)
+    {
+        Neighbor *n = ch->up_neighbor(d.v, d.w);
+        if (n == nullptr)
+        {
+            cerr << "delta file does not match shortcut graph" << endl;
+            exit(EXIT_FAILURE);
+        }
+        n->distance = d.distance;
+        n->path_count = path_t(d.paths);
+        if (ch->tracking)
+            ch->changed_edges.push_back(make_pair(d.v, d.w));
+    }
+    return header.version >= 6;
+}
+
+// weight files consist of a header with node count, followed by a section holding the weights of graph edges changed
+// by the deltas merged into an index
+static const uint64_t weights_magic = 0x5448474945574e00ull;
+
+static vector<WeightDelta> read_weight_file(const string &filename, size_t node_count)
+{
+    ifstream is(filename);
+    if (!is)
+        return {};
+    FileHeader header(weights_magic);
+    if (header.read(is) != node_count || header.version == 0)
+    {
+        cerr << "weights in " << filename << " do not match index" << endl;
+        exit(EXIT_FAILURE);
+    }
+    return read_section<WeightDelta>(is);
+}
+
+void read_weights(Graph &g, const string &filename)
+{
+    for (const WeightDelta &d : read_weight_file(filename, g.node_count()))
+    {
+        g.update_edge(d.v, d.w, d.distance);
+        g.update_edge(d.w, d.v, d.distance);
+    }
+}
+
+void compact_index(const string &index_prefix, const vector<string> &delta_files, const string &target_prefix)
+{
+    ContractionIndex ci(index_prefix + "_cl");
+    bool compressed = ci.is_compressed();
+    ifstream ifs(index_prefix + "_gs");
+    ContractionHierarchy ch(ifs);
+    ifs.close();
+    // later weights of an edge replace earlier ones
+    map<pair<NodeID, NodeID>, distance_t> merged;
+    for (const WeightDelta &d : read_weight_file(index_prefix + "_w", ch.node_count() - 1))
+        merged[make_pair(d.v, d.w)] = d.distance;
+    for (const string &delta_file : delta_files)
+    {
+        ifstream dfs(delta_file);
+        vector<Edge> weights;
+        if (!ci.apply_delta(dfs, ch, weights))
+            cerr << "delta file " << delta_file << " holds no graph weights; maintenance on the merged index needs a graph file with current weights" << endl;
+        for (const Edge &e : weights)
+            merged[make_pair(e.a, e.b)] = e.d;
+    }
+    vector<WeightDelta> weights;
+    for (const auto &[edge, distance] : merged)
+        weights.push_back({ edge.first, edge.second, distance });
+    // merged index keeps the label format of the base index
+    if (compressed)
+        ci.compress();
+    // write to temporary files first, so readers (including ci, which maps the base file) never see partial files
+    for (const char* suffix : { "_cl", "_gs", "_w" })
+    {
+        string target = target_prefix + suffix;
+        ofstream ofs(target + ".tmp");
+        if (suffix == string("_cl"))
+            ci.write(ofs);
+        else if (suffix == string("_gs"))
+            ch.write(ofs);
+        else
+        {
+            FileHeader::current(weights_magic).write(ofs, ch.node_count() - 1);
+            write_section(ofs, weights);
+        }
+        ofs.close();
+        if (!ofs || rename((target + ".tmp").c_str(), target.c_str()) != 0)
+        {
+            cerr << "cannot write " << target << endl;
+            exit(EXIT_FAILURE);
         }
     }
 }
@@ -922,7 +2802,7 @@ Neighbor::Neighbor(NodeID node, distance_t distance) : node(node), distance(dist
 {
 }
 
-Neighbor::Neighbor(NodeID node, distance_t distance, size_t path_count) : node(node), distance(distance), path_count(path_count)
+Neighbor::Neighbor(NodeID node, distance_t distance, path_t path_count) : node(node), distance(distance), path_count(path_count)
 {
 }
 
@@ -938,28 +2818,100 @@ Node::Node(SubgraphID subgraph_id) : subgraph_id(subgraph_id)
     landmark_level = 0;
 }
 
-Node& MultiThreadNodeData::operator[](size_type pos)
+inline NodeRef::NodeRef(Node &n) : neighbors(n.neighbors), subgraph_id(n.subgraph_id), distance(n.distance), outcopy_distance(n.outcopy_distance), path_count(n.path_count),
+#ifdef MULTI_THREAD_DISTANCES
+    distances(n.distances),
+#endif
+    inflow(n.inflow), outflow(n.outflow), landmark_level(n.landmark_level)
 {
-    if (pos == Graph::s)
-        return s_data;
-    if (pos == Graph::t)
-        return t_data;
-    return vector::operator[](pos);
 }
 
-const Node& MultiThreadNodeData::operator[](size_type pos) const
+inline NodeRef::NodeRef(vector<Neighbor> &neighbors, SubgraphID &subgraph_id, distance_t &distance, distance_t &outcopy_distance, path_t &path_count,
+#ifdef MULTI_THREAD_DISTANCES
+    distance_t *distances,
+#endif
+    NodeID &inflow, NodeID &outflow, uint16_t &landmark_level)
+    : neighbors(neighbors), subgraph_id(subgraph_id), distance(distance), outcopy_distance(outcopy_distance), path_count(path_count),
+#ifdef MULTI_THREAD_DISTANCES
+    distances(distances),
+#endif
+    inflow(inflow), outflow(outflow), landmark_level(landmark_level)
+{
+}
+
+inline NodeRef MultiThreadNodeData::operator[](size_type pos)
 {
     if (pos == Graph::s)
-        return s_data;
+        return NodeRef(s_data);
     if (pos == Graph::t)
-        return t_data;
-    return vector::operator[](pos);
+        return NodeRef(t_data);
+    DistanceData &dd = distance_data[pos];
+    FlowData &fd = flow_data[pos];
+    return NodeRef(neighbors[pos], subgraph_ids[pos], dd.distance, dd.outcopy_distance, dd.path_count,
+#ifdef MULTI_THREAD_DISTANCES
+        parallel_distances[pos].data(),
+#endif
+        fd.inflow, fd.outflow, dd.landmark_level);
+}
+
+Node MultiThreadNodeData::node(size_type pos) const
+{
+    Node n(subgraph_ids[pos]);
+    n.neighbors = neighbors[pos];
+    n.distance = distance_data[pos].distance;
+    n.outcopy_distance = distance_data[pos].outcopy_distance;
+    n.path_count = distance_data[pos].path_count;
+    n.landmark_level = distance_data[pos].landmark_level;
+#ifdef MULTI_THREAD_DISTANCES
+    copy(parallel_distances[pos].begin(), parallel_distances[pos].end(), n.distances);
+#endif
+    n.inflow = flow_data[pos].inflow;
+    n.outflow = flow_data[pos].outflow;
+    return n;
+}
+
+MultiThreadNodeData::size_type MultiThreadNodeData::size() const
+{
+    return subgraph_ids.size();
+}
+
+void MultiThreadNodeData::clear()
+{
+    neighbors.clear();
+    subgraph_ids.clear();
+    distance_data.clear();
+#ifdef MULTI_THREAD_DISTANCES
+    parallel_distances.clear();
+#endif
+    flow_data.clear();
+}
+
+void MultiThreadNodeData::resize(size_type count, const Node &value)
+{
+    neighbors.resize(count, value.neighbors);
+    subgraph_ids.resize(count, value.subgraph_id);
+    distance_data.resize(count, DistanceData { value.distance, value.outcopy_distance, value.path_count, value.landmark_level });
+#ifdef MULTI_THREAD_DISTANCES
+    array<distance_t, MULTI_THREAD_DISTANCES> distances;
+    copy(value.distances, value.distances + MULTI_THREAD_DISTANCES, distances.begin());
+    parallel_distances.resize(count, distances);
+#endif
+    flow_data.resize(count, FlowData { value.inflow, value.outflow });
 }
 
 void MultiThreadNodeData::normalize()
 {
-    vector::operator[](Graph::s) = s_data;
-    vector::operator[](Graph::t) = t_data;
+    for (NodeID v : { Graph::s, Graph::t })
+    {
+        const Node &n = v == Graph::s ? s_data : t_data;
+        neighbors[v] = n.neighbors;
+        subgraph_ids[v] = n.subgraph_id;
+        distance_data[v] = DistanceData { n.distance, n.outcopy_distance, n.path_count, n.landmark_level };
+#ifdef MULTI_THREAD_DISTANCES
+        copy(n.distances, n.distances + MULTI_THREAD_DISTANCES, parallel_distances[v].begin());
+#endif
+        flow_data[v] = FlowData { n.inflow, n.outflow };
+    }
 }
 
 double Partition::rating() const
@@ -1013,6 +2965,43 @@ void Graph::show_progress(bool state)
     log_progress_on = state;
 }
 
+// tasks of index construction (subgraph recursion & distance computations) get executed by a persistent pool
+static size_t thread_count = max<size_t>(thread::hardware_concurrency(), 1);
+static unique_ptr<util::ThreadPool> pool;
+// pool gets created on first use, possibly by several threads at once (e.g. background compaction)
+static atomic<util::ThreadPool*> pool_instance = nullptr;
+static mutex pool_mutex;
+
+static util::ThreadPool& thread_pool()
+{
+    util::ThreadPool *instance = pool_instance.load(memory_order_acquire);
+    if (instance == nullptr)
+    {
+        lock_guard<mutex> lock(pool_mutex);
+        if (!pool)
+        {
+            pool = make_unique<util::ThreadPool>(thread_count - 1);
+            pool_instance.store(pool.get(), memory_order_release);
+        }
+        instance = pool.get();
+    }
+    return *instance;
+}
+
+bool Graph::set_thread_count(size_t threads)
+{
+    lock_guard<mutex> lock(pool_mutex);
+    if (pool && pool->busy())
+    {
+        cerr << "cannot change thread count while tasks are running" << endl;
+        return false;
+    }
+    thread_count = max<size_t>(threads, 1);
+    pool_instance.store(nullptr, memory_order_release);
+    pool.reset();
+    return true;
+}
+
 bool Graph::contains(NodeID node) const
 {
     return node_data[node].subgraph_id == subgraph_id;
@@ -1028,8 +3017,7 @@ Graph::Graph(size_t node_count)
 
 Graph::Graph(size_t node_count, const vector<Edge> &edges) : Graph(node_count)
 {
-    for (Edge e : edges)
-        add_edge(e.a, e.b, e.d, true);
+    add_edges(edges);
 }
 
 void Graph::resize(size_t node_count)
@@ -1069,6 +3057,51 @@ void Graph::add_edge(NodeID v, NodeID w, distance_t distance, bool add_reverse)
         add_edge(w, v, distance, false);
 }
 
+void Graph::add_edges(const vector<Edge> &edges)
+{
+    // group edge endpoints by node, keeping insertion order
+    vector<size_t> offsets(node_data.size() + 1, 0);
+    for (const Edge &e : edges)
+    {
+        assert(e.a < node_data.size() && e.b < node_data.size() && e.d > 0);
+        offsets[e.a + 1]++;
+        offsets[e.b + 1]++;
+    }
+    for (size_t v = 0; v < node_data.size(); v++)
+        offsets[v + 1] += offsets[v];
+    vector<Neighbor> grouped(offsets.back(), Neighbor(NO_NODE, 0));
+    vector<size_t> next(offsets.begin(), offsets.end() - 1);
+    for (const Edge &e : edges)
+    {
+        grouped[next[e.a]++] = Neighbor(e.b, e.d);
+        grouped[next[e.b]++] = Neighbor(e.a, e.d);
+    }
+    // merge into neighbor lists, nodes being independent
+    auto merge_range = [this, &offsets, &grouped](NodeID begin, NodeID end) {
+        for (NodeID v = begin; v < end; v++)
+        {
+            vector<Neighbor> &neighbors = node_data[v].neighbors;
+            neighbors.reserve(neighbors.size() + offsets[v + 1] - offsets[v]);
+            for (size_t i = offsets[v]; i < offsets[v + 1]; i++)
+            {
+                auto it = find_if(neighbors.begin(), neighbors.end(), [&grouped, i](const Neighbor &n) { return n.node == grouped[i].node; });
+                if (it == neighbors.end())
+                    neighbors.push_back(grouped[i]);
+                else
+                    it->distance = min(it->distance, grouped[i].distance);
+            }
+        }
+    };
+    const NodeID range_size = 1 << 16;
+    util::ThreadPool::TaskGroup group;
+    for (NodeID begin = 0; begin < node_data.size(); begin += range_size)
+    {
+        NodeID end = min<size_t>(begin + range_size, node_data.size());
+        thread_pool().run(group, [&merge_range, begin, end] { merge_range(begin, end); });
+    }
+    thread_pool().wait(group);
+}
+
 void Graph::remove_edge(NodeID v, NodeID w)
 {
     std::erase_if(node_data[v].neighbors, [w](const Neighbor &n) { return n.node == w; });
@@ -1092,6 +3125,14 @@ void Graph::update_edge(NodeID v, NodeID w, distance_t d)
                 }
 }
 
+distance_t Graph::edge_weight(NodeID v, NodeID w) const
+{
+        for (const Neighbor &n : node_data[v].neighbors)
+                if (n.node == w)
+                        return n.distance;
+        return infinity;
+}
+
 void Graph::remove_isolated()
 {
     unordered_set<NodeID> isolated;
@@ -1233,6 +3274,14 @@ struct SearchNode
     SearchNode(distance_t distance, NodeID node) : distance(distance), node(node) {}
 };
 
+// Dijkstra queue re-used by all searches of a thread, to avoid re-allocation
+static util::radix_heap<SearchNode>& search_queue()
+{
+    thread_local static util::radix_heap<SearchNode> q;
+    q.clear();
+    return q;
+}
+
 void Graph::run_dijkstra(NodeID v)
 {
     CHECK_CONSISTENT;
@@ -1245,13 +3294,15 @@ void Graph::run_dijkstra(NodeID v)
     node_data[v].distance = 0;
     node_data[v].path_count = 1;
     // init queue
-    priority_queue<SearchNode> q;
+    util::radix_heap<SearchNode> &q = search_queue();
     q.push(SearchNode(0, v));
     // dijkstra
     while (!q.empty())
     {
-        SearchNode next = q.top();
-        q.pop();
+        SearchNode next = q.pop();
+        // skip outdated queue entries
+        if (next.distance > node_data[next.node].distance)
+            continue;
 
         for (Neighbor n : node_data[next.node].neighbors)
         {
@@ -1282,17 +3333,19 @@ void Graph::run_dijkstra_llsub(NodeID v)
         node_data[node].distance = infinity;
     node_data[v].distance = 0;
     // init queue
-    priority_queue<SearchNode> q;
+    util::radix_heap<SearchNode> &q = search_queue();
     q.push(SearchNode(0, v));
     // dijkstra
     while (!q.empty())
     {
-        SearchNode next = q.top();
-        q.pop();
+        SearchNode next = q.pop();
+        // skip outdated queue entries
+        if (next.distance > node_data[next.node].distance)
+            continue;
 
         for (Neighbor n : node_data[next.node].neighbors)
         {
-            Node &n_data = node_data[n.node];
+            NodeRef n_data = node_data[n.node];
             // filter neighbors nodes not belonging to subgraph or having higher landmark level
             if (!contains(n.node) || n_data.landmark_level >= pruning_level)
                 continue;
@@ -1318,7 +3371,7 @@ void Graph::run_dijkstra_ll(NodeID v)
         node_data[node].distance = infinity;
     node_data[v].distance = 1;
     // init queue
-    priority_queue<SearchNode> q;
+    util::radix_heap<SearchNode> &q = search_queue();
     for (Neighbor n : node_data[v].neighbors)
     {
         distance_t n_dist = (n.distance << 1) | 1;
@@ -1328,10 +3381,12 @@ void Graph::run_dijkstra_ll(NodeID v)
     // dijkstra
     while (!q.empty())
     {
-        SearchNode next = q.top();
-        q.pop();
+        SearchNode next = q.pop();
+        // skip outdated queue entries
+        if (next.distance > node_data[next.node].distance)
+            continue;
 
-        const Node &next_data = node_data[next.node];
+        NodeRef next_data = node_data[next.node];
         distance_t current_dist = next_data.landmark_level >= pruning_level ? next.distance & ~static_cast<distance_t>(1) : next.distance;
         for (Neighbor n : next_data.neighbors)
         {
@@ -1354,7 +3409,6 @@ void Graph::run_dijkstra_ll(NodeID v)
 void Graph::run_dijkstra_par(const vector<NodeID> &vertices)
 {
     CHECK_CONSISTENT;
-    vector<thread> threads;
     auto dijkstra = [this](NodeID v, size_t distance_id) {
         assert(contains(v));
         assert(distance_id < MULTI_THREAD_DISTANCES);
@@ -1363,13 +3417,15 @@ void Graph::run_dijkstra_par(const vector<NodeID> &vertices)
             node_data[node].distances[distance_id] = infinity;
         node_data[v].distances[distance_id] = 0;
         // init queue
-        priority_queue<SearchNode> q;
+        util::radix_heap<SearchNode> &q = search_queue();
         q.push(SearchNode(0, v));
         // dijkstra
         while (!q.empty())
         {
-            SearchNode next = q.top();
-            q.pop();
+            SearchNode next = q.pop();
+            // skip outdated queue entries
+            if (next.distance > node_data[next.node].distances[distance_id])
+                continue;
 
             for (Neighbor n : node_data[next.node].neighbors)
             {
@@ -1386,16 +3442,15 @@ void Graph::run_dijkstra_par(const vector<NodeID> &vertices)
             }
         }
     };
+    util::ThreadPool::TaskGroup group;
     for (size_t i = 0; i < vertices.size(); i++)
-        threads.push_back(thread(dijkstra, vertices[i], i));
-    for (size_t i = 0; i < vertices.size(); i++)
-        threads[i].join();
+        thread_pool().run(group, [&dijkstra, &vertices, i] { dijkstra(vertices[i], i); });
+    thread_pool().wait(group);
 }
 
 void Graph::run_dijkstra_llsub_par(const std::vector<NodeID> &vertices)
 {
     CHECK_CONSISTENT;
-    vector<thread> threads;
     auto dijkstra = [this](NodeID v, size_t distance_id) {
         assert(contains(v));
         assert(distance_id < MULTI_THREAD_DISTANCES);
@@ -1405,17 +3460,19 @@ void Graph::run_dijkstra_llsub_par(const std::vector<NodeID> &vertices)
             node_data[node].distances[distance_id] = infinity;
         node_data[v].distances[distance_id] = 0;
         // init queue
-        priority_queue<SearchNode> q;
+        util::radix_heap<SearchNode> &q = search_queue();
         q.push(SearchNode(0, v));
         // dijkstra
         while (!q.empty())
         {
-            SearchNode next = q.top();
-            q.pop();
+            SearchNode next = q.pop();
+            // skip outdated queue entries
+            if (next.distance > node_data[next.node].distances[distance_id])
+                continue;
 
             for (Neighbor n : node_data[next.node].neighbors)
             {
-                Node &n_data = node_data[n.node];
+                NodeRef n_data = node_data[n.node];
                 // filter neighbors nodes not belonging to subgraph or having higher landmark level
                 if (!contains(n.node) || n_data.landmark_level >= pruning_level)
                     continue;
@@ -1429,17 +3486,16 @@ void Graph::run_dijkstra_llsub_par(const std::vector<NodeID> &vertices)
             }
         }
     };
+    util::ThreadPool::TaskGroup group;
     for (size_t i = 0; i < vertices.size(); i++)
-        threads.push_back(thread(dijkstra, vertices[i], i));
-    for (size_t i = 0; i < vertices.size(); i++)
-        threads[i].join();
+        thread_pool().run(group, [&dijkstra, &vertices, i] { dijkstra(vertices[i], i); });
+    thread_pool().wait(group);
 }
 
 #ifdef PRUNING
 void Graph::run_dijkstra_ll_par(const vector<NodeID> &vertices)
 {
     CHECK_CONSISTENT;
-    vector<thread> threads;
     auto dijkstra = [this](NodeID v, size_t distance_id) {
         assert(contains(v));
         assert(distance_id < MULTI_THREAD_DISTANCES);
@@ -1449,7 +3505,7 @@ void Graph::run_dijkstra_ll_par(const vector<NodeID> &vertices)
             node_data[node].distances[distance_id] = infinity;
         node_data[v].distances[distance_id] = 1;
         // init queue
-        priority_queue<SearchNode> q;
+        util::radix_heap<SearchNode> &q = search_queue();
         for (Neighbor n : node_data[v].neighbors)
         {
             distance_t n_dist = (n.distance << 1) | 1;
@@ -1459,10 +3515,12 @@ void Graph::run_dijkstra_ll_par(const vector<NodeID> &vertices)
         // dijkstra
         while (!q.empty())
         {
-            SearchNode next = q.top();
-            q.pop();
+            SearchNode next = q.pop();
+            // skip outdated queue entries
+            if (next.distance > node_data[next.node].distances[distance_id])
+                continue;
 
-            const Node &next_data = node_data[next.node];
+            NodeRef next_data = node_data[next.node];
             distance_t current_dist = next_data.landmark_level >= pruning_level ? next.distance & ~static_cast<distance_t>(1) : next.distance;
             for (Neighbor n : next_data.neighbors)
             {
@@ -1479,10 +3537,10 @@ void Graph::run_dijkstra_ll_par(const vector<NodeID> &vertices)
             }
         }
     };
+    util::ThreadPool::TaskGroup group;
     for (size_t i = 0; i < vertices.size(); i++)
-        threads.push_back(thread(dijkstra, vertices[i], i));
-    for (size_t i = 0; i < vertices.size(); i++)
-        threads[i].join();
+        thread_pool().run(group, [&dijkstra, &vertices, i] { dijkstra(vertices[i], i); });
+    thread_pool().wait(group);
 }
 #endif
 #endif
@@ -1491,6 +3549,13 @@ void Graph::run_bfs(NodeID v)
 {
     CHECK_CONSISTENT;
     assert(contains(v));
+#ifdef MULTI_THREAD
+    if (nodes.size() > thread_threshold && thread_count > 1)
+    {
+        run_bfs_par(v);
+        return;
+    }
+#endif
     // init distances
     for (NodeID node : nodes)
         node_data[node].distance = infinity;
@@ -1518,6 +3583,90 @@ void Graph::run_bfs(NodeID v)
     }
 }
 
+#ifdef MULTI_THREAD
+void Graph::run_bfs_par(NodeID v)
+{
+    CHECK_CONSISTENT;
+    assert(contains(v));
+    // init distances
+    for (NodeID node : nodes)
+        node_data[node].distance = infinity;
+    node_data[v].distance = 0;
+    // level-synchronous BFS; nodes get claimed atomically, so distances are the same as for sequential BFS
+    vector<NodeID> level(1, v);
+    for (distance_t new_dist = 1; !level.empty(); new_dist++)
+    {
+        size_t chunks = min(thread_count, (level.size() + BFS_GRAIN - 1) / BFS_GRAIN);
+        vector<vector<NodeID>> next(chunks);
+        auto expand = [this, &level, &next, chunks, new_dist](size_t c) {
+            for (size_t i = level.size() * c / chunks; i < level.size() * (c + 1) / chunks; i++)
+                for (Neighbor n : node_data[level[i]].neighbors)
+                {
+                    // filter neighbors nodes not belonging to subgraph or already visited
+                    if (!contains(n.node))
+                        continue;
+                    atomic_ref<distance_t> distance(node_data[n.node].distance);
+                    distance_t expected = infinity;
+                    if (distance.load(memory_order_relaxed) == infinity && distance.compare_exchange_strong(expected, new_dist, memory_order_relaxed))
+                        next[c].push_back(n.node);
+                }
+        };
+        if (chunks > 1)
+        {
+            util::ThreadPool::TaskGroup group;
+            for (size_t c = 0; c < chunks; c++)
+                thread_pool().run(group, [&expand, c] { expand(c); });
+            thread_pool().wait(group);
+        }
+        else
+            expand(0);
+        level.clear();
+        for (const vector<NodeID> &chunk : next)
+            level.insert(level.end(), chunk.cbegin(), chunk.cend());
+    }
+}
+#endif
+
+#ifdef MULTI_THREAD_DISTANCES
+void Graph::run_bfs_par(const vector<NodeID> &vertices)
+{
+    CHECK_CONSISTENT;
+    auto bfs = [this](NodeID v, size_t distance_id) {
+        assert(contains(v));
+        assert(distance_id < MULTI_THREAD_DISTANCES);
+        // init distances
+        for (NodeID node : nodes)
+            node_data[node].distances[distance_id] = infinity;
+        node_data[v].distances[distance_id] = 0;
+        // init queue
+        queue<NodeID> q;
+        q.push(v);
+        // BFS
+        while (!q.empty())
+        {
+            NodeID next = q.front();
+            q.pop();
+
+            distance_t new_dist = node_data[next].distances[distance_id] + 1;
+            for (Neighbor n : node_data[next].neighbors)
+            {
+                // filter neighbors nodes not belonging to subgraph or already visited
+                if (contains(n.node) && node_data[n.node].distances[distance_id] == infinity)
+                {
+                    // update distance and enque
+                    node_data[n.node].distances[distance_id] = new_dist;
+                    q.push(n.node);
+                }
+            }
+        }
+    };
+    util::ThreadPool::TaskGroup group;
+    for (size_t i = 0; i < vertices.size(); i++)
+        thread_pool().run(group, [&bfs, &vertices, i] { bfs(vertices[i], i); });
+    thread_pool().wait(group);
+}
+#endif
+
 // node in flow graph which splits nodes into incoming and outgoing copies
 struct FlowNode
 {
@@ -1692,7 +3841,7 @@ distance_t Graph::get_distance(NodeID v, NodeID w, bool weighted)
     return node_data[w].distance;
 }
 
-distance_t Graph::get_path_count(NodeID v, NodeID w, bool weighted)
+path_t Graph::get_path_count(NodeID v, NodeID w, bool weighted)
 {
     assert(contains(v) && contains(w));
     weighted ? run_dijkstra(v) : run_bfs(v);
@@ -1767,47 +3916,52 @@ bool Graph::get_rough_partition(Partition &p, double balance, bool disconnected)
     DEBUG("get_rough_partition, p=" << p << ", disconnected=" << disconnected << " on " << *this);
     CHECK_CONSISTENT;
     assert(p.left.empty() && p.cut.empty() && p.right.empty());
-    if (disconnected)
+    // find two extreme points; first search also reveals whether graph is connected
+#ifdef NDEBUG
+    NodeID a = get_furthest(random_node(), weighted_furthest).first;
+#else
+    NodeID a = get_furthest(nodes[0], weighted_furthest).first;
+#endif
+    if (disconnected && node_data[a].distance == infinity)
     {
         vector<vector<NodeID>> cc;
         get_connected_components(cc);
-        if (cc.size() > 1)
+        assert(cc.size() > 1);
+        DEBUG("found multiple connected components: " << cc);
+        sort(cc.begin(), cc.end(), cmp_size_desc);
+        // for size zero cuts we loosen the balance requirement
+        if (cc[0].size() < nodes.size() * (1 - balance/2))
         {
-            DEBUG("found multiple connected components: " << cc);
-            sort(cc.begin(), cc.end(), cmp_size_desc);
-            // for size zero cuts we loosen the balance requirement
-            if (cc[0].size() < nodes.size() * (1 - balance/2))
-            {
-                for (vector<NodeID> &c : cc)
-                    add_to_smaller(p.left, p.right, c);
-                return true;
-            }
-            // get rough partion over main component
-            Graph main_cc(cc[0].begin(), cc[0].end());
-            bool is_fine = main_cc.get_rough_partition(p, balance, false);
-            // reset subgraph ids
-            for (NodeID node : main_cc.nodes)
-                node_data[node].subgraph_id = subgraph_id;
-            if (is_fine)
-            {
-                // distribute remaining components
-                for (size_t i = 1; i < cc.size(); i++)
-                    add_to_smaller(p.left, p.right, cc[i]);
-            }
-            return is_fine;
+            for (vector<NodeID> &c : cc)
+                add_to_smaller(p.left, p.right, c);
+            return true;
         }
+        // get rough partion over main component
+        Graph main_cc(cc[0].begin(), cc[0].end());
+        bool is_fine = main_cc.get_rough_partition(p, balance, false);
+        // reset subgraph ids
+        for (NodeID node : main_cc.nodes)
+            node_data[node].subgraph_id = subgraph_id;
+        if (is_fine)
+        {
+            // distribute remaining components
+            for (size_t i = 1; i < cc.size(); i++)
+                add_to_smaller(p.left, p.right, cc[i]);
+        }
+        return is_fine;
     }
-    // graph is connected - find two extreme points
-#ifdef NDEBUG
-    NodeID a = get_furthest(random_node(), weighted_furthest).first;
-#else
-    NodeID a = get_furthest(nodes[0], weighted_furthest).first;
-#endif
     NodeID b = get_furthest(a, weighted_furthest).first;
     DEBUG("furthest nodes: a=" << a << ", b=" << b);
-    // get distances from a and b and sort by difference
+    // get distances from a and b; distances from a are left over from search for b unless weighting differs
     vector<DiffData> diff;
-    get_diff_data(diff, a, b, weighted_diff, weighted_furthest);
+    get_diff_data(diff, a, b, weighted_diff, weighted_diff == weighted_furthest);
+    return diff_to_rough_partition(p, balance, diff);
+}
+
+bool Graph::diff_to_rough_partition(Partition &p, double balance, vector<DiffData> &diff)
+{
+    assert(diff.size() == nodes.size());
+    // sort by difference
     sort(diff.begin(), diff.end(), DiffData::cmp_diff);
     DEBUG("diff=" << diff);
     // get parition bounds based on balance; round up if possible
@@ -2176,6 +4330,11 @@ void Graph::create_partition(Partition &p, double balance)
         DEBUG("get_rough_partition found partition=" << p);
         return;
     }
+    rough_to_partition(p);
+}
+
+void Graph::rough_to_partition(Partition &p)
+{
     // find minimum cut
     vector<vector<NodeID>> cuts;
     rough_partition_to_cuts(cuts, p);
@@ -2194,6 +4353,73 @@ void Graph::create_partition(Partition &p, double balance)
     DEBUG("partition=" << p);
 }
 
+void Graph::create_partitions(vector<Partition> &candidates, double balance)
+{
+    CHECK_CONSISTENT;
+    assert(nodes.size() > 1);
+#ifdef MULTI_THREAD_DISTANCES
+    // searches for extreme points use one distance slot per candidate; max-flow computations share flow data and remain sequential
+    auto search = [this](const vector<NodeID> &vertices, bool weighted) {
+        weighted ? run_dijkstra_par(vertices) : run_bfs_par(vertices);
+    };
+    auto furthest = [this](NodeID v, size_t distance_id) {
+        NodeID f = v;
+        for (NodeID node : nodes)
+            if (node_data[node].distances[distance_id] > node_data[f].distances[distance_id])
+                f = node;
+        return f;
+    };
+    for (size_t offset = 0; offset < candidates.size(); offset += MULTI_THREAD_DISTANCES)
+    {
+        size_t count = min<size_t>(MULTI_THREAD_DISTANCES, candidates.size() - offset);
+        vector<NodeID> a(count), b(count);
+        for (size_t i = 0; i < count; i++)
+#ifdef NDEBUG
+            a[i] = random_node();
+#else
+            a[i] = nodes[(offset + i) % nodes.size()];
+#endif
+        search(a, weighted_furthest);
+        for (size_t i = 0; i < count; i++)
+            a[i] = furthest(a[i], i);
+        // disconnected graphs are handled by get_rough_partition
+        if (node_data[a[0]].distances[0] == infinity)
+        {
+            for (size_t i = offset; i < candidates.size(); i++)
+                create_partition(candidates[i], balance);
+            return;
+        }
+        search(a, weighted_furthest);
+        for (size_t i = 0; i < count; i++)
+            b[i] = furthest(a[i], i);
+        // get distances from a and b
+        if (weighted_diff != weighted_furthest)
+            search(a, weighted_diff);
+        vector<vector<DiffData>> diffs(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            diffs[i].reserve(nodes.size());
+            for (NodeID node : nodes)
+                diffs[i].push_back(DiffData(node, node_data[node].distances[i], 0));
+        }
+        search(b, weighted_diff);
+        for (size_t i = 0; i < count; i++)
+            for (DiffData &dd : diffs[i])
+                dd.dist_b = node_data[dd.node].distances[i];
+        for (size_t i = 0; i < count; i++)
+        {
+            Partition &p = candidates[offset + i];
+            if (!diff_to_rough_partition(p, balance, diffs[i]))
+                rough_to_partition(p);
+            DEBUG("candidate partition=" << p);
+        }
+    }
+#else
+    for (Partition &p : candidates)
+        create_partition(p, balance);
+#endif
+}
+
 void Graph::add_shortcuts(const vector<NodeID> &cut, const vector<CutIndex> &ci)
 {
     CHECK_CONSISTENT;
@@ -2343,9 +4569,10 @@ void Graph::extend_on_partition(vector<CutIndex> &ci, double balance, uint8_t cu
     {
         Graph g(p.begin(), p.end());
 #ifndef NO_SHORTCUTS
-        START_TIMER;
-        g.add_shortcuts(cut, ci);
-        STOP_TIMER(t_shortcut);
+        {
+            metrics::PhaseTimer timer(metrics::Phase::shortcuts);
+            g.add_shortcuts(cut, ci);
+        }
 #endif
         g.extend_cut_index(ci, balance, cut_level + 1);
     }
@@ -2378,18 +4605,17 @@ void Graph::extend_cut_index(vector<CutIndex> &ci, double balance, uint8_t cut_l
     Partition p;
     if (cut_level < MAX_CUT_LEVEL)
     {
-        START_TIMER;
-        create_partition(p, balance);
+        metrics::PhaseTimer timer(metrics::Phase::partition);
 #ifdef CUT_REPEAT
+        vector<Partition> candidates(CUT_REPEAT);
+        create_partitions(candidates, balance);
+        p = candidates[0];
         for (size_t i = 1; i < CUT_REPEAT; i++)
-        {
-            Partition p_new;
-            create_partition(p_new, balance);
-            if (p_new.rating() > p.rating())
-                p = p_new;
-        }
+            if (candidates[i].rating() > p.rating())
+                p = candidates[i];
+#else
+        create_partition(p, balance);
 #endif
-        STOP_TIMER(t_partition);
     }
     else
         p.cut = nodes;
@@ -2401,10 +4627,11 @@ void Graph::extend_cut_index(vector<CutIndex> &ci, double balance, uint8_t cut_l
     for (NodeID node : nodes)
     {
         assert(ci[node].dist_index.size() == cut_level);
+        uint16_t parent_index = cut_level == 0 ? 0 : ci[node].dist_index[cut_level - 1];
         if(node_data[node].landmark_level == 0)
-            ci[node].dist_index.push_back(ci[node].dist_index[cut_level - 1] + p.cut.size());
+            ci[node].dist_index.push_back(parent_index + p.cut.size());
 	else 
-	    ci[node].dist_index.push_back(ci[node].dist_index[cut_level - 1] + (p.cut.size() - node_data[node].landmark_level + 1));
+	    ci[node].dist_index.push_back(parent_index + (p.cut.size() - node_data[node].landmark_level + 1));
     }
 
     // set cut_level
@@ -2421,15 +4648,15 @@ void Graph::extend_cut_index(vector<CutIndex> &ci, double balance, uint8_t cut_l
     // reset landmark flags
     for (NodeID c : p.cut)
         node_data[c].landmark_level = 0;
-    STOP_TIMER(t_label);
 
     // add shortcuts and recurse
 #ifdef MULTI_THREAD
     if (nodes.size() > thread_threshold)
     {
-        std::thread t_left(extend_on_partition, std::ref(ci), balance, cut_level, std::cref(p.left), std::cref(p.cut));
+        util::ThreadPool::TaskGroup group;
+        thread_pool().run(group, [&ci, balance, cut_level, &p] { extend_on_partition(ci, balance, cut_level, p.left, p.cut); });
         extend_on_partition(ci, balance, cut_level, p.right, p.cut);
-        t_left.join();
+        thread_pool().wait(group);
     }
     else
 #endif
@@ -2441,9 +4668,7 @@ void Graph::extend_cut_index(vector<CutIndex> &ci, double balance, uint8_t cut_l
 
 size_t Graph::create_cut_index(std::vector<CutIndex> &ci, double balance)
 {
-#ifndef NPROFILE
-    t_partition = t_label = t_shortcut = 0;
-#endif
+    metrics::PhaseTimer timer(metrics::Phase::create_cut_index);
     assert(is_undirected());
 #ifndef NDEBUG
     // sort neighbors to make algorithms deterministic
@@ -2471,11 +4696,6 @@ size_t Graph::create_cut_index(std::vector<CutIndex> &ci, double balance)
     for (NodeID node : nodes)
         if (!ci[node].is_consistent())
             cerr << "inconsistent cut index for node " << node << ": "<< ci[node] << endl;
-#endif
-#ifndef NPROFILE
-    cerr << "partitioning took " << t_partition << "s" << endl;
-    cerr << "labeling took " << t_label << "s" << endl;
-    cerr << "shortcuts took " << t_shortcut << "s" << endl;
 #endif
     //return shortcuts / 2;
     return 0;
@@ -2490,9 +4710,9 @@ void Graph::get_redundant_edges(std::vector<Edge> &edges)
         node_data[node].distance = infinity;
     // run localized Dijkstra from each node
     vector<NodeID> visited;
-    priority_queue<SearchNode> q;
     for (NodeID v : nodes)
     {
+        util::radix_heap<SearchNode> &q = search_queue();
         node_data[v].distance = 0;
         visited.push_back(v);
         distance_t max_dist = 0;
@@ -2507,8 +4727,7 @@ void Graph::get_redundant_edges(std::vector<Edge> &edges)
         // dijkstra
         while (!q.empty())
         {
-            SearchNode next = q.top();
-            q.pop();
+            SearchNode next = q.pop();
 
             for (Neighbor n : node_data[next.node].neighbors)
             {
@@ -2539,6 +4758,7 @@ void Graph::get_redundant_edges(std::vector<Edge> &edges)
 
 void Graph::contract(vector<Neighbor> &closest)
 {
+    metrics::PhaseTimer timer(metrics::Phase::contract);
     closest.resize(node_data.size() - 2, Neighbor(NO_NODE, 0));
     for (NodeID node : nodes)
         closest[node] = Neighbor(node, 0);
@@ -2581,112 +4801,204 @@ ContractionHierarchy::ContractionHierarchy() {
 
 ContractionHierarchy::ContractionHierarchy(istream &is) {
 
-    size_t count, node_count, total_size = 0;
-    is.read((char*)&node_count, sizeof(size_t));
-    nodes.resize(node_count);
-    for(NodeID i = 1; i < node_count; i++) {
-        is.read((char*)&nodes[i].dist_index, sizeof(uint16_t));
-        if(nodes[i].dist_index == 65535)
-            continue;
-        is.read((char*)&count, sizeof(size_t));
-        nodes[i].up_neighbors.reserve(count); total_size += count;
-        for(size_t j = 0; j < count; j++) {
-            Neighbor n(NO_NODE, 0, 0);
-            is.read((char*)&n.node, sizeof(NodeID));
-            is.read((char*)&n.distance, sizeof(distance_t));
-            is.read((char*)&n.path_count, sizeof(uint16_t));
-            nodes[i].up_neighbors.push_back(n);
+    FileHeader header(hierarchy_magic);
+    size_t node_count = header.read(is);
+    dist_index.resize(node_count);
+    if (header.version >= 4)
+    {
+        // bulk format: dist indices, offset arrays, then edge arrays
+        SectionChecksums checksums;
+        auto read_checked = [&is, &checksums](void *data, size_t size) {
+            is.read((char*)data, size);
+            checksums.add_section(data, size);
+        };
+        up_offsets.resize(node_count + 1);
+        down_offsets.resize(node_count + 1);
+        read_checked(dist_index.data(), node_count * sizeof(uint16_t));
+        read_checked(up_offsets.data(), up_offsets.size() * sizeof(size_t));
+        read_checked(down_offsets.data(), down_offsets.size() * sizeof(size_t));
+        // offsets determine the sizes of the edge arrays, so check them before allocating
+        if (!is || !is_sorted(up_offsets.begin(), up_offsets.end()) || !is_sorted(down_offsets.begin(), down_offsets.end()))
+        {
+            cerr << "corrupt shortcut graph file" << endl;
+            exit(EXIT_FAILURE);
         }
-        is.read((char*)&count, sizeof(size_t));
-        nodes[i].down_neighbors.reserve(count);
-        for(size_t j = 0; j < count; j++) {
-            NodeID n;
-            is.read((char*)&n, sizeof(NodeID));
-            nodes[i].down_neighbors.push_back(n);
+        up_edges.resize(up_offsets.back(), Neighbor(NO_NODE, 0, 0));
+        down_edges.resize(down_offsets.back());
+        read_checked(up_edges.data(), up_edges.size() * sizeof(Neighbor));
+        read_checked(down_edges.data(), down_edges.size() * sizeof(NodeID));
+        if (header.version >= 5)
+            checksums.verify(is, "shortcut graph");
+    }
+    else
+    {
+        // edges are stored field by field, so each node's edges get read as one block and then decoded
+        const size_t entry_size = sizeof(NodeID) + sizeof(distance_t) + sizeof(path_t);
+        size_t count;
+        vector<char> buffer;
+        vector<vector<Neighbor>> up(node_count);
+        vector<vector<NodeID>> down(node_count);
+        for(NodeID i = 1; i < node_count; i++) {
+            is.read((char*)&dist_index[i], sizeof(uint16_t));
+            if(dist_index[i] == 65535)
+                continue;
+            is.read((char*)&count, sizeof(size_t));
+            buffer.resize(count * entry_size);
+            is.read(buffer.data(), buffer.size());
+            up[i].resize(count, Neighbor(NO_NODE, 0, 0));
+            for(size_t j = 0; j < count; j++) {
+                const char *entry = buffer.data() + j * entry_size;
+                memcpy(&up[i][j].node, entry, sizeof(NodeID));
+                memcpy(&up[i][j].distance, entry + sizeof(NodeID), sizeof(distance_t));
+                memcpy(&up[i][j].path_count, entry + sizeof(NodeID) + sizeof(distance_t), sizeof(path_t));
+            }
+            is.read((char*)&count, sizeof(size_t));
+            down[i].resize(count);
+            is.read((char*)down[i].data(), count * sizeof(NodeID));
         }
+        assign(up, down);
     }
-    cout << total_size << endl;
 }
 
 void ContractionHierarchy::write(ostream &os) {
 
-    size_t count = nodes.size();
-    os.write((char*)&count, sizeof(size_t));
-    for(NodeID i = 1; i < nodes.size() ; i++) {
-        os.write((char*)&nodes[i].dist_index, sizeof(uint16_t));
-        if(nodes[i].dist_index == 65535)
-            continue;
-        count = nodes[i].up_neighbors.size();
-        os.write((char*)&count, sizeof(size_t));
-        for(Neighbor n: nodes[i].up_neighbors) {
-            os.write((char*)&n.node, sizeof(NodeID));
-            os.write((char*)&n.distance, sizeof(distance_t));
-            os.write((char*)&n.path_count, sizeof(uint16_t));
-        }
-        count = nodes[i].down_neighbors.size();
-        os.write((char*)&count, sizeof(size_t));
-        for(NodeID n: nodes[i].down_neighbors) {
-            os.write((char*)&n, sizeof(NodeID));
+    size_t node_count = dist_index.size();
+    FileHeader::current(hierarchy_magic).write(os, node_count);
+    SectionChecksums checksums;
+    auto write_checked = [&os, &checksums](const void *data, size_t size) {
+        os.write((const char*)data, size);
+        checksums.add_section(data, size);
+    };
+    write_checked(dist_index.data(), node_count * sizeof(uint16_t));
+    write_checked(up_offsets.data(), up_offsets.size() * sizeof(size_t));
+    write_checked(down_offsets.data(), down_offsets.size() * sizeof(size_t));
+    write_checked(up_edges.data(), up_edges.size() * sizeof(Neighbor));
+    write_checked(down_edges.data(), down_edges.size() * sizeof(NodeID));
+    checksums.write(os);
+}
+
+void ContractionHierarchy::assign(vector<vector<Neighbor>> &up, vector<vector<NodeID>> &down)
+{
+    assert(up.size() == dist_index.size() && down.size() == dist_index.size());
+    size_t node_count = dist_index.size();
+    up_offsets.assign(node_count + 1, 0);
+    down_offsets.assign(node_count + 1, 0);
+    for (size_t v = 0; v < node_count; v++)
+    {
+        up_offsets[v + 1] = up_offsets[v] + up[v].size();
+        down_offsets[v + 1] = down_offsets[v] + down[v].size();
+    }
+    up_edges.assign(up_offsets.back(), Neighbor(NO_NODE, 0, 0));
+    down_edges.clear();
+    down_edges.reserve(down_offsets.back());
+    // clear padding bytes, so files get written deterministically
+    memset((void*)up_edges.data(), 0, up_edges.size() * sizeof(Neighbor));
+    for (size_t v = 0; v < node_count; v++)
+    {
+        for (size_t i = 0; i < up[v].size(); i++)
+        {
+            Neighbor &e = up_edges[up_offsets[v] + i];
+            e.node = up[v][i].node;
+            e.distance = up[v][i].distance;
+            e.path_count = up[v][i].path_count;
         }
+        down_edges.insert(down_edges.end(), down[v].begin(), down[v].end());
+        vector<Neighbor>().swap(up[v]);
+        vector<NodeID>().swap(down[v]);
     }
 }
 
+size_t ContractionHierarchy::node_count() const
+{
+    return dist_index.size();
+}
+
+span<Neighbor> ContractionHierarchy::up_neighbors(NodeID v)
+{
+    return span<Neighbor>(up_edges.data() + up_offsets[v], up_edges.data() + up_offsets[v + 1]);
+}
+
+span<const Neighbor> ContractionHierarchy::up_neighbors(NodeID v) const
+{
+    return span<const Neighbor>(up_edges.data() + up_offsets[v], up_edges.data() + up_offsets[v + 1]);
+}
+
+span<const NodeID> ContractionHierarchy::down_neighbors(NodeID v) const
+{
+    return span<const NodeID>(down_edges.data() + down_offsets[v], down_edges.data() + down_offsets[v + 1]);
+}
+
 size_t ContractionHierarchy::size() const
 {
-    size_t total = 0;
-    for(NodeID i = 1; i < nodes.size() ; i++) {
-	if(nodes[i].dist_index == 65535)
-            continue;
-        total += sizeof(uint64_t);
-	total += nodes[i].up_neighbors.size() * sizeof(NodeID);
-	total += nodes[i].up_neighbors.size() * sizeof(distance_t);
-	total += nodes[i].up_neighbors.size() * sizeof(uint16_t);
-	total += nodes[i].down_neighbors.size() * sizeof(NodeID);
-    }       
-    return total;
+    return dist_index.size() * sizeof(uint16_t)
+        + (up_offsets.size() + down_offsets.size()) * sizeof(size_t)
+        + up_edges.size() * sizeof(Neighbor)
+        + down_edges.size() * sizeof(NodeID);
+}
+
+Neighbor* ContractionHierarchy::up_neighbor(NodeID v, NodeID w)
+{
+    // up neighbors are sorted by decreasing dist_index, which is unique among ancestors
+    span<Neighbor> up = up_neighbors(v);
+    uint16_t w_index = dist_index[w];
+    auto it = lower_bound(up.begin(), up.end(), w_index, [this](const Neighbor &n, uint16_t index) { return dist_index[n.node] > index; });
+    return it != up.end() && it->node == w ? &*it : nullptr;
+}
+
+const Neighbor* ContractionHierarchy::up_neighbor(NodeID v, NodeID w) const
+{
+    return const_cast<ContractionHierarchy*>(this)->up_neighbor(v, w);
+}
+
+void ContractionHierarchy::record_changes(const vector<pair<edge_t, edata_t>> &C)
+{
+    if (tracking)
+        for (const pair<edge_t, edata_t> &c : C)
+            changed_edges.push_back(c.first);
 }
 
 size_t ContractionHierarchy::edge_count() const
 {
-    size_t total = 0;
-    for (CHNode const& node : nodes)
-        total += node.up_neighbors.size();
-    return total;
+    return up_edges.size();
 }
 
+// number of nodes per chunk when computing DHCL labels in parallel
+[[maybe_unused]] static const size_t label_grain = 16;
+
 void Graph::create_sc_graph(ContractionHierarchy &ch, vector<CutIndex> &ci)
 {
-    vector<thread> threads;
-    auto dclp = [this](ContractionHierarchy &ch, vector<CutIndex> &ci, util::par_max_bucket_list<NodeID, MULTI_THREAD_DISTANCES> &que, size_t id) {
-
-        NodeID x;
-        while (que.next(x, id))
-        {
-            for(Neighbor &n: ch.nodes[x].up_neighbors) {
-                for(size_t anc = 0; anc < ch.nodes[n.node].dist_index; anc++) {
-                    distance_t dist = n.distance + ci[n.node].distances[anc];
-                    uint16_t path_count = n.path_count * ci[n.node].paths[anc];
-                    if(dist < ci[x].distances[anc]) {
-                        ci[x].distances[anc] = dist;
-                        ci[x].paths[anc] = path_count;
-                    } else if (dist == ci[x].distances[anc]) {
-                        ci[x].paths[anc] += path_count;
-                    }
+    metrics::PhaseTimer timer(metrics::Phase::create_sc_graph);
+    // compute DHCL labels of node from those of its upward neighbors
+    auto compute_labels = [&ch, &ci](NodeID x) {
+        for(Neighbor &n: ch.up_neighbors(x)) {
+            for(size_t anc = 0; anc < ch.dist_index[n.node]; anc++) {
+                distance_t dist = n.distance + ci[n.node].distances[anc];
+                path_t path_count = n.path_count * ci[n.node].paths[anc];
+                if(dist < ci[x].distances[anc]) {
+                    ci[x].distances[anc] = dist;
+                    ci[x].paths[anc] = path_count;
+                } else if (dist == ci[x].distances[anc]) {
+                    ci[x].paths[anc] += path_count;
                 }
             }
-            ci[x].distances.push_back(0);
-            ci[x].paths.push_back(1);
         }
+        ci[x].distances.push_back(0);
+        ci[x].paths.push_back(1);
     };
 
     vector<NodeID> bottom_up_nodes;
     bottom_up_nodes.reserve(nodes.size() + 1);
     // initialize distance index to determine edge direction
-    ch.nodes.resize(nodes.size() + 1);
+    ch.dist_index.resize(nodes.size() + 1);
+    vector<vector<Neighbor>> up_neighbors(nodes.size() + 1);
+    vector<vector<NodeID>> down_neighbors(nodes.size() + 1);
     for (NodeID node : nodes) {
-        ch.nodes[node].dist_index = ci[node].dist_index[ci[node].cut_level] - 1;
-	ci[node].distances.resize(ch.nodes[node].dist_index, infinity);
-	ci[node].paths.resize(ch.nodes[node].dist_index, 0);
+        ch.dist_index[node] = ci[node].dist_index[ci[node].cut_level] - 1;
+        // labels grow by one (the node itself) during construction
+        ci[node].distances.reserve(ch.dist_index[node] + 1);
+        ci[node].paths.reserve(ch.dist_index[node] + 1);
+	ci[node].distances.resize(ch.dist_index[node], infinity);
+	ci[node].paths.resize(ch.dist_index[node], 0);
     }
 
     // initialize with upwards graph edges
@@ -2694,23 +5006,23 @@ void Graph::create_sc_graph(ContractionHierarchy &ch, vector<CutIndex> &ci)
     {
         bottom_up_nodes.push_back(node);
         for (Neighbor &n : node_data[node].neighbors)
-	    if (ch.nodes[n.node].dist_index < ch.nodes[node].dist_index) {
-		ch.nodes[node].up_neighbors.push_back(Neighbor(n.node, n.distance, 1));
-                ci[node].distances[ch.nodes[n.node].dist_index] = n.distance;
-                ci[node].paths[ch.nodes[n.node].dist_index] = 1;
+	    if (ch.dist_index[n.node] < ch.dist_index[node]) {
+		up_neighbors[node].push_back(Neighbor(n.node, n.distance, 1));
+                ci[node].distances[ch.dist_index[n.node]] = n.distance;
+                ci[node].paths[ch.dist_index[n.node]] = 1;
 	    }
     };
 
     // add shortcuts bottom-up
     auto di_order = [&ch](NodeID a, NodeID b) -> bool
     {
-        return ch.nodes[a].dist_index > ch.nodes[b].dist_index;
+        return ch.dist_index[a] > ch.dist_index[b];
     };
     auto di_order1 = [&ch](Neighbor a, Neighbor b) -> bool
     {
-        if(ch.nodes[a.node].dist_index > ch.nodes[b.node].dist_index) return true;
-	if(ch.nodes[a.node].dist_index == ch.nodes[b.node].dist_index && a.distance < b.distance) return true;
-	if(ch.nodes[a.node].dist_index == ch.nodes[b.node].dist_index && a.distance == b.distance && a.path_count > b.path_count) return true;
+        if(ch.dist_index[a.node] > ch.dist_index[b.node]) return true;
+	if(ch.dist_index[a.node] == ch.dist_index[b.node] && a.distance < b.distance) return true;
+	if(ch.dist_index[a.node] == ch.dist_index[b.node] && a.distance == b.distance && a.path_count > b.path_count) return true;
 	return false;
     };
 
@@ -2718,191 +5030,160 @@ void Graph::create_sc_graph(ContractionHierarchy &ch, vector<CutIndex> &ci)
 
     for (NodeID node : bottom_up_nodes)
     {
-        vector<Neighbor> &up = ch.nodes[node].up_neighbors;
+        vector<Neighbor> &up = up_neighbors[node];
         util::make_set(up, di_order1);
 
 	for (size_t i = 0; i + 1 < up.size(); i++) {
             for (size_t j = i + 1; j < up.size(); j++) {
 
                 distance_t weight = up[i].distance + up[j].distance;
-                uint16_t path_count = up[i].path_count * up[j].path_count;
-                if(weight < ci[up[i].node].distances[ch.nodes[up[j].node].dist_index]) {
-                    ch.nodes[up[i].node].up_neighbors.push_back(Neighbor(up[j].node, weight, path_count));
-                    ci[up[i].node].distances[ch.nodes[up[j].node].dist_index] = weight;
-                    ci[up[i].node].paths[ch.nodes[up[j].node].dist_index] = path_count;
-                } else if(weight == ci[up[i].node].distances[ch.nodes[up[j].node].dist_index]) {
-		    ci[up[i].node].paths[ch.nodes[up[j].node].dist_index] += path_count;
-                    ch.nodes[up[i].node].up_neighbors.push_back(Neighbor(up[j].node, weight, ci[up[i].node].paths[ch.nodes[up[j].node].dist_index]));
+                path_t path_count = up[i].path_count * up[j].path_count;
+                if(weight < ci[up[i].node].distances[ch.dist_index[up[j].node]]) {
+                    up_neighbors[up[i].node].push_back(Neighbor(up[j].node, weight, path_count));
+                    ci[up[i].node].distances[ch.dist_index[up[j].node]] = weight;
+                    ci[up[i].node].paths[ch.dist_index[up[j].node]] = path_count;
+                } else if(weight == ci[up[i].node].distances[ch.dist_index[up[j].node]]) {
+		    ci[up[i].node].paths[ch.dist_index[up[j].node]] += path_count;
+                    up_neighbors[up[i].node].push_back(Neighbor(up[j].node, weight, ci[up[i].node].paths[ch.dist_index[up[j].node]]));
                 }
             }
         }
 
         // create downward neighbors from upward ones
         for (Neighbor upn: up)
-            ch.nodes[upn.node].down_neighbors.push_back(node);
+            down_neighbors[upn.node].push_back(node);
     }
-
-#ifdef MULTI_THREAD_DISTANCES
-    util::par_max_bucket_list<NodeID, MULTI_THREAD_DISTANCES> que(ch.nodes[bottom_up_nodes[0]].dist_index);
+    // sorted down neighbors allow merge-intersection during updates
     for (NodeID node : bottom_up_nodes)
-        que.push(node, ch.nodes[node].dist_index);
+        sort(down_neighbors[node].begin(), down_neighbors[node].end());
+    ch.assign(up_neighbors, down_neighbors);
 
-    // add nodes to queue (pre-compute)
-    for (size_t i = 0; i < MULTI_THREAD_DISTANCES; i++)
-        threads.push_back(thread(dclp, std::ref(ch), std::ref(ci), std::ref(que), i));
-    for (size_t i = 0; i < MULTI_THREAD_DISTANCES; i++)
-        threads[i].join();
+    metrics::PhaseTimer label_timer(metrics::Phase::labels);
+#ifdef MULTI_THREAD_DISTANCES
+    // process nodes top-down, level by level
+    util::par_level_list<NodeID> top_down(vector<NodeID>(bottom_up_nodes.rbegin(), bottom_up_nodes.rend()),
+        [&ch](NodeID node) { return ch.dist_index[node]; }, label_grain);
+    top_down.run(thread_count, compute_labels);
 #else
     // compute DHCL distances
-    for(auto it = bottom_up_nodes.rbegin(); it != bottom_up_nodes.rend(); it++) {
-	sort(ch.nodes[*it].down_neighbors.begin(), ch.nodes[*it].down_neighbors.end());
-    	for(Neighbor n: ch.nodes[*it].up_neighbors) {
-            for(size_t anc = 0; anc < ch.nodes[n.node].dist_index; anc++) {
-                distance_t dist = n.distance + ci[n.node].distances[anc];
-		uint16_t path_count = n.path_count * ci[n.node].paths[anc];
-                if(dist < ci[*it].distances[anc]) {
-                    ci[*it].distances[anc] = dist;
-                    ci[*it].paths[anc] = path_count;
-                } else if (dist == ci[*it].distances[anc]) {
-                    ci[*it].paths[anc] += path_count;
-                }
-            }
-        }
-        ci[*it].distances.push_back(0);
-        ci[*it].paths.push_back(1);
-    }
+    for (auto it = bottom_up_nodes.rbegin(); it != bottom_up_nodes.rend(); it++)
+        compute_labels(*it);
 #endif
 }
 
 void Graph::create_sc_graph(ContractionHierarchy &ch, vector<CutIndex> &ci, vector<Neighbor> &closest)
 {
-    vector<thread> threads;
-    auto dclp = [this](ContractionHierarchy &ch, vector<CutIndex> &ci, util::par_max_bucket_list<NodeID, MULTI_THREAD_DISTANCES> &que, size_t id) {
-
-        NodeID x;
-        while (que.next(x, id))
-        {
-            for(Neighbor &n: ch.nodes[x].up_neighbors) {
-                for(size_t anc = 0; anc < ch.nodes[n.node].dist_index; anc++) {
-                    distance_t dist = n.distance + ci[n.node].distances[anc];
-                    uint16_t path_count = n.path_count * ci[n.node].paths[anc];
-                    if(dist < ci[x].distances[anc]) {
-                        ci[x].distances[anc] = dist;
-                        ci[x].paths[anc] = path_count;
-                    } else if (dist == ci[x].distances[anc]) {
-                        ci[x].paths[anc] += path_count;
-                    }
+    metrics::PhaseTimer timer(metrics::Phase::create_sc_graph);
+    // compute DHCL labels of node from those of its upward neighbors
+    auto compute_labels = [&ch, &ci](NodeID x) {
+        for(Neighbor &n: ch.up_neighbors(x)) {
+            for(size_t anc = 0; anc < ch.dist_index[n.node]; anc++) {
+                distance_t dist = n.distance + ci[n.node].distances[anc];
+                path_t path_count = n.path_count * ci[n.node].paths[anc];
+                if(dist < ci[x].distances[anc]) {
+                    ci[x].distances[anc] = dist;
+                    ci[x].paths[anc] = path_count;
+                } else if (dist == ci[x].distances[anc]) {
+                    ci[x].paths[anc] += path_count;
                 }
             }
-            ci[x].distances.push_back(0);
-            ci[x].paths.push_back(1);
         }
+        ci[x].distances.push_back(0);
+        ci[x].paths.push_back(1);
     };
 
     vector<NodeID> bottom_up_nodes;
     bottom_up_nodes.reserve(nodes.size() + 1); 
     // initialize distance index to determine edge direction
-    ch.nodes.resize(nodes.size() + 1);
+    ch.dist_index.resize(nodes.size() + 1);
+    vector<vector<Neighbor>> up_neighbors(nodes.size() + 1);
+    vector<vector<NodeID>> down_neighbors(nodes.size() + 1);
     for (NodeID node : nodes) {
         if(closest[node].node == node) {
 
             bottom_up_nodes.push_back(node);
-            ch.nodes[node].dist_index = ci[node].dist_index[ci[node].cut_level] - 1;
-            ci[node].distances.resize(ch.nodes[node].dist_index, infinity);
-	    ci[node].paths.resize(ch.nodes[node].dist_index, 0);
+            ch.dist_index[node] = ci[node].dist_index[ci[node].cut_level] - 1;
+            // labels grow by one (the node itself) during construction
+            ci[node].distances.reserve(ch.dist_index[node] + 1);
+            ci[node].paths.reserve(ch.dist_index[node] + 1);
+            ci[node].distances.resize(ch.dist_index[node], infinity);
+	    ci[node].paths.resize(ch.dist_index[node], 0);
         } else
-            ch.nodes[node].dist_index = 65535;
+            ch.dist_index[node] = 65535;
     } 
 
     // initialize with upwards graph edges
     for (NodeID node : bottom_up_nodes)
     {
         for (Neighbor &n : node_data[node].neighbors)
-            if (closest[n.node].node == n.node && ch.nodes[n.node].dist_index < ch.nodes[node].dist_index) {
-                ch.nodes[node].up_neighbors.push_back(Neighbor(n.node, n.distance, 1));
-                ci[node].distances[ch.nodes[n.node].dist_index] = n.distance;
-		ci[node].paths[ch.nodes[n.node].dist_index] = 1;
+            if (closest[n.node].node == n.node && ch.dist_index[n.node] < ch.dist_index[node]) {
+                up_neighbors[node].push_back(Neighbor(n.node, n.distance, 1));
+                ci[node].distances[ch.dist_index[n.node]] = n.distance;
+		ci[node].paths[ch.dist_index[n.node]] = 1;
             }
     }
 
     // add shortcuts bottom-up
     auto di_order = [&ch](NodeID a, NodeID b) -> bool
     {
-        return ch.nodes[a].dist_index > ch.nodes[b].dist_index;
+        return ch.dist_index[a] > ch.dist_index[b];
     };
     auto di_order1 = [&ch](Neighbor a, Neighbor b) -> bool
     {
-        if(ch.nodes[a.node].dist_index > ch.nodes[b.node].dist_index) return true;
-        if(ch.nodes[a.node].dist_index == ch.nodes[b.node].dist_index && a.distance < b.distance) return true;
-	if(ch.nodes[a.node].dist_index == ch.nodes[b.node].dist_index && a.distance == b.distance && a.path_count > b.path_count) return true;
+        if(ch.dist_index[a.node] > ch.dist_index[b.node]) return true;
+        if(ch.dist_index[a.node] == ch.dist_index[b.node] && a.distance < b.distance) return true;
+	if(ch.dist_index[a.node] == ch.dist_index[b.node] && a.distance == b.distance && a.path_count > b.path_count) return true;
         return false;
     };
 
     std::sort(bottom_up_nodes.begin(), bottom_up_nodes.end(), di_order);
     for (NodeID node : bottom_up_nodes)
     {
-        vector<Neighbor> &up = ch.nodes[node].up_neighbors;
+        vector<Neighbor> &up = up_neighbors[node];
         util::make_set(up, di_order1);
 
         for (size_t i = 0; i + 1 < up.size(); i++) {
             for (size_t j = i + 1; j < up.size(); j++) {
                 distance_t weight = up[i].distance + up[j].distance;
-		size_t path_count = up[i].path_count * up[j].path_count;
-                if(weight < ci[up[i].node].distances[ch.nodes[up[j].node].dist_index]) {
-                    ch.nodes[up[i].node].up_neighbors.push_back(Neighbor(up[j].node, weight, path_count));
-                    ci[up[i].node].distances[ch.nodes[up[j].node].dist_index] = weight;
-		    ci[up[i].node].paths[ch.nodes[up[j].node].dist_index] = path_count;
-                } else if(weight == ci[up[i].node].distances[ch.nodes[up[j].node].dist_index]) {
-		    ci[up[i].node].paths[ch.nodes[up[j].node].dist_index] += path_count;
-		    ch.nodes[up[i].node].up_neighbors.push_back(Neighbor(up[j].node, weight, ci[up[i].node].paths[ch.nodes[up[j].node].dist_index]));
+		path_t path_count = up[i].path_count * up[j].path_count;
+                if(weight < ci[up[i].node].distances[ch.dist_index[up[j].node]]) {
+                    up_neighbors[up[i].node].push_back(Neighbor(up[j].node, weight, path_count));
+                    ci[up[i].node].distances[ch.dist_index[up[j].node]] = weight;
+		    ci[up[i].node].paths[ch.dist_index[up[j].node]] = path_count;
+                } else if(weight == ci[up[i].node].distances[ch.dist_index[up[j].node]]) {
+		    ci[up[i].node].paths[ch.dist_index[up[j].node]] += path_count;
+		    up_neighbors[up[i].node].push_back(Neighbor(up[j].node, weight, ci[up[i].node].paths[ch.dist_index[up[j].node]]));
 		}
             }
         }
 
         // create downward neighbors from upward ones
         for (Neighbor upn: up)
-            ch.nodes[upn.node].down_neighbors.push_back(node);
+            down_neighbors[upn.node].push_back(node);
     }
-
-#ifdef MULTI_THREAD_DISTANCES
-    util::par_max_bucket_list<NodeID, MULTI_THREAD_DISTANCES> que(ch.nodes[bottom_up_nodes[0]].dist_index);
+    // sorted down neighbors allow merge-intersection during updates
     for (NodeID node : bottom_up_nodes)
-        que.push(node, ch.nodes[node].dist_index);
+        sort(down_neighbors[node].begin(), down_neighbors[node].end());
+    ch.assign(up_neighbors, down_neighbors);
 
-    // add nodes to queue (pre-compute)
-    for (size_t i = 0; i < MULTI_THREAD_DISTANCES; i++)
-        threads.push_back(thread(dclp, std::ref(ch), std::ref(ci), std::ref(que), i));
-    for (size_t i = 0; i < MULTI_THREAD_DISTANCES; i++)
-        threads[i].join();
+    metrics::PhaseTimer label_timer(metrics::Phase::labels);
+#ifdef MULTI_THREAD_DISTANCES
+    // process nodes top-down, level by level
+    util::par_level_list<NodeID> top_down(vector<NodeID>(bottom_up_nodes.rbegin(), bottom_up_nodes.rend()),
+        [&ch](NodeID node) { return ch.dist_index[node]; }, label_grain);
+    top_down.run(thread_count, compute_labels);
 #else
     // compute DHCL distances
-    for(auto it = bottom_up_nodes.rbegin(); it != bottom_up_nodes.rend(); it++) {
-	sort(ch.nodes[*it].down_neighbors.begin(), ch.nodes[*it].down_neighbors.end());
-        for(Neighbor n: ch.nodes[*it].up_neighbors) {
-            for(size_t anc = 0; anc < ch.nodes[n.node].dist_index; anc++) {
-	        distance_t dist = n.distance + ci[n.node].distances[anc];
-		uint16_t path_count = n.path_count * ci[n.node].paths[anc];
-	        if(dist < ci[*it].distances[anc]) {
-		    ci[*it].distances[anc] = dist;
-		    ci[*it].paths[anc] = path_count;
-		} else if (dist == ci[*it].distances[anc]) {
-		    ci[*it].paths[anc] += path_count;
-		}
-	    }
-        }
-        ci[*it].distances.push_back(0);
-	ci[*it].paths.push_back(1);
-    }
+    for (auto it = bottom_up_nodes.rbegin(); it != bottom_up_nodes.rend(); it++)
+        compute_labels(*it);
 #endif
 }
 
 Neighbor& Graph::UpNeighbor(ContractionHierarchy &ch, NodeID v, NodeID w) {
 
-    for(Neighbor &n: ch.nodes[v].up_neighbors) {
-        if(n.node == w) {
-            return n;
-        }
-    }
+    Neighbor *n = ch.up_neighbor(v, w);
+    assert(n != nullptr);
+    return *n;
 }
 
 struct DCHSearchNode
@@ -2911,9 +5192,9 @@ struct DCHSearchNode
     NodeID v;
     NodeID w;
     distance_t distance;
-    uint16_t path_count;
+    path_t path_count;
     bool operator<(const DCHSearchNode &other) const { return dist_index < other.dist_index; }
-    DCHSearchNode(uint16_t dist_index, NodeID v, NodeID w, distance_t distance, uint16_t path_count) : dist_index(dist_index), v(v), w(w), distance(distance), path_count(path_count) {}
+    DCHSearchNode(uint16_t dist_index, NodeID v, NodeID w, distance_t distance, path_t path_count) : dist_index(dist_index), v(v), w(w), distance(distance), path_count(path_count) {}
 };
 
 struct ICHSearchNode
@@ -2921,27 +5202,26 @@ struct ICHSearchNode
     NodeID v;
     uint16_t i;
     distance_t distance;
-    uint16_t path_count;
-    ICHSearchNode(NodeID v, uint16_t i, distance_t distance, uint16_t path_count) : v(v), i(i), distance(distance), path_count(path_count) {}
+    path_t path_count;
+    ICHSearchNode(NodeID v, uint16_t i, distance_t distance, path_t path_count) : v(v), i(i), distance(distance), path_count(path_count) {}
 };
 
 struct ICHSearchNode_P
 {
     NodeID v;
     distance_t distance;
-    uint16_t path_count;
-    ICHSearchNode_P(NodeID v, distance_t distance, uint16_t path_count) : v(v), distance(distance), path_count(path_count) {}
+    path_t path_count;
+    ICHSearchNode_P(NodeID v, distance_t distance, path_t path_count) : v(v), distance(distance), path_count(path_count) {}
 };
 
 ////////////////////// Shortcut Count Graph Maintenance
 
-void Graph::merge_edges(vector<pair<edge_t,edata_t> > &v)
+// combine consecutive changes of the same edge in sorted list
+static void combine_sorted_edges(vector<pair<edge_t,edata_t> > &v)
 {
     size_t v_size = v.size();
     if (v_size < 2)
         return;
-    sort(v.begin(), v.end());
-
     size_t last_distinct = 0;
     for (size_t next = 1; next < v_size; next++)
     {
@@ -2959,20 +5239,115 @@ void Graph::merge_edges(vector<pair<edge_t,edata_t> > &v)
     v.erase(v.begin() + (last_distinct + 1), v.end());
 }
 
+void Graph::merge_edges(vector<pair<edge_t,edata_t> > &v)
+{
+    sort(v.begin(), v.end());
+    combine_sorted_edges(v);
+}
+
+// merge edge changes collected in separate buffers into C; buffers are merged in parallel, then combined pairwise
+static void merge_edges_par(vector<vector<pair<edge_t,edata_t> > > &parts, vector<pair<edge_t,edata_t> > &C)
+{
+    parts.push_back(move(C));
+    util::ThreadPool::TaskGroup group;
+    for (vector<pair<edge_t,edata_t> > &part : parts)
+        thread_pool().run(group, [&part] { sort(part.begin(), part.end()); combine_sorted_edges(part); });
+    thread_pool().wait(group);
+    for (size_t step = 1; step < parts.size(); step *= 2)
+    {
+        for (size_t i = 0; i + step < parts.size(); i += 2 * step)
+            thread_pool().run(group, [&parts, i, step] {
+                vector<pair<edge_t,edata_t> > &a = parts[i], &b = parts[i + step];
+                size_t middle = a.size();
+                a.insert(a.end(), b.begin(), b.end());
+                vector<pair<edge_t,edata_t> >().swap(b);
+                inplace_merge(a.begin(), a.begin() + middle, a.end());
+                combine_sorted_edges(a);
+            });
+        thread_pool().wait(group);
+    }
+    C = move(parts[0]);
+}
+
+// minimum number of changes at a level for processing them in parallel, and changes per task
+static const size_t sc_grain = 64;
+
+// process shortcut graph changes bottom-up, level by level (dist_index of lower endpoint); changes of edges of different
+// nodes at the same level are independent, so each level is grouped by node and processed in parallel, with follow-up
+// changes (always on higher levels) and changed edges collected in per-task buffers
+template<typename F>
+static void process_sc_levels(vector<DCHSearchNode> &seeds, F step, vector<pair<edge_t, edata_t> > &C)
+{
+    vector<vector<DCHSearchNode> > levels;
+    metrics::Tally tally;
+    auto push = [&levels, &tally](const DCHSearchNode &change) {
+        tally[metrics::Counter::queue_pushes]++;
+        if (levels.size() <= change.dist_index)
+            levels.resize(change.dist_index + 1);
+        levels[change.dist_index].push_back(change);
+    };
+    for (const DCHSearchNode &change : seeds)
+        push(change);
+    vector<vector<pair<edge_t, edata_t> > > changed;
+    for (size_t level = levels.size(); level-- > 0;)
+    {
+        vector<DCHSearchNode> changes;
+        changes.swap(levels[level]);
+        if (changes.empty())
+            continue;
+        tally[metrics::Counter::queue_pops] += changes.size();
+        // keep changes of a node in order, processed by the same task
+        stable_sort(changes.begin(), changes.end(), [](const DCHSearchNode &a, const DCHSearchNode &b) { return a.v < b.v; });
+        vector<size_t> task_begin(1, 0);
+        for (size_t i = 1; i < changes.size(); i++)
+            if (changes[i].v != changes[i - 1].v && i - task_begin.back() >= sc_grain)
+                task_begin.push_back(i);
+        task_begin.push_back(changes.size());
+        size_t task_count = task_begin.size() - 1;
+        vector<vector<DCHSearchNode> > follow_ups(task_count);
+        size_t changed_offset = changed.size();
+        changed.resize(changed_offset + task_count);
+        auto run_task = [&](size_t t) {
+            for (size_t i = task_begin[t]; i < task_begin[t + 1]; i++)
+                step(changes[i], follow_ups[t], changed[changed_offset + t]);
+        };
+        if (task_count == 1)
+            run_task(0);
+        else
+        {
+            util::ThreadPool::TaskGroup group;
+            for (size_t t = 0; t < task_count; t++)
+                thread_pool().run(group, [&run_task, t] { run_task(t); });
+            thread_pool().wait(group);
+        }
+        for (const vector<DCHSearchNode> &f : follow_ups)
+            for (const DCHSearchNode &change : f)
+            {
+                assert(change.dist_index < level);
+                push(change);
+            }
+    }
+    merge_edges_par(changed, C);
+}
+
 void Graph::GS_Dec(ContractionHierarchy &ch, vector<pair<pair<distance_t, distance_t>, pair<NodeID, NodeID> > >& updates, vector<pair<edge_t, edata_t> > &C) 
 {
+    metrics::PhaseTimer timer(metrics::Phase::GS_Dec);
+    metrics::Tally tally;
     priority_queue<DCHSearchNode> q; NodeID a, b;
+    auto push = [&q, &tally](const DCHSearchNode &change) { q.push(change); tally[metrics::Counter::queue_pushes]++; };
     for(pair<pair<distance_t, distance_t>, pair<NodeID, NodeID> > iter: updates) {
 
         a = iter.second.first, b = iter.second.second;
-        if(ch.nodes[a].dist_index < ch.nodes[b].dist_index) swap(a, b);
+        if(ch.dist_index[a] < ch.dist_index[b]) swap(a, b);
         if(UpNeighbor(ch, a, b).distance >= iter.first.second)
-            q.push(DCHSearchNode(ch.nodes[a].dist_index, a, b, iter.first.second, 1));
+            push(DCHSearchNode(ch.dist_index[a], a, b, iter.first.second, 1));
     }
 
     vector<pair<edge_t, edata_t> > temp;
     while(!q.empty()) {
         DCHSearchNode next = q.top(); q.pop();
+        tally[metrics::Counter::queue_pops]++;
 
         Neighbor &x = UpNeighbor(ch, next.v, next.w);
         if(next.distance < x.distance) {
@@ -2983,46 +5358,51 @@ void Graph::GS_Dec(ContractionHierarchy &ch, vector<pair<pair<distance_t, distan
         } else
             continue;
 
-        for(Neighbor n: ch.nodes[next.v].up_neighbors) {
+        for(Neighbor n: ch.up_neighbors(next.v)) {
             if(n.node != next.w) {
                 distance_t dist = next.distance + n.distance;
-                uint16_t path_count = next.path_count * n.path_count;
+                path_t path_count = next.path_count * n.path_count;
 
                 a = next.w, b = n.node;
-                if(ch.nodes[a].dist_index < ch.nodes[b].dist_index) swap(a, b);
+                if(ch.dist_index[a] < ch.dist_index[b]) swap(a, b);
                 if(UpNeighbor(ch, a, b).distance >= dist)
-                    q.push(DCHSearchNode(ch.nodes[a].dist_index, a, b, dist, path_count));
+                    push(DCHSearchNode(ch.dist_index[a], a, b, dist, path_count));
             }
         }
         C.push_back(make_pair(make_pair(next.v, next.w), make_pair(next.distance, next.path_count)));
     }
     merge_edges(C);
+    ch.record_changes(C);
 }
 
 void Graph::GS_Inc(ContractionHierarchy &ch, vector<pair<pair<distance_t, distance_t>, pair<NodeID, NodeID> > >& updates, vector<pair<edge_t, edata_t> > &C) 
 {
+    metrics::PhaseTimer timer(metrics::Phase::GS_Inc);
+    metrics::Tally tally;
     priority_queue<DCHSearchNode> q; NodeID a, b;
+    auto push = [&q, &tally](const DCHSearchNode &change) { q.push(change); tally[metrics::Counter::queue_pushes]++; };
     for(pair<pair<distance_t, distance_t>, pair<NodeID, NodeID> > iter: updates) {
 
         a = iter.second.first, b = iter.second.second;
-        if(ch.nodes[a].dist_index < ch.nodes[b].dist_index) swap(a, b);
+        if(ch.dist_index[a] < ch.dist_index[b]) swap(a, b);
 
         if(UpNeighbor(ch, a, b).distance == iter.first.first)
-            q.push(DCHSearchNode(ch.nodes[a].dist_index, a, b, iter.first.first, 1));
+            push(DCHSearchNode(ch.dist_index[a], a, b, iter.first.first, 1));
     }
 
     while(!q.empty()) {
         DCHSearchNode next = q.top(); q.pop();
+        tally[metrics::Counter::queue_pops]++;
 
-        for(Neighbor &n: ch.nodes[next.v].up_neighbors) {
+        for(Neighbor &n: ch.up_neighbors(next.v)) {
             if(n.node != next.w) {
                 distance_t dist = next.distance + n.distance;
-                uint16_t path_count = next.path_count * n.path_count;
+                path_t path_count = next.path_count * n.path_count;
 
                 a = next.w, b = n.node;
-                if(ch.nodes[a].dist_index < ch.nodes[b].dist_index) swap(a, b);
+                if(ch.dist_index[a] < ch.dist_index[b]) swap(a, b);
                 if(UpNeighbor(ch, a, b).distance == dist)
-                    q.push(DCHSearchNode(ch.nodes[a].dist_index, a, b, dist, path_count));
+                    push(DCHSearchNode(ch.dist_index[a], a, b, dist, path_count));
             }
         }
 
@@ -3039,15 +5419,15 @@ void Graph::GS_Inc(ContractionHierarchy &ch, vector<pair<pair<distance_t, distan
             }
 
             size_t i = 0, j = 0;
-            while (i < ch.nodes[next.v].down_neighbors.size() && j < ch.nodes[next.w].down_neighbors.size()) {
-                a = ch.nodes[next.v].down_neighbors[i]; b = ch.nodes[next.w].down_neighbors[j];
+            while (i < ch.down_neighbors(next.v).size() && j < ch.down_neighbors(next.w).size()) {
+                a = ch.down_neighbors(next.v)[i]; b = ch.down_neighbors(next.w)[j];
                 if (a < b) i++;
                 else if (b < a) j++;
                 else {
                     Neighbor &av = UpNeighbor(ch, a, next.v);
                     Neighbor &aw = UpNeighbor(ch, a, next.w);
                     distance_t dist = av.distance + aw.distance;
-                    uint16_t path_count = av.path_count * aw.path_count;
+                    path_t path_count = av.path_count * aw.path_count;
                     if(dist < x.distance) {
                         x.distance = dist;
                         x.path_count = path_count;
@@ -3060,29 +5440,536 @@ void Graph::GS_Inc(ContractionHierarchy &ch, vector<pair<pair<distance_t, distan
         }
 	C.push_back(make_pair(make_pair(next.v, next.w), make_pair(next.distance, next.path_count)));
     }
-    merge_edges(C);
+    merge_edges(C);
+    ch.record_changes(C);
+}
+
+////////////////////// 2-Hop Count Labeling Maintenance
+
+void Graph::DCL_Dec(ContractionHierarchy &ch, ContractionIndex &ci, vector<pair<pair<distance_t, distance_t>, pair<NodeID, NodeID> > >& updates) 
+{
+    metrics::PhaseTimer timer(metrics::Phase::DCL_Dec);
+    vector<pair<edge_t, edata_t> > C;
+    GS_Dec(ch, updates, C);
+    DCL_Dec_Labels(ch, ci, C);
+}
+
+void Graph::DCL_Dec_Labels(ContractionHierarchy &ch, ContractionIndex &ci, const vector<pair<edge_t, edata_t> > &C)
+{
+    ci.next_epoch();
+    metrics::Tally tally;
+
+    //update distances involving ancestors
+    util::min_bucket_queue<ICHSearchNode> q;
+    auto push = [&q, &tally](const ICHSearchNode &change, size_t bucket) { q.push(change, bucket); tally[metrics::Counter::queue_pushes]++; };
+    for(pair<edge_t, edata_t> iter: C) {
+        FlatCutIndex a = ci.get_contraction_label(iter.first.first).cut_index;
+        if(a.empty())
+            continue;
+        if(iter.second.first <= a.distance_at(ch.dist_index[iter.first.second])) {
+
+            FlatCutIndex b = ci.get_contraction_label(iter.first.second).cut_index;
+            for(size_t i = 0; i <= ch.dist_index[iter.first.second]; i++) {
+                distance_t dist = iter.second.first + b.distance_at(i);
+
+                if(a.distance_at(i) >= dist) {
+                    path_t path_count = iter.second.second * b.paths_at(i);
+                    push(ICHSearchNode(iter.first.first, i, dist, path_count), ch.dist_index[iter.first.first]);
+                }
+            }
+        }
+    }
+
+    // update distances involving descendants
+    while(!q.empty()) {
+        ICHSearchNode next = q.pop();
+        tally[metrics::Counter::queue_pops]++;
+
+        FlatCutIndex cv = ci.get_mutable_cut_index(next.v, next.i);
+        if(cv.distance_at(next.i) > next.distance) {
+            cv.distance_at(next.i) = next.distance;
+            cv.paths_at(next.i) = next.path_count;
+        } else if(cv.distance_at(next.i) == next.distance) {
+            cv.paths_at(next.i) = cv.paths_at(next.i) + next.path_count;
+        } else
+            continue;
+        tally[metrics::Counter::labels_touched]++;
+
+        // queue updates for descendants
+        for(NodeID u: ch.down_neighbors(next.v)) {
+            Neighbor &x = UpNeighbor(ch, u, next.v);
+            distance_t dist = x.distance + next.distance;
+
+            FlatCutIndex cu = ci.get_contraction_label(u).cut_index;
+            if(!cu.empty() && cu.distance_at(next.i) >= dist) {
+                path_t path_count = x.path_count * next.path_count;
+                push(ICHSearchNode(u, next.i, dist, path_count), ch.dist_index[u]);
+            }
+        }
+    }
+}
+
+void Graph::DCL_Inc(ContractionHierarchy &ch, ContractionIndex &ci, std::vector<std::pair<std::pair<distance_t, distance_t>, std::pair<NodeID, NodeID> > >& updates) 
+{
+    metrics::PhaseTimer timer(metrics::Phase::DCL_Inc);
+    vector<pair<edge_t, edata_t> > C;
+    GS_Inc(ch, updates, C);
+    DCL_Inc_Labels(ch, ci, C);
+}
+
+void Graph::DCL_Inc_Labels(ContractionHierarchy &ch, ContractionIndex &ci, const vector<pair<edge_t, edata_t> > &C)
+{
+    ci.next_epoch();
+    metrics::Tally tally;
+
+    //update distances involving ancestors
+    util::min_bucket_queue<ICHSearchNode> q;
+    auto push = [&q, &tally](const ICHSearchNode &change, size_t bucket) { q.push(change, bucket); tally[metrics::Counter::queue_pushes]++; };
+    for(pair<edge_t, edata_t> iter: C) {
+        FlatCutIndex a = ci.get_contraction_label(iter.first.first).cut_index;
+        if(a.empty())
+            continue;
+        if(iter.second.first == a.distance_at(ch.dist_index[iter.first.second])) {
+
+            FlatCutIndex b = ci.get_contraction_label(iter.first.second).cut_index;
+            for(size_t i = 0; i <= ch.dist_index[iter.first.second]; i++) {
+                distance_t dist = iter.second.first + b.distance_at(i);
+                path_t path_count = iter.second.second * b.paths_at(i);
+
+                if(dist == a.distance_at(i))
+                    push(ICHSearchNode(iter.first.first, i, dist, path_count), ch.dist_index[iter.first.first]);
+            }
+        }
+    }
+
+    // update distances involving descendants
+    while(!q.empty()) {
+        ICHSearchNode next = q.pop();
+        tally[metrics::Counter::queue_pops]++;
+        tally[metrics::Counter::labels_touched]++;
+
+        // update descendants
+        FlatCutIndex cv = ci.get_mutable_cut_index(next.v, next.i);
+        for(NodeID u: ch.down_neighbors(next.v)) {
+            Neighbor &x = UpNeighbor(ch, u, next.v);
+            FlatCutIndex cu = ci.get_contraction_label(u).cut_index;
+            distance_t dist = x.distance + cv.distance_at(next.i);
+            path_t path_count = x.path_count * next.path_count;
+
+            if(!cu.empty() && dist == cu.distance_at(next.i))
+                push(ICHSearchNode(u, next.i, dist, path_count), ch.dist_index[u]);
+        }
+
+        if(cv.paths_at(next.i) > next.path_count) { // update path count, distance does not change
+            cv.paths_at(next.i) = cv.paths_at(next.i) - next.path_count;
+        } else { // recompute distance and path count
+            cv.distance_at(next.i) = infinity;
+            for(Neighbor &u: ch.up_neighbors(next.v)) {
+                if(ch.dist_index[u.node] >= next.i) {
+                    Neighbor &x = UpNeighbor(ch, next.v, u.node);
+                    FlatCutIndex cu = ci.get_contraction_label(u.node).cut_index;
+                    distance_t dist = x.distance + cu.distance_at(next.i);
+                    path_t path_count = x.path_count * cu.paths_at(next.i);
+
+                    if(dist < cv.distance_at(next.i)) {
+                        cv.distance_at(next.i) = dist;
+                        cv.paths_at(next.i) = path_count;
+                    } else if(dist == cv.distance_at(next.i)) {
+                        cv.paths_at(next.i) = cv.paths_at(next.i) + path_count;
+                    }
+                }
+            }
+        }
+    }
+}
+
+////////////////////// Parallel Maintenance
+
+void Graph::GS_Dec_Par(ContractionHierarchy &ch, vector<pair<pair<distance_t, distance_t>, pair<NodeID, NodeID> > >& updates, vector<pair<edge_t, edata_t> > &C)
+{
+    metrics::PhaseTimer timer(metrics::Phase::GS_Dec_Par);
+    vector<DCHSearchNode> seeds; NodeID a, b;
+    for(pair<pair<distance_t, distance_t>, pair<NodeID, NodeID> > iter: updates) {
+
+        a = iter.second.first, b = iter.second.second;
+        if(ch.dist_index[a] < ch.dist_index[b]) swap(a, b);
+        if(UpNeighbor(ch, a, b).distance >= iter.first.second)
+            seeds.push_back(DCHSearchNode(ch.dist_index[a], a, b, iter.first.second, 1));
+    }
+
+    auto step = [this, &ch](const DCHSearchNode &next, vector<DCHSearchNode> &q, vector<pair<edge_t, edata_t> > &C) {
+        Neighbor &x = UpNeighbor(ch, next.v, next.w);
+        if(next.distance < x.distance) {
+            x.distance = next.distance;
+            x.path_count = next.path_count;
+        } else if(next.distance == x.distance) {
+            x.path_count = x.path_count + next.path_count;
+        } else
+            return;
+
+        for(Neighbor n: ch.up_neighbors(next.v)) {
+            if(n.node != next.w) {
+                distance_t dist = next.distance + n.distance;
+                path_t path_count = next.path_count * n.path_count;
+
+                NodeID a = next.w, b = n.node;
+                if(ch.dist_index[a] < ch.dist_index[b]) swap(a, b);
+                if(UpNeighbor(ch, a, b).distance >= dist)
+                    q.push_back(DCHSearchNode(ch.dist_index[a], a, b, dist, path_count));
+            }
+        }
+        C.push_back(make_pair(make_pair(next.v, next.w), make_pair(next.distance, next.path_count)));
+    };
+    process_sc_levels(seeds, step, C);
+    ch.record_changes(C);
+}
+
+void Graph::GS_Inc_Par(ContractionHierarchy &ch, vector<pair<pair<distance_t, distance_t>, pair<NodeID, NodeID> > >& updates, vector<pair<edge_t, edata_t> > &C)
+{
+    metrics::PhaseTimer timer(metrics::Phase::GS_Inc_Par);
+    vector<DCHSearchNode> seeds; NodeID a, b;
+    for(pair<pair<distance_t, distance_t>, pair<NodeID, NodeID> > iter: updates) {
+
+        a = iter.second.first, b = iter.second.second;
+        if(ch.dist_index[a] < ch.dist_index[b]) swap(a, b);
+
+        if(UpNeighbor(ch, a, b).distance == iter.first.first)
+            seeds.push_back(DCHSearchNode(ch.dist_index[a], a, b, iter.first.first, 1));
+    }
+
+    auto step = [this, &ch](const DCHSearchNode &next, vector<DCHSearchNode> &q, vector<pair<edge_t, edata_t> > &C) {
+        NodeID a, b;
+        for(Neighbor &n: ch.up_neighbors(next.v)) {
+            if(n.node != next.w) {
+                distance_t dist = next.distance + n.distance;
+                path_t path_count = next.path_count * n.path_count;
+
+                a = next.w, b = n.node;
+                if(ch.dist_index[a] < ch.dist_index[b]) swap(a, b);
+                if(UpNeighbor(ch, a, b).distance == dist)
+                    q.push_back(DCHSearchNode(ch.dist_index[a], a, b, dist, path_count));
+            }
+        }
+
+        Neighbor &x = UpNeighbor(ch, next.v, next.w);
+        if(x.path_count > next.path_count) {
+            x.path_count = x.path_count - next.path_count;
+        } else {
+            x.distance = infinity; x.path_count = 1;
+            for (Neighbor &n : node_data[next.v].neighbors) {
+                if (n.node == next.w) {
+                    x.distance = n.distance;
+                    break;
+                }
+            }
+
+            size_t i = 0, j = 0;
+            while (i < ch.down_neighbors(next.v).size() && j < ch.down_neighbors(next.w).size()) {
+                a = ch.down_neighbors(next.v)[i]; b = ch.down_neighbors(next.w)[j];
+                if (a < b) i++;
+                else if (b < a) j++;
+                else {
+                    Neighbor &av = UpNeighbor(ch, a, next.v);
+                    Neighbor &aw = UpNeighbor(ch, a, next.w);
+                    distance_t dist = av.distance + aw.distance;
+                    path_t path_count = av.path_count * aw.path_count;
+                    if(dist < x.distance) {
+                        x.distance = dist;
+                        x.path_count = path_count;
+                    } else if(dist == x.distance) {
+                        x.path_count = x.path_count + path_count;
+                    }
+                    i++; j++;
+                }
+            }
+        }
+        C.push_back(make_pair(make_pair(next.v, next.w), make_pair(next.distance, next.path_count)));
+    };
+    process_sc_levels(seeds, step, C);
+    ch.record_changes(C);
+}
+
+// process bucket too large for a single task: updates only propagate to descendants, which lie in the partition subtree
+// of their ancestor, so those of nodes in disjoint subtrees SPLIT_LEVELS below the cut of the label are independent;
+// nodes above these subtrees are processed first, deferring updates of nodes within them, then subtrees in parallel
+template<typename T, typename F>
+static void split_label_bucket(const ContractionIndex &ci, vector<T> &bucket, size_t label_index, F &process)
+{
+    const uint16_t *dist_index = ci.get_contraction_label(bucket[0].v).cut_index.dist_index();
+    size_t label_level = 0;
+    while (dist_index[label_level] <= label_index)
+        label_level++;
+    size_t split_level = label_level + 1 + SPLIT_LEVELS;
+    // subtree of node, or 2^SPLIT_LEVELS for nodes above split level
+    auto subtree = [&ci, label_level, split_level](NodeID v) {
+        FlatCutIndex cv = ci.get_contraction_label(v).cut_index;
+        if (cv.cut_level() < split_level)
+            return (size_t)1 << SPLIT_LEVELS;
+        return (size_t)(cv.partition() >> (label_level + 1)) & (((size_t)1 << SPLIT_LEVELS) - 1);
+    };
+    vector<vector<T>> parts((1 << SPLIT_LEVELS) + 1);
+    for (const T &item : bucket)
+        parts[subtree(item.v)].push_back(item);
+    vector<T>().swap(bucket);
+    vector<T> deferred;
+    auto top = [&subtree](NodeID v) { return subtree(v) == (size_t)1 << SPLIT_LEVELS; };
+    if (!parts.back().empty())
+        process(parts.back(), label_index, top, deferred);
+    for (const T &item : deferred)
+        parts[subtree(item.v)].push_back(item);
+    util::ThreadPool::TaskGroup group;
+    for (size_t i = 0; i < ((size_t)1 << SPLIT_LEVELS); i++)
+        if (!parts[i].empty())
+            thread_pool().run(group, [&parts, &process, label_index, i] {
+                vector<T> none;
+                process(parts[i], label_index, [](NodeID) { return true; }, none);
+            });
+    thread_pool().wait(group);
+}
+
+// process buckets of updates (one per label index) in parallel; buckets are queued in label index order, so the
+// heavy buckets of top-level cut vertices get started first while idle threads steal the remaining ones
+// process(bucket, label_index, owned, deferred) propagates the updates of bucket, moving updates of nodes not owned
+// to deferred rather than processing them
+template<typename T, typename F>
+static void process_label_buckets(const ContractionIndex &ci, vector<vector<T>> &buckets, F process)
+{
+    util::ThreadPool::TaskGroup group;
+    for (size_t i = 0; i < buckets.size(); i++)
+    {
+        if (buckets[i].empty())
+            continue;
+        if (buckets[i].size() > BUCKET_SPLIT)
+            thread_pool().run(group, [&ci, &buckets, &process, i] { split_label_bucket(ci, buckets[i], i, process); });
+        else
+            thread_pool().run(group, [&buckets, &process, i] {
+                vector<T> none;
+                process(buckets[i], i, [](NodeID) { return true; }, none);
+            });
+    }
+    thread_pool().wait(group);
+}
+
+template<typename T>
+static void push_to_bucket(vector<vector<T>> &buckets, T item, size_t bucket)
+{
+    if (buckets.size() <= bucket)
+        buckets.resize(bucket + 1);
+    buckets[bucket].push_back(item);
+}
+
+void Graph::DCL_Dec_Par(ContractionHierarchy &ch, ContractionIndex &ci, vector<pair<pair<distance_t, distance_t>, pair<NodeID, NodeID> > >& updates) {
+    metrics::PhaseTimer timer(metrics::Phase::DCL_Dec_Par);
+    ci.next_epoch();
+
+    auto dhcldec = [this, &ch, &ci](vector<ICHSearchNode_P> &bucket, size_t label_index, auto owned, vector<ICHSearchNode_P> &deferred) {
+        metrics::Tally tally;
+        util::min_bucket_queue<ICHSearchNode_P> bq;
+        for (ICHSearchNode_P obj : bucket)
+            bq.push(obj, label_index);
+        vector<ICHSearchNode_P>().swap(bucket);
+
+        // update distances involving descendants
+        while(!bq.empty()) {
+            ICHSearchNode_P next = bq.pop();
+            tally[metrics::Counter::queue_pops]++;
+
+            FlatCutIndex cv = ci.get_mutable_cut_index(next.v, label_index);
+            if(cv.distance_at(label_index) > next.distance) {
+                cv.distance_at(label_index) = next.distance;
+                cv.paths_at(label_index) = next.path_count;
+            } else if(cv.distance_at(label_index) == next.distance) {
+                cv.paths_at(label_index) = cv.paths_at(label_index) + next.path_count;
+            } else
+                continue;
+            tally[metrics::Counter::labels_touched]++;
+
+            // queue updates for descendants
+            for(NodeID u: ch.down_neighbors(next.v)) {
+                Neighbor &x = UpNeighbor(ch, u, next.v);
+                distance_t dist = x.distance + next.distance;
+
+                FlatCutIndex cu = ci.get_contraction_label(u).cut_index;
+                if(cu.distance_at(label_index) >= dist) {
+                    path_t path_count = x.path_count * next.path_count;
+                    if (owned(u))
+                        bq.push(ICHSearchNode_P(u, dist, path_count), label_index);
+                    else
+                        deferred.push_back(ICHSearchNode_P(u, dist, path_count));
+                    tally[metrics::Counter::queue_pushes]++;
+                }
+            }
+        }
+    };
+
+    vector<pair<edge_t, edata_t> > C;
+    GS_Dec_Par(ch, updates, C);
+
+    //update distances involving ancestors
+    vector<vector<ICHSearchNode_P>> grouping;
+    metrics::Tally tally;
+    for(pair<edge_t, edata_t> iter: C) {
+        FlatCutIndex a = ci.get_contraction_label(iter.first.first).cut_index;
+        if(iter.second.first <= a.distance_at(ch.dist_index[iter.first.second])) {
+
+            FlatCutIndex b = ci.get_contraction_label(iter.first.second).cut_index;
+            for(size_t i = 0; i <= ch.dist_index[iter.first.second]; i++) {
+                distance_t dist = iter.second.first + b.distance_at(i);
+
+                if(a.distance_at(i) >= dist) {
+                    path_t path_count = iter.second.second * b.paths_at(i);
+                    push_to_bucket(grouping, ICHSearchNode_P(iter.first.first, dist, path_count), i);
+                    tally[metrics::Counter::queue_pushes]++;
+                }
+            }
+        }
+    }
+
+    process_label_buckets(ci, grouping, dhcldec);
+}
+
+void Graph::DCL_Inc_Par(ContractionHierarchy &ch, ContractionIndex &ci, vector<pair<pair<distance_t, distance_t>, pair<NodeID, NodeID> > >& updates) {
+    metrics::PhaseTimer timer(metrics::Phase::DCL_Inc_Par);
+    ci.next_epoch();
+
+    auto dhclinc = [this, &ch, &ci](vector<ICHSearchNode_P> &bucket, size_t label_index, auto owned, vector<ICHSearchNode_P> &deferred) {
+        metrics::Tally tally;
+        util::min_bucket_queue<ICHSearchNode_P> bq;
+        // move items to bucket queue
+        for (ICHSearchNode_P obj: bucket)
+            bq.push(obj, label_index);
+        vector<ICHSearchNode_P>().swap(bucket);
+
+        while(!bq.empty()) {
+            ICHSearchNode_P next = bq.pop();
+            tally[metrics::Counter::queue_pops]++;
+            tally[metrics::Counter::labels_touched]++;
+
+            // update descendants
+            FlatCutIndex cv = ci.get_mutable_cut_index(next.v, label_index);
+            for(NodeID u: ch.down_neighbors(next.v)) {
+                Neighbor &x = UpNeighbor(ch, u, next.v);
+                FlatCutIndex cu = ci.get_contraction_label(u).cut_index;
+                distance_t dist = x.distance + cv.distance_at(label_index);
+
+                if(dist == cu.distance_at(label_index)) {
+                    path_t path_count = x.path_count * next.path_count;
+                    if (owned(u))
+                        bq.push(ICHSearchNode_P(u, dist, path_count), label_index);
+                    else
+                        deferred.push_back(ICHSearchNode_P(u, dist, path_count));
+                    tally[metrics::Counter::queue_pushes]++;
+                }
+            }
+
+            if(cv.paths_at(label_index) > next.path_count) { // update path count, distance does not change
+                cv.paths_at(label_index) = cv.paths_at(label_index) - next.path_count;
+            } else { // recompute distance and path count
+                cv.distance_at(label_index) = infinity;
+                for(Neighbor &u: ch.up_neighbors(next.v)) {
+                    if(ch.dist_index[u.node] >= label_index) {
+                        Neighbor &x = UpNeighbor(ch, next.v, u.node);
+                        FlatCutIndex cu = ci.get_contraction_label(u.node).cut_index;
+                        distance_t dist = x.distance + cu.distance_at(label_index);
+                        path_t path_count = x.path_count * cu.paths_at(label_index);
+
+                        if(dist < cv.distance_at(label_index)) {
+                            cv.distance_at(label_index) = dist;
+                            cv.paths_at(label_index) = path_count;
+                        } else if(dist == cv.distance_at(label_index)) {
+                            cv.paths_at(label_index) = cv.paths_at(label_index) + path_count;
+                        }
+                    }
+                }
+            }
+        }
+    };
+
+    vector<pair<edge_t, edata_t> > C;
+    GS_Inc_Par(ch, updates, C);
+
+    //update distances involving ancestors
+    vector<vector<ICHSearchNode_P>> grouping;
+    metrics::Tally tally;
+    for(pair<edge_t, edata_t> iter: C) {
+        FlatCutIndex a = ci.get_contraction_label(iter.first.first).cut_index;
+        if(iter.second.first == a.distance_at(ch.dist_index[iter.first.second])) {
+
+            FlatCutIndex b = ci.get_contraction_label(iter.first.second).cut_index;
+            for(size_t i = 0; i <= ch.dist_index[iter.first.second]; i++) {
+                distance_t dist = iter.second.first + b.distance_at(i);
+
+		if(dist == a.distance_at(i)) {
+                    path_t path_count = iter.second.second * b.paths_at(i);
+                    push_to_bucket(grouping, ICHSearchNode_P(iter.first.first, dist, path_count), i);
+                    tally[metrics::Counter::queue_pushes]++;
+                }
+            }
+        }
+    }
+
+    process_label_buckets(ci, grouping, dhclinc);
+}
+
+
+////////////////////// Optimized Maintenance (Avoiding Propagation Overhead in Count Updates)
+
+util::min_bucket_queue<ICHSearchNode> q;
+void Graph::EnqueAndUpdate_d(ContractionHierarchy &ch, ContractionIndex &ci, NodeID v, uint16_t i, distance_t dist, path_t path_count) {
+
+    //store original values in queue
+    FlatCutIndex cv = ci.get_mutable_cut_index(v, i);
+    if((cv.paths_at(i) & PATH_FLAG) == 0) {
+        q.push(ICHSearchNode(v, i, cv.distance_at(i), cv.paths_at(i)), ch.dist_index[v]);
+        metrics::add(metrics::Counter::queue_pushes);
+        // setting the highest bit
+        cv.paths_at(i) = cv.paths_at(i) | PATH_FLAG;
+    }
+
+    // update values in index
+    if(cv.distance_at(i) > dist) {
+        cv.distance_at(i) = dist;
+        cv.paths_at(i) = path_count | PATH_FLAG;
+    } else {
+        cv.paths_at(i) = cv.paths_at(i) + path_count;
+    }
 }
 
-////////////////////// 2-Hop Count Labeling Maintenance
+void Graph::EnqueAndUpdate_i(ContractionHierarchy &ch, ContractionIndex &ci, NodeID v, uint16_t i, path_t path_count) {
+
+    //store original values in queue
+    FlatCutIndex cv = ci.get_mutable_cut_index(v, i);
+    if((cv.paths_at(i) & PATH_FLAG) == 0) {
+        q.push(ICHSearchNode(v, i, cv.distance_at(i), cv.paths_at(i)), ch.dist_index[v]);
+        metrics::add(metrics::Counter::queue_pushes);
+        // setting the highest bit
+        cv.paths_at(i) = cv.paths_at(i) | PATH_FLAG;
+    }
+
+    // update count in index
+    cv.paths_at(i) = cv.paths_at(i) - path_count;
+}
+
+void Graph::DCL_Dec_Opt(ContractionHierarchy &ch, ContractionIndex &ci, vector<pair<pair<distance_t, distance_t>, pair<NodeID, NodeID> > >& updates) {
+    metrics::PhaseTimer timer(metrics::Phase::DCL_Dec_Opt);
+    ci.next_epoch();
+    metrics::Tally tally;
 
-void Graph::DCL_Dec(ContractionHierarchy &ch, ContractionIndex &ci, vector<pair<pair<distance_t, distance_t>, pair<NodeID, NodeID> > >& updates) 
-{
     vector<pair<edge_t, edata_t> > C;
     GS_Dec(ch, updates, C);
 
     //update distances involving ancestors
-    util::min_bucket_queue<ICHSearchNode> q;
     for(pair<edge_t, edata_t> iter: C) {
         FlatCutIndex a = ci.get_contraction_label(iter.first.first).cut_index;
-        if(iter.second.first <= a.distances()[ch.nodes[iter.first.second].dist_index]) {
+        if(iter.second.first <= a.distance_at(ch.dist_index[iter.first.second])) {
 
             FlatCutIndex b = ci.get_contraction_label(iter.first.second).cut_index;
-            for(size_t i = 0; i <= ch.nodes[iter.first.second].dist_index; i++) {
-                distance_t dist = iter.second.first + b.distances()[i];
+            for(size_t i = 0; i <= ch.dist_index[iter.first.second]; i++) {
+                distance_t dist = iter.second.first + b.distance_at(i);
 
-                if(a.distances()[i] >= dist) {
-                    uint16_t path_count = iter.second.second * b.paths()[i];
-                    q.push(ICHSearchNode(iter.first.first, i, dist, path_count), ch.nodes[iter.first.first].dist_index);
+                if(a.distance_at(i) >= dist) {
+                    path_t path_count = iter.second.second * b.paths_at(i);
+                    EnqueAndUpdate_d(ch, ci, iter.first.first, i, dist, path_count);
                 }
             }
         }
@@ -3091,48 +5978,55 @@ void Graph::DCL_Dec(ContractionHierarchy &ch, ContractionIndex &ci, vector<pair<
     // update distances involving descendants
     while(!q.empty()) {
         ICHSearchNode next = q.pop();
+        tally[metrics::Counter::queue_pops]++;
 
-        FlatCutIndex cv = ci.get_contraction_label(next.v).cut_index;
-        if(cv.distances()[next.i] > next.distance) {
-            cv.distances()[next.i] = next.distance;
-            cv.paths()[next.i] = next.path_count;
-        } else if(cv.distances()[next.i] == next.distance) {
-            cv.paths()[next.i] = cv.paths()[next.i] + next.path_count;
+        path_t convex_path_count = 0;
+        FlatCutIndex cv = ci.get_mutable_cut_index(next.v, next.i);
+        // resetting the highest bit
+        cv.paths_at(next.i) &= ~PATH_FLAG;
+        if(cv.distance_at(next.i) == next.distance) {
+            convex_path_count = cv.paths_at(next.i) - next.path_count;
+        } else if(cv.distance_at(next.i) < next.distance) {
+            convex_path_count = cv.paths_at(next.i);
         } else
             continue;
+        tally[metrics::Counter::labels_touched]++;
 
         // queue updates for descendants
-        for(NodeID u: ch.nodes[next.v].down_neighbors) {
+        for(NodeID u: ch.down_neighbors(next.v)) {
             Neighbor &x = UpNeighbor(ch, u, next.v);
-            distance_t dist = x.distance + next.distance;
+            distance_t dist = x.distance + cv.distance_at(next.i);
 
             FlatCutIndex cu = ci.get_contraction_label(u).cut_index;
-            if(cu.distances()[next.i] >= dist) {
-                uint16_t path_count = x.path_count * next.path_count;
-                q.push(ICHSearchNode(u, next.i, dist, path_count), ch.nodes[u].dist_index);
+            if(cu.distance_at(next.i) >= dist) {
+                path_t path_count = x.path_count * convex_path_count;
+                EnqueAndUpdate_d(ch, ci, u, next.i, dist, path_count);
             }
         }
     }
 }
 
-void Graph::DCL_Inc(ContractionHierarchy &ch, ContractionIndex &ci, std::vector<std::pair<std::pair<distance_t, distance_t>, std::pair<NodeID, NodeID> > >& updates) 
-{
+void Graph::DCL_Inc_Opt(ContractionHierarchy &ch, ContractionIndex &ci, std::vector<std::pair<std::pair<distance_t, distance_t>, std::pair<NodeID, NodeID> > >& updates) {
+    metrics::PhaseTimer timer(metrics::Phase::DCL_Inc_Opt);
+    ci.next_epoch();
+    metrics::Tally tally;
+
     vector<pair<edge_t, edata_t> > C;
     GS_Inc(ch, updates, C);
 
     //update distances involving ancestors
-    util::min_bucket_queue<ICHSearchNode> q;
     for(pair<edge_t, edata_t> iter: C) {
         FlatCutIndex a = ci.get_contraction_label(iter.first.first).cut_index;
-        if(iter.second.first == a.distances()[ch.nodes[iter.first.second].dist_index]) {
+        if(iter.second.first == a.distance_at(ch.dist_index[iter.first.second])) {
 
             FlatCutIndex b = ci.get_contraction_label(iter.first.second).cut_index;
-            for(size_t i = 0; i <= ch.nodes[iter.first.second].dist_index; i++) {
-                distance_t dist = iter.second.first + b.distances()[i];
-                uint16_t path_count = iter.second.second * b.paths()[i];
+            for(size_t i = 0; i <= ch.dist_index[iter.first.second]; i++) {
+                distance_t dist = iter.second.first + b.distance_at(i);
 
-                if(dist == a.distances()[i])
-                    q.push(ICHSearchNode(iter.first.first, i, dist, path_count), ch.nodes[iter.first.first].dist_index);
+                if(dist == a.distance_at(i)) {
+                    path_t path_count = iter.second.second * b.paths_at(i);
+                    EnqueAndUpdate_i(ch, ci, iter.first.first, i, path_count);
+                }
             }
         }
     }
@@ -3140,35 +6034,40 @@ void Graph::DCL_Inc(ContractionHierarchy &ch, ContractionIndex &ci, std::vector<
     // update distances involving descendants
     while(!q.empty()) {
         ICHSearchNode next = q.pop();
+        tally[metrics::Counter::queue_pops]++;
+        tally[metrics::Counter::labels_touched]++;
+
+        FlatCutIndex cv = ci.get_mutable_cut_index(next.v, next.i);
+        // resetting the highest bit
+        cv.paths_at(next.i) &= ~PATH_FLAG;
+        path_t convex_path_count = next.path_count - cv.paths_at(next.i);
 
         // update descendants
-        FlatCutIndex cv = ci.get_contraction_label(next.v).cut_index;
-        for(NodeID u: ch.nodes[next.v].down_neighbors) {
+        for(NodeID u: ch.down_neighbors(next.v)) {
             Neighbor &x = UpNeighbor(ch, u, next.v);
             FlatCutIndex cu = ci.get_contraction_label(u).cut_index;
-            distance_t dist = x.distance + cv.distances()[next.i];
-            uint16_t path_count = x.path_count * next.path_count;
+            distance_t dist = x.distance + cv.distance_at(next.i);
 
-            if(dist == cu.distances()[next.i])
-                q.push(ICHSearchNode(u, next.i, dist, path_count), ch.nodes[u].dist_index);
+            if(dist == cu.distance_at(next.i)) {
+                path_t path_count = x.path_count * convex_path_count;
+                EnqueAndUpdate_i(ch, ci, u, next.i, path_count);
+            }
         }
 
-        if(cv.paths()[next.i] > next.path_count) { // update path count, distance does not change
-            cv.paths()[next.i] = cv.paths()[next.i] - next.path_count;
-        } else { // recompute distance and path count
-            cv.distances()[next.i] = infinity;
-            for(Neighbor &u: ch.nodes[next.v].up_neighbors) {
-                if(ch.nodes[u.node].dist_index >= next.i) {
-                    Neighbor &x = UpNeighbor(ch, next.v, u.node);
-                    FlatCutIndex cu = ci.get_contraction_label(u.node).cut_index;
-                    distance_t dist = x.distance + cu.distances()[next.i];
-                    uint16_t path_count = x.path_count * cu.paths()[next.i];
-
-                    if(dist < cv.distances()[next.i]) {
-                        cv.distances()[next.i] = dist;
-                        cv.paths()[next.i] = path_count;
-                    } else if(dist == cv.distances()[next.i]) {
-                        cv.paths()[next.i] = cv.paths()[next.i] + path_count;
+        if(cv.paths_at(next.i) == 0) {
+            cv.distance_at(next.i) = infinity;
+            for(Neighbor &w: ch.up_neighbors(next.v)) {
+                if(ch.dist_index[w.node] >= next.i) {
+                    Neighbor &x = UpNeighbor(ch, next.v, w.node);
+                    FlatCutIndex cw = ci.get_contraction_label(w.node).cut_index;
+                    distance_t dist = x.distance + cw.distance_at(next.i);
+                    path_t path_count = x.path_count * cw.paths_at(next.i);
+
+                    if(dist < cv.distance_at(next.i)) {
+                        cv.distance_at(next.i) = dist;
+                        cv.paths_at(next.i) = path_count;
+                    } else if(dist == cv.distance_at(next.i)) {
+                        cv.paths_at(next.i) = cv.paths_at(next.i) + path_count;
                     }
                 }
             }
@@ -3176,332 +6075,826 @@ void Graph::DCL_Inc(ContractionHierarchy &ch, ContractionIndex &ci, std::vector<
     }
 }
 
-////////////////////// Parallel Maintenance
-
-void Graph::DCL_Dec_Par(ContractionHierarchy &ch, ContractionIndex &ci, vector<pair<pair<distance_t, distance_t>, pair<NodeID, NodeID> > >& updates) {
-
-    vector<thread> threads;
-    auto dhcldec = [this](ContractionHierarchy &ch, ContractionIndex& ci, util::TSBucketQueue<ICHSearchNode_P>& que) {
-
-        util::min_bucket_queue<ICHSearchNode_P> bq;
-        vector<ICHSearchNode_P> bucket; size_t label_index;
-        while (que.next_bucket(bucket, label_index))
-        {
-            for (ICHSearchNode_P obj : bucket)
-                bq.push(obj, label_index);
-
-            // update distances involving descendants
-            while(!bq.empty()) {
-                ICHSearchNode_P next = bq.pop();
-
-                FlatCutIndex cv = ci.get_contraction_label(next.v).cut_index;
-                if(cv.distances()[label_index] > next.distance) {
-                    cv.distances()[label_index] = next.distance;
-                    cv.paths()[label_index] = next.path_count;
-                } else if(cv.distances()[label_index] == next.distance) {
-                    cv.paths()[label_index] = cv.paths()[label_index] + next.path_count;
-                } else
-                    continue;
+void Graph::contract_seq(ContractionIndex &ci, vector<pair<pair<distance_t,distance_t>, NodeID> >& contracted_updates) {
+    metrics::PhaseTimer timer(metrics::Phase::contract_seq);
 
-                // queue updates for descendants
-                for(NodeID u: ch.nodes[next.v].down_neighbors) {
-                    Neighbor &x = UpNeighbor(ch, u, next.v);
-                    distance_t dist = x.distance + next.distance;
+    // we start searches in order of original distance and cancel searches for nodes already updated
+    sort(contracted_updates.begin(), contracted_updates.end());
+    // search from each update using DFS
+    vector<SearchNode> stack;
+    for (auto& it: contracted_updates) {
+        // if already processed, distance offset has (probably) changed
+        if (it.first.first != ci.get_contraction_label(it.second).distance_offset)
+            continue;
+        stack.push_back(SearchNode(it.first.second, it.second));
+        while (!stack.empty()) {
+            SearchNode next = stack.back(); stack.pop_back();
 
-                    FlatCutIndex cu = ci.get_contraction_label(u).cut_index;
-                    if(cu.distances()[label_index] >= dist) {
-                        uint16_t path_count = x.path_count * next.path_count;
-                        bq.push(ICHSearchNode_P(u, dist, path_count), label_index);
-                    }
-                }
+            // update label
+            ci.update_distance_offset(next.node, next.distance);
+            // enqueue neighbors
+            for (Neighbor n : node_data[next.node].neighbors) {
+                if (ci.get_contraction_label(n.node).parent == next.node)
+                    stack.push_back(SearchNode(next.distance + n.distance, n.node));
             }
         }
-    };
-
-    vector<pair<edge_t, edata_t> > C;
-    GS_Dec(ch, updates, C);
+    }
+}
 
-    //update distances involving ancestors
-    util::TSBucketQueue<ICHSearchNode_P> grouping;
-    for(pair<edge_t, edata_t> iter: C) {
-        FlatCutIndex a = ci.get_contraction_label(iter.first.first).cut_index;
-        if(iter.second.first <= a.distances()[ch.nodes[iter.first.second].dist_index]) {
+// coalesce updates of the same (undirected) edge, keeping the last one
+static vector<Edge> coalesce_updates(const vector<Edge> &updates)
+{
+    vector<pair<edge_t, size_t>> order;
+    order.reserve(updates.size());
+    for (size_t i = 0; i < updates.size(); i++)
+        order.push_back(make_pair(make_pair(min(updates[i].a, updates[i].b), max(updates[i].a, updates[i].b)), i));
+    sort(order.begin(), order.end());
+    vector<Edge> coalesced;
+    for (size_t i = 0; i < order.size(); i++)
+        if (i + 1 == order.size() || order[i + 1].first != order[i].first)
+            coalesced.push_back(updates[order[i].second]);
+    return coalesced;
+}
 
-            FlatCutIndex b = ci.get_contraction_label(iter.first.second).cut_index;
-            for(size_t i = 0; i <= ch.nodes[iter.first.second].dist_index; i++) {
-                distance_t dist = iter.second.first + b.distances()[i];
+void Graph::apply_updates(ContractionHierarchy &ch, ContractionIndex &ci, const vector<Edge> &updates, bool parallel)
+{
+    metrics::PhaseTimer timer(metrics::Phase::apply_updates);
+    auto start = chrono::steady_clock::now();
+    metrics::add(metrics::Counter::updates, updates.size());
+    vector<Edge> decreases, increases;
+    for (const Edge &e : coalesce_updates(updates))
+    {
+        distance_t old_weight = edge_weight(e.a, e.b);
+        if (old_weight == infinity || e.d == old_weight)
+            continue;
+        (e.d < old_weight ? decreases : increases).push_back(e);
+    }
 
-                if(a.distances()[i] >= dist) {
-                    uint16_t path_count = iter.second.second * b.paths()[i];
-                    grouping.push(ICHSearchNode_P(iter.first.first, dist, path_count), i);
-                }
+    // decreases first; edges of later batch still carry their old weight in graph and shortcut graph
+    for (bool decrease : { true, false })
+    {
+        vector<pair<pair<distance_t,distance_t>, NodeID> > contracted_updates;
+        vector<pair<pair<distance_t, distance_t>, pair<NodeID, NodeID> > > core_updates;
+        for (const Edge &e : decrease ? decreases : increases)
+        {
+            distance_t old_weight = edge_weight(e.a, e.b);
+            update_edge(e.a, e.b, e.d);
+            update_edge(e.b, e.a, e.d);
+            if (ci.is_contracted(e.a) || ci.is_contracted(e.b))
+            {
+                ContractionLabel x = ci.get_contraction_label(e.a), y = ci.get_contraction_label(e.b);
+                if (x.distance_offset > y.distance_offset)
+                    contracted_updates.push_back(make_pair(make_pair(x.distance_offset, y.distance_offset + e.d), e.a));
+                else if (x.distance_offset < y.distance_offset)
+                    contracted_updates.push_back(make_pair(make_pair(y.distance_offset, x.distance_offset + e.d), e.b));
+                continue;
             }
+            core_updates.push_back(make_pair(make_pair(old_weight, e.d), make_pair(e.a, e.b)));
         }
+        if (!core_updates.empty())
+        {
+            if (decrease && parallel)
+                DCL_Dec_Par(ch, ci, core_updates);
+            else if (decrease)
+                DCL_Dec(ch, ci, core_updates);
+            else if (parallel)
+                DCL_Inc_Par(ch, ci, core_updates);
+            else
+                DCL_Inc(ch, ci, core_updates);
+        }
+        contract_seq(ci, contracted_updates);
     }
-
-    for (size_t i = 0; i < MULTI_THREAD_DISTANCES; i++)
-        threads.push_back(thread(dhcldec, std::ref(ch), std::ref(ci), std::ref(grouping)));
-    for (size_t i = 0; i < MULTI_THREAD_DISTANCES; i++)
-        threads[i].join();
+    metrics::record(metrics::Histogram::update_latency, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
 }
 
-void Graph::DCL_Inc_Par(ContractionHierarchy &ch, ContractionIndex &ci, vector<pair<pair<distance_t, distance_t>, pair<NodeID, NodeID> > >& updates) {
-
-    vector<thread> threads;
-    auto dhclinc = [this](ContractionHierarchy &ch, ContractionIndex& ci, util::TSBucketQueue<ICHSearchNode_P>& que) {
+////////////////////// Localized Rebuild
 
-        util::min_bucket_queue<ICHSearchNode_P> bq;
-        vector<ICHSearchNode_P> bucket; size_t label_index;
-        while (que.next_bucket(bucket, label_index))
+void Graph::rebuild_subtree(ContractionHierarchy &ch, ContractionIndex &ci, uint64_t partition_bitvector, double balance)
+{
+    metrics::PhaseTimer timer(metrics::Phase::rebuild_subtree);
+    uint16_t level = PBV::cut_level(partition_bitvector);
+    size_t node_count = ch.node_count();
+    // nodes of subtree, and ancestors (cut vertices above subtree) whose labels and shortcuts between them stay
+    enum Role : uint8_t { other, subtree, ancestor };
+    vector<uint8_t> role(node_count, other);
+    vector<NodeID> subtree_nodes;
+    [[maybe_unused]] size_t ancestor_count = 0;
+    for (NodeID node = 1; node < node_count; node++)
+    {
+        FlatCutIndex cut_index = ci.get_contraction_label(node).cut_index;
+        if (ci.is_contracted(node) || cut_index.empty())
+            continue;
+        uint64_t bv = *cut_index.partition_bitvector();
+        if (PBV::is_ancestor(partition_bitvector, bv))
         {
-            // move items to bucket queue
-            for (ICHSearchNode_P obj: bucket)
-                bq.push(obj, label_index);
-
-            while(!bq.empty()) {
-                ICHSearchNode_P next = bq.pop();
+            role[node] = subtree;
+            subtree_nodes.push_back(node);
+        }
+        else if (PBV::is_ancestor(bv, partition_bitvector))
+        {
+            role[node] = ancestor;
+            ancestor_count++;
+        }
+    }
+    if (subtree_nodes.empty())
+        return;
+    metrics::add(metrics::Counter::rebuilt_nodes, subtree_nodes.size());
+
+    // cut indexes of subtree nodes, truncated to the cut levels above the subtree
+    vector<CutIndex> cis(node_count);
+    vector<edge_t> pairs;
+    auto add_ancestor_pairs = [&role, &pairs](const vector<Neighbor> &up) {
+        // up neighbors are sorted by decreasing dist_index, so the first of each pair is the lower node
+        for (size_t i = 0; i < up.size(); i++)
+            if (role[up[i].node] == ancestor)
+                for (size_t j = i + 1; j < up.size(); j++)
+                    pairs.push_back(make_pair(up[i].node, up[j].node));
+    };
+    for (NodeID x : subtree_nodes)
+    {
+        FlatCutIndex old = ci.get_contraction_label(x).cut_index;
+        cis[x].partition = old.partition() & ((static_cast<uint64_t>(1) << level) - 1);
+        cis[x].dist_index.assign(old.dist_index(), old.dist_index() + level);
+        assert(level == 0 || cis[x].dist_index.back() == ancestor_count);
+        // shortcuts between ancestors that subtree nodes contributed to
+        span<const Neighbor> up = ch.up_neighbors(x);
+        add_ancestor_pairs(vector<Neighbor>(up.begin(), up.end()));
+    }
 
-                // update descendants
-                FlatCutIndex cv = ci.get_contraction_label(next.v).cut_index;
-                for(NodeID u: ch.nodes[next.v].down_neighbors) {
-                    Neighbor &x = UpNeighbor(ch, u, next.v);
-                    FlatCutIndex cu = ci.get_contraction_label(u).cut_index;
-                    distance_t dist = x.distance + cv.distances()[label_index];
+    // re-decompose subtree; subgraphs share node data, so membership of nodes in this graph gets restored afterwards
+    if (level == 0)
+    {
+        Graph g(subtree_nodes.begin(), subtree_nodes.end());
+        g.extend_cut_index(cis, balance, 0);
+    }
+    else
+        extend_on_partition(cis, balance, level - 1, subtree_nodes, {});
+    assign_nodes();
 
-                    if(dist == cu.distances()[label_index]) {
-                        uint16_t path_count = x.path_count * next.path_count;
-                        bq.push(ICHSearchNode_P(u, dist, path_count), label_index);
-                    }
+    // create shortcuts of subtree nodes bottom-up, as in create_sc_graph; shortcuts between ancestors only get
+    // collected, as they also depend on nodes outside the subtree
+    vector<vector<Neighbor>> up_neighbors(node_count);
+    vector<vector<NodeID>> down_neighbors(node_count);
+    for (NodeID x : subtree_nodes)
+    {
+        ch.dist_index[x] = cis[x].dist_index[cis[x].cut_level] - 1;
+        // labels grow by one (the node itself) during construction
+        cis[x].distances.reserve(ch.dist_index[x] + 1);
+        cis[x].paths.reserve(ch.dist_index[x] + 1);
+        cis[x].distances.resize(ch.dist_index[x], infinity);
+        cis[x].paths.resize(ch.dist_index[x], 0);
+    }
+    for (NodeID x : subtree_nodes)
+        for (Neighbor &n : node_data[x].neighbors)
+        {
+            // neighbors outside subtree and ancestors have been contracted
+            assert(role[n.node] != other || ci.is_contracted(n.node));
+            if (role[n.node] != other && ch.dist_index[n.node] < ch.dist_index[x])
+            {
+                up_neighbors[x].push_back(Neighbor(n.node, n.distance, 1));
+                cis[x].distances[ch.dist_index[n.node]] = n.distance;
+                cis[x].paths[ch.dist_index[n.node]] = 1;
+            }
+        }
+    auto di_order = [&ch](NodeID a, NodeID b) -> bool
+    {
+        return ch.dist_index[a] > ch.dist_index[b];
+    };
+    auto di_order1 = [&ch](Neighbor a, Neighbor b) -> bool
+    {
+        if(ch.dist_index[a.node] > ch.dist_index[b.node]) return true;
+        if(ch.dist_index[a.node] == ch.dist_index[b.node] && a.distance < b.distance) return true;
+        if(ch.dist_index[a.node] == ch.dist_index[b.node] && a.distance == b.distance && a.path_count > b.path_count) return true;
+        return false;
+    };
+    vector<NodeID> bottom_up_nodes = subtree_nodes;
+    std::sort(bottom_up_nodes.begin(), bottom_up_nodes.end(), di_order);
+    for (NodeID node : bottom_up_nodes)
+    {
+        vector<Neighbor> &up = up_neighbors[node];
+        util::make_set(up, di_order1);
+        for (size_t i = 0; i + 1 < up.size() && role[up[i].node] == subtree; i++)
+            for (size_t j = i + 1; j < up.size(); j++)
+            {
+                CutIndex &lower = cis[up[i].node];
+                uint16_t index = ch.dist_index[up[j].node];
+                distance_t weight = up[i].distance + up[j].distance;
+                path_t path_count = up[i].path_count * up[j].path_count;
+                if (weight < lower.distances[index])
+                {
+                    up_neighbors[up[i].node].push_back(Neighbor(up[j].node, weight, path_count));
+                    lower.distances[index] = weight;
+                    lower.paths[index] = path_count;
                 }
-
-                if(cv.paths()[label_index] > next.path_count) { // update path count, distance does not change
-                    cv.paths()[label_index] = cv.paths()[label_index] - next.path_count;
-                } else { // recompute distance and path count
-                    cv.distances()[label_index] = infinity;
-                    for(Neighbor &u: ch.nodes[next.v].up_neighbors) {
-                        if(ch.nodes[u.node].dist_index >= label_index) {
-                            Neighbor &x = UpNeighbor(ch, next.v, u.node);
-                            FlatCutIndex cu = ci.get_contraction_label(u.node).cut_index;
-                            distance_t dist = x.distance + cu.distances()[label_index];
-                            uint16_t path_count = x.path_count * cu.paths()[label_index];
-
-                            if(dist < cv.distances()[label_index]) {
-                                cv.distances()[label_index] = dist;
-                                cv.paths()[label_index] = path_count;
-                            } else if(dist == cv.distances()[label_index]) {
-                                cv.paths()[label_index] = cv.paths()[label_index] + path_count;
-                            }
-                        }
-                    }
+                else if (weight == lower.distances[index])
+                {
+                    lower.paths[index] += path_count;
+                    up_neighbors[up[i].node].push_back(Neighbor(up[j].node, weight, lower.paths[index]));
                 }
             }
+        add_ancestor_pairs(up);
+    }
+    util::make_set(pairs);
+
+    // splice subtree edges into shortcut graph, adding missing shortcuts between ancestors with infinite weight, so
+    // ancestors keep all pairs of up neighbors of their descendants connected
+    for (NodeID v = 1; v < node_count; v++)
+        if (role[v] != subtree)
+        {
+            span<const Neighbor> up = ch.up_neighbors(v);
+            up_neighbors[v].assign(up.begin(), up.end());
+            for (NodeID d : ch.down_neighbors(v))
+                if (role[d] != subtree)
+                    down_neighbors[v].push_back(d);
+        }
+    for (NodeID x : subtree_nodes)
+        for (const Neighbor &n : up_neighbors[x])
+            down_neighbors[n.node].push_back(x);
+    map<edge_t, edata_t> old_values;
+    for (edge_t e : pairs)
+    {
+        vector<Neighbor> &up = up_neighbors[e.first];
+        if (find_if(up.begin(), up.end(), [&e](const Neighbor &n) { return n.node == e.second; }) == up.end())
+        {
+            up.push_back(Neighbor(e.second, infinity, 1));
+            old_values[e] = make_pair(infinity, 1);
+        }
+    }
+    for (NodeID v = 1; v < node_count; v++)
+        if (role[v] == ancestor)
+        {
+            std::sort(up_neighbors[v].begin(), up_neighbors[v].end(), di_order1);
+            std::sort(down_neighbors[v].begin(), down_neighbors[v].end());
         }
+    for (NodeID x : subtree_nodes)
+        std::sort(down_neighbors[x].begin(), down_neighbors[x].end());
+    ch.assign(up_neighbors, down_neighbors);
+
+    // recompute shortcuts between ancestors bottom-up from graph edge and common down neighbors, as in GS_Inc
+    priority_queue<DCHSearchNode> q;
+    set<edge_t> queued;
+    auto push = [&ch, &q, &queued](NodeID v, NodeID w) {
+        if (ch.dist_index[v] < ch.dist_index[w])
+            swap(v, w);
+        if (queued.insert(make_pair(v, w)).second)
+            q.push(DCHSearchNode(ch.dist_index[v], v, w, 0, 0));
     };
+    for (edge_t e : pairs)
+        push(e.first, e.second);
+    while (!q.empty())
+    {
+        DCHSearchNode next = q.top(); q.pop();
+        Neighbor &x = UpNeighbor(ch, next.v, next.w);
+        edata_t before(x.distance, x.path_count);
+        x.distance = edge_weight(next.v, next.w);
+        x.path_count = 1;
+        span<const NodeID> down_v = ch.down_neighbors(next.v), down_w = ch.down_neighbors(next.w);
+        size_t i = 0, j = 0;
+        while (i < down_v.size() && j < down_w.size())
+        {
+            if (down_v[i] < down_w[j]) i++;
+            else if (down_w[j] < down_v[i]) j++;
+            else
+            {
+                Neighbor &av = UpNeighbor(ch, down_v[i], next.v);
+                Neighbor &aw = UpNeighbor(ch, down_v[i], next.w);
+                distance_t dist = av.distance + aw.distance;
+                path_t path_count = av.path_count * aw.path_count;
+                if (dist < x.distance) {
+                    x.distance = dist;
+                    x.path_count = path_count;
+                } else if (dist == x.distance)
+                    x.path_count = x.path_count + path_count;
+                i++; j++;
+            }
+        }
+        if (edata_t(x.distance, x.path_count) == before)
+            continue;
+        old_values.emplace(make_pair(next.v, next.w), before);
+        // shortcuts created by contracting next.v depend on changed edge
+        for (const Neighbor &n : ch.up_neighbors(next.v))
+            if (n.node != next.w)
+                push(next.w, n.node);
+    }
 
-    vector<pair<edge_t, edata_t> > C;
-    GS_Inc(ch, updates, C);
+    // propagate changed shortcuts between ancestors to labels outside the subtree: increases (and decreased path
+    // counts) as by DCL_Inc, with decreased shortcuts still at their old values, then decreases as by DCL_Dec;
+    // subtree nodes have no labels meanwhile, so maintenance skips them
+    vector<pair<edge_t, edata_t> > increases, decreases, decreased_values;
+    for (const pair<const edge_t, edata_t> &old : old_values)
+    {
+        Neighbor &x = UpNeighbor(ch, old.first.first, old.first.second);
+        edata_t now(x.distance, x.path_count), before = old.second;
+        if (now == before || (now.first == infinity && before.first == infinity))
+            continue;
+        if (now.first < before.first)
+            decreases.push_back(make_pair(old.first, now));
+        else if (now.first > before.first)
+            increases.push_back(make_pair(old.first, before));
+        else if (now.second > before.second)
+            decreases.push_back(make_pair(old.first, make_pair(now.first, now.second - before.second)));
+        else
+            increases.push_back(make_pair(old.first, make_pair(before.first, before.second - now.second)));
+        if (now.first < before.first || (now.first == before.first && now.second > before.second))
+        {
+            decreased_values.push_back(make_pair(old.first, now));
+            x.distance = before.first;
+            x.path_count = before.second;
+        }
+    }
+    ci.next_epoch();
+    for (NodeID x : subtree_nodes)
+        ci.replace_labels(x, nullptr);
+    if (!increases.empty())
+        DCL_Inc_Labels(ch, ci, increases);
+    for (const pair<edge_t, edata_t> &d : decreased_values)
+    {
+        Neighbor &x = UpNeighbor(ch, d.first.first, d.first.second);
+        x.distance = d.second.first;
+        x.path_count = d.second.second;
+    }
+    if (!decreases.empty())
+        DCL_Dec_Labels(ch, ci, decreases);
 
-    //update distances involving ancestors
-    util::TSBucketQueue<ICHSearchNode_P> grouping;
-    for(pair<edge_t, edata_t> iter: C) {
-        FlatCutIndex a = ci.get_contraction_label(iter.first.first).cut_index;
-        if(iter.second.first == a.distances()[ch.nodes[iter.first.second].dist_index]) {
+    // compute labels of subtree nodes top-down from those of their upward neighbors, as in create_sc_graph
+    auto compute_labels = [&ch, &ci, &cis, &role](NodeID x) {
+        CutIndex &cx = cis[x];
+        for (const Neighbor &n : ch.up_neighbors(x))
+        {
+            auto combine = [&cx, &n](size_t anc, distance_t label_distance, path_t label_paths) {
+                distance_t dist = n.distance + label_distance;
+                path_t path_count = n.path_count * label_paths;
+                if (dist < cx.distances[anc]) {
+                    cx.distances[anc] = dist;
+                    cx.paths[anc] = path_count;
+                } else if (dist == cx.distances[anc])
+                    cx.paths[anc] += path_count;
+            };
+            if (role[n.node] == subtree)
+                for (size_t anc = 0; anc < ch.dist_index[n.node]; anc++)
+                    combine(anc, cis[n.node].distances[anc], cis[n.node].paths[anc]);
+            else
+            {
+                FlatCutIndex cn = ci.get_contraction_label(n.node).cut_index;
+                for (size_t anc = 0; anc < ch.dist_index[n.node]; anc++)
+                    combine(anc, cn.distance_at(anc), cn.paths_at(anc));
+            }
+        }
+        cx.distances.push_back(0);
+        cx.paths.push_back(1);
+    };
+#ifdef MULTI_THREAD_DISTANCES
+    // process nodes top-down, level by level
+    util::par_level_list<NodeID> top_down(vector<NodeID>(bottom_up_nodes.rbegin(), bottom_up_nodes.rend()),
+        [&ch](NodeID node) { return ch.dist_index[node]; }, label_grain);
+    top_down.run(thread_count, compute_labels);
+#else
+    for (auto it = bottom_up_nodes.rbegin(); it != bottom_up_nodes.rend(); it++)
+        compute_labels(*it);
+#endif
+    ci.next_epoch();
+    for (NodeID x : subtree_nodes)
+        ci.replace_labels(x, &cis[x]);
+}
 
-            FlatCutIndex b = ci.get_contraction_label(iter.first.second).cut_index;
-            for(size_t i = 0; i <= ch.nodes[iter.first.second].dist_index; i++) {
-                distance_t dist = iter.second.first + b.distances()[i];
+// cost model of apply_changes, in units of rebuilding one subtree node: maintaining a weight decrease / increase, and
+// the overhead of a rebuild per core node of the index (scanning labels and re-assigning the shortcut graph); rough
+// estimates from measurements on road networks
+static const double decrease_cost = 80, increase_cost = 100, rebuild_overhead = 1.0 / 64;
 
-		if(dist == a.distances()[i]) {
-                    uint16_t path_count = iter.second.second * b.paths()[i];
-                    grouping.push(ICHSearchNode_P(iter.first.first, dist, path_count), i);
-                }
-            }
+void Graph::apply_changes(ContractionHierarchy &ch, ContractionIndex &ci, const vector<Edge> &changes, double balance, bool parallel)
+{
+    struct Change
+    {
+        Edge e;
+        distance_t old_weight;
+        uint64_t subtree; // smallest partition subtree containing both endpoints
+    };
+    // changes of contracted nodes get maintained, the others are grouped by subtree
+    vector<Change> grouped;
+    vector<Edge> maintained;
+    for (const Edge &e : coalesce_updates(changes))
+    {
+        distance_t old_weight = edge_weight(e.a, e.b);
+        if (e.d == old_weight)
+            continue;
+        bool structural = old_weight == infinity || e.d == infinity;
+        FlatCutIndex a = ci.get_contraction_label(e.a).cut_index, b = ci.get_contraction_label(e.b).cut_index;
+        if (ci.is_contracted(e.a) || ci.is_contracted(e.b) || a.empty() || b.empty())
+        {
+            if (structural)
+                cerr << "skipping change of edge " << e.a << "-" << e.b << ", as it changes contracted nodes or nodes without labels" << endl;
+            else
+                maintained.push_back(e);
+            continue;
+        }
+        grouped.push_back(Change { e, old_weight, PBV::lca(*a.partition_bitvector(), *b.partition_bitvector()) });
+    }
+
+    // merge groups into groups of ancestor subtrees, so the remaining subtrees are disjoint
+    vector<uint64_t> subtrees;
+    for (const Change &c : grouped)
+        subtrees.push_back(c.subtree);
+    std::sort(subtrees.begin(), subtrees.end(), [](uint64_t a, uint64_t b) { return PBV::cut_level(a) < PBV::cut_level(b) || (PBV::cut_level(a) == PBV::cut_level(b) && a < b); });
+    subtrees.erase(unique(subtrees.begin(), subtrees.end()), subtrees.end());
+    // size and estimated maintenance cost of each remaining subtree
+    unordered_map<uint64_t, pair<size_t, double>> groups;
+    auto find_group = [&groups](uint64_t bv) {
+        for (uint16_t level = 0; level <= PBV::cut_level(bv); level++)
+        {
+            auto it = groups.find(PBV::from(PBV::partition(bv), level));
+            if (it != groups.end())
+                return it;
         }
+        return groups.end();
+    };
+    for (uint64_t bv : subtrees)
+        if (find_group(bv) == groups.end())
+            groups[bv] = make_pair(0, 0.0);
+    if (groups.empty())
+    {
+        if (!maintained.empty())
+            apply_updates(ch, ci, maintained, parallel);
+        return;
+    }
+    for (Change &c : grouped)
+    {
+        auto group = find_group(c.subtree);
+        c.subtree = group->first;
+        if (c.old_weight == infinity || c.e.d == infinity)
+            group->second.second = numeric_limits<double>::infinity();
+        else
+            group->second.second += c.e.d < c.old_weight ? decrease_cost : increase_cost;
+    }
+    size_t core_nodes = 0;
+    for (NodeID node = 1; node < ch.node_count(); node++)
+    {
+        FlatCutIndex cut_index = ci.get_contraction_label(node).cut_index;
+        if (ci.is_contracted(node) || cut_index.empty())
+            continue;
+        core_nodes++;
+        auto group = find_group(*cut_index.partition_bitvector());
+        if (group != groups.end())
+            group->second.first++;
     }
 
-    for (size_t i = 0; i < MULTI_THREAD_DISTANCES; i++)
-        threads.push_back(thread(dhclinc, std::ref(ch), std::ref(ci), std::ref(grouping)));
-    for (size_t i = 0; i < MULTI_THREAD_DISTANCES; i++)
-        threads[i].join();
+    // rebuild subtrees whose maintenance is estimated to cost more, after applying their changes to the graph
+    vector<uint64_t> rebuilt;
+    for (const pair<const uint64_t, pair<size_t, double>> &group : groups)
+        if (group.second.second >= group.second.first + rebuild_overhead * core_nodes)
+            rebuilt.push_back(group.first);
+    std::sort(rebuilt.begin(), rebuilt.end());
+    size_t rebuilt_changes = 0;
+    for (const Change &c : grouped)
+    {
+        if (!binary_search(rebuilt.begin(), rebuilt.end(), c.subtree))
+        {
+            maintained.push_back(c.e);
+            continue;
+        }
+        rebuilt_changes++;
+        if (c.e.d == infinity)
+            remove_edge(c.e.a, c.e.b);
+        else if (c.old_weight == infinity)
+            add_edge(c.e.a, c.e.b, c.e.d, true);
+        else
+        {
+            update_edge(c.e.a, c.e.b, c.e.d);
+            update_edge(c.e.b, c.e.a, c.e.d);
+        }
+    }
+    metrics::add(metrics::Counter::updates, rebuilt_changes);
+    for (uint64_t bv : rebuilt)
+        rebuild_subtree(ch, ci, bv, balance);
+    if (!maintained.empty())
+        apply_updates(ch, ci, maintained, parallel);
 }
 
+//--------------------------- UpdatePipeline ------------------------
 
-////////////////////// Optimized Maintenance (Avoiding Propagation Overhead in Count Updates)
+UpdatePipeline::UpdatePipeline(Graph &g, ContractionHierarchy &ch, ContractionIndex &ci, double window, bool parallel)
+    : g(g), ch(ch), window(chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(window))), parallel(parallel)
+{
+    shadow.reset(new ContractionIndex(&ci));
+    ci.index_trees();
+    shadow->index_trees();
+    versions[0].ci = &ci;
+    versions[1].ci = shadow.get();
+    worker = thread(&UpdatePipeline::run, this);
+}
 
-util::min_bucket_queue<ICHSearchNode> q;
-void Graph::EnqueAndUpdate_d(ContractionHierarchy &ch, ContractionIndex &ci, NodeID v, uint16_t i, distance_t dist, uint16_t path_count) {
+UpdatePipeline::~UpdatePipeline()
+{
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        stopping = true;
+    }
+    queue_cv.notify_all();
+    worker.join();
+    assert(versions[0].readers == 0 && versions[1].readers == 0);
+}
 
-    //store original values in queue
-    FlatCutIndex cv = ci.get_contraction_label(v).cut_index;
-    if((cv.paths()[i] & (1 << 15)) == 0) {
-        q.push(ICHSearchNode(v, i, cv.distances()[i], cv.paths()[i]), ch.nodes[v].dist_index);
-        // setting the highest bit
-        cv.paths()[i] = cv.paths()[i] | (1 << 15);
+void UpdatePipeline::push(NodeID a, NodeID b, distance_t weight)
+{
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        if (pending.empty())
+            pending_since = chrono::steady_clock::now();
+        pending.push_back(Edge(a, b, weight));
+        queued++;
+    }
+    queue_cv.notify_all();
+}
+
+void UpdatePipeline::flush()
+{
+    unique_lock<mutex> lock(queue_mutex);
+    uint64_t target = queued;
+    flush_target = max(flush_target, target);
+    queue_cv.notify_all();
+    applied_cv.wait(lock, [this, target] { return applied >= target; });
+}
+
+void UpdatePipeline::run()
+{
+    unique_lock<mutex> lock(queue_mutex);
+    while (true)
+    {
+        queue_cv.wait(lock, [this] { return stopping || !pending.empty(); });
+        if (pending.empty())
+            break;
+        // keep collecting until window closes, unless asked to flush or stop
+        queue_cv.wait_until(lock, pending_since + window, [this] { return stopping || flush_target > applied; });
+        vector<Edge> batch;
+        batch.swap(pending);
+        uint64_t batch_end = queued;
+        lock.unlock();
+        apply(batch);
+        lock.lock();
+        applied = batch_end;
+        applied_cv.notify_all();
     }
+}
+
+void UpdatePipeline::apply(vector<Edge> &batch)
+{
+    // both versions are identical between batches, so the unpublished one shares all blocks with the published one
+    Version &target = versions[1 - published];
+    target.ci->copy_on_write = true;
+    g.apply_updates(ch, *target.ci, batch, parallel);
+    target.ci->copy_on_write = false;
+
+    // publish, then bring previous version up to date once its readers are gone
+    unique_lock<mutex> lock(version_mutex);
+    Version &previous = versions[published];
+    published = 1 - published;
+    m_version++;
+    released_cv.wait(lock, [&previous] { return previous.readers == 0; });
+    lock.unlock();
+    previous.ci->catch_up(*target.ci);
+}
+
+UpdatePipeline::Snapshot UpdatePipeline::snapshot() const
+{
+    return Snapshot(*this);
+}
+
+uint64_t UpdatePipeline::version() const
+{
+    lock_guard<mutex> lock(version_mutex);
+    return m_version;
+}
+
+UpdatePipeline::Snapshot::Snapshot(const UpdatePipeline &pipeline) : pipeline(pipeline)
+{
+    lock_guard<mutex> lock(pipeline.version_mutex);
+    current = &pipeline.versions[pipeline.published];
+    current->readers++;
+    m_version = pipeline.m_version;
+}
 
-    // update values in index
-    if(cv.distances()[i] > dist) {
-        cv.distances()[i] = dist;
-        cv.paths()[i] = path_count | (1 << 15);
-    } else {
-        cv.paths()[i] = cv.paths()[i] + path_count;
-    }
+UpdatePipeline::Snapshot::~Snapshot()
+{
+    lock_guard<mutex> lock(pipeline.version_mutex);
+    if (--current->readers == 0)
+        pipeline.released_cv.notify_all();
 }
 
-void Graph::EnqueAndUpdate_i(ContractionHierarchy &ch, ContractionIndex &ci, NodeID v, uint16_t i, uint16_t path_count) {
+const ContractionIndex& UpdatePipeline::Snapshot::index() const
+{
+    return *current->ci;
+}
 
-    //store original values in queue
-    FlatCutIndex cv = ci.get_contraction_label(v).cut_index;
-    if((cv.paths()[i] & (1 << 15)) == 0) {
-        q.push(ICHSearchNode(v, i, cv.distances()[i], cv.paths()[i]), ch.nodes[v].dist_index);
-        // setting the highest bit
-        cv.paths()[i] = cv.paths()[i] | (1 << 15);
-    }
+const ContractionIndex* UpdatePipeline::Snapshot::operator->() const
+{
+    return current->ci;
+}
 
-    // update count in index
-    cv.paths()[i] = cv.paths()[i] - path_count;
+uint64_t UpdatePipeline::Snapshot::version() const
+{
+    return m_version;
 }
 
-void Graph::DCL_Dec_Opt(ContractionHierarchy &ch, ContractionIndex &ci, vector<pair<pair<distance_t, distance_t>, pair<NodeID, NodeID> > >& updates) {
+//--------------------------- metrics -------------------------------
 
-    vector<pair<edge_t, edata_t> > C;
-    GS_Dec(ch, updates, C);
+namespace metrics
+{
 
-    //update distances involving ancestors
-    for(pair<edge_t, edata_t> iter: C) {
-        FlatCutIndex a = ci.get_contraction_label(iter.first.first).cut_index;
-        if(iter.second.first <= a.distances()[ch.nodes[iter.first.second].dist_index]) {
+static const size_t phase_count = static_cast<size_t>(Phase::COUNT);
+static const size_t counter_count = static_cast<size_t>(Counter::COUNT);
+static const size_t histogram_count = static_cast<size_t>(Histogram::COUNT);
+static const size_t histogram_buckets = 65; // bucket i holds values of bit width i
 
-            FlatCutIndex b = ci.get_contraction_label(iter.first.second).cut_index;
-            for(size_t i = 0; i <= ch.nodes[iter.first.second].dist_index; i++) {
-                distance_t dist = iter.second.first + b.distances()[i];
+static const char* phase_names[] = { "contract", "create_cut_index", "partition", "shortcuts", "create_sc_graph", "labels",
+    "GS_Dec", "GS_Inc", "GS_Dec_Par", "GS_Inc_Par", "DCL_Dec", "DCL_Inc", "DCL_Dec_Par", "DCL_Inc_Par", "DCL_Dec_Opt", "DCL_Inc_Opt", "contract_seq", "apply_updates", "rebuild_subtree", "batch_spc" };
+static const char* counter_names[] = { "queue_pushes", "queue_pops", "labels_touched", "updates", "queries", "hoplinks", "cache_hits", "cache_misses", "rebuilt_nodes" };
+static const char* histogram_names[] = { "query_latency", "update_latency" };
+static_assert(size(phase_names) == phase_count && size(counter_names) == counter_count && size(histogram_names) == histogram_count);
 
-                if(a.distances()[i] >= dist) {
-                    uint16_t path_count = iter.second.second * b.paths()[i];
-                    EnqueAndUpdate_d(ch, ci, iter.first.first, i, dist, path_count);
-                }
-            }
-        }
+// values get written by their owning thread (retired shard under lock), but read by all
+struct Shard
+{
+    atomic<uint64_t> phase_time[phase_count], phase_calls[phase_count], counters[counter_count];
+    atomic<uint64_t> histograms[histogram_count][histogram_buckets];
+
+    void reset()
+    {
+        for (atomic<uint64_t> &v : phase_time) v.store(0, memory_order_relaxed);
+        for (atomic<uint64_t> &v : phase_calls) v.store(0, memory_order_relaxed);
+        for (atomic<uint64_t> &v : counters) v.store(0, memory_order_relaxed);
+        for (auto &h : histograms)
+            for (atomic<uint64_t> &v : h) v.store(0, memory_order_relaxed);
     }
+};
 
-    // update distances involving descendants
-    while(!q.empty()) {
-        ICHSearchNode next = q.pop();
+static void add_to(atomic<uint64_t> &v, uint64_t x)
+{
+    v.fetch_add(x, memory_order_relaxed);
+}
 
-        uint16_t convex_path_count = 0;
-        FlatCutIndex cv = ci.get_contraction_label(next.v).cut_index;
-        // resetting the highest bit
-        cv.paths()[next.i] &= ~(1 << 15);
-        if(cv.distances()[next.i] == next.distance) {
-            convex_path_count = cv.paths()[next.i] - next.path_count;
-        } else if(cv.distances()[next.i] < next.distance) {
-            convex_path_count = cv.paths()[next.i];
-        } else
-            continue;
+// shards of running threads, plus sum of shards of terminated ones
+struct Registry
+{
+    mutex m_mutex;
+    vector<Shard*> shards;
+    Shard retired = {};
+};
 
-        // queue updates for descendants
-        for(NodeID u: ch.nodes[next.v].down_neighbors) {
-            Neighbor &x = UpNeighbor(ch, u, next.v);
-            distance_t dist = x.distance + cv.distances()[next.i];
+// never destroyed, as threads of static thread pools may terminate after static destruction
+static Registry& registry()
+{
+    static Registry *r = new Registry();
+    return *r;
+}
 
-            FlatCutIndex cu = ci.get_contraction_label(u).cut_index;
-            if(cu.distances()[next.i] >= dist) {
-                uint16_t path_count = x.path_count * convex_path_count;
-                EnqueAndUpdate_d(ch, ci, u, next.i, dist, path_count);
-            }
+// registers shard of current thread, and folds it into retired one on thread termination
+struct LocalShard
+{
+    Shard shard = {};
+    LocalShard()
+    {
+        Registry &r = registry();
+        lock_guard<mutex> lock(r.m_mutex);
+        r.shards.push_back(&shard);
+    }
+    ~LocalShard()
+    {
+        Registry &r = registry();
+        lock_guard<mutex> lock(r.m_mutex);
+        for (size_t i = 0; i < phase_count; i++)
+        {
+            add_to(r.retired.phase_time[i], shard.phase_time[i]);
+            add_to(r.retired.phase_calls[i], shard.phase_calls[i]);
         }
+        for (size_t i = 0; i < counter_count; i++)
+            add_to(r.retired.counters[i], shard.counters[i]);
+        for (size_t h = 0; h < histogram_count; h++)
+            for (size_t b = 0; b < histogram_buckets; b++)
+                add_to(r.retired.histograms[h][b], shard.histograms[h][b]);
+        erase(r.shards, &shard);
     }
-}
+};
 
-void Graph::DCL_Inc_Opt(ContractionHierarchy &ch, ContractionIndex &ci, std::vector<std::pair<std::pair<distance_t, distance_t>, std::pair<NodeID, NodeID> > >& updates) {
+static Shard& local_shard()
+{
+    thread_local static LocalShard local;
+    return local.shard;
+}
 
-    vector<pair<edge_t, edata_t> > C;
-    GS_Inc(ch, updates, C);
+// sum of field selected by f over all shards
+template<typename F>
+static uint64_t sum_shards(F f)
+{
+    Registry &r = registry();
+    lock_guard<mutex> lock(r.m_mutex);
+    uint64_t total = f(r.retired).load(memory_order_relaxed);
+    for (Shard *shard : r.shards)
+        total += f(*shard).load(memory_order_relaxed);
+    return total;
+}
 
-    //update distances involving ancestors
-    for(pair<edge_t, edata_t> iter: C) {
-        FlatCutIndex a = ci.get_contraction_label(iter.first.first).cut_index;
-        if(iter.second.first == a.distances()[ch.nodes[iter.first.second].dist_index]) {
+void add_time(Phase phase, uint64_t nanoseconds)
+{
+    Shard &shard = local_shard();
+    add_to(shard.phase_time[static_cast<size_t>(phase)], nanoseconds);
+    add_to(shard.phase_calls[static_cast<size_t>(phase)], 1);
+}
 
-            FlatCutIndex b = ci.get_contraction_label(iter.first.second).cut_index;
-            for(size_t i = 0; i <= ch.nodes[iter.first.second].dist_index; i++) {
-                distance_t dist = iter.second.first + b.distances()[i];
+void add(Counter counter, uint64_t value)
+{
+    add_to(local_shard().counters[static_cast<size_t>(counter)], value);
+}
 
-                if(dist == a.distances()[i]) {
-                    uint16_t path_count = iter.second.second * b.paths()[i];
-                    EnqueAndUpdate_i(ch, ci, iter.first.first, i, path_count);
-                }
-            }
-        }
-    }
+void record(Histogram histogram, uint64_t nanoseconds)
+{
+    add_to(local_shard().histograms[static_cast<size_t>(histogram)][bit_width(nanoseconds)], 1);
+}
 
-    // update distances involving descendants
-    while(!q.empty()) {
-        ICHSearchNode next = q.pop();
+uint64_t get(Counter counter)
+{
+    return sum_shards([counter](Shard &s) -> atomic<uint64_t>& { return s.counters[static_cast<size_t>(counter)]; });
+}
 
-        FlatCutIndex cv = ci.get_contraction_label(next.v).cut_index;
-        // resetting the highest bit
-        cv.paths()[next.i] &= ~(1 << 15);
-        uint16_t convex_path_count = next.path_count - cv.paths()[next.i];
+uint64_t get(Phase phase)
+{
+    return sum_shards([phase](Shard &s) -> atomic<uint64_t>& { return s.phase_time[static_cast<size_t>(phase)]; });
+}
 
-        // update descendants
-        for(NodeID u: ch.nodes[next.v].down_neighbors) {
-            Neighbor &x = UpNeighbor(ch, u, next.v);
-            FlatCutIndex cu = ci.get_contraction_label(u).cut_index;
-            distance_t dist = x.distance + cv.distances()[next.i];
+void reset()
+{
+    Registry &r = registry();
+    lock_guard<mutex> lock(r.m_mutex);
+    r.retired.reset();
+    for (Shard *shard : r.shards)
+        shard->reset();
+}
 
-            if(dist == cu.distances()[next.i]) {
-                uint16_t path_count = x.path_count * convex_path_count;
-                EnqueAndUpdate_i(ch, ci, u, next.i, path_count);
-            }
-        }
+// largest value falling into histogram bucket
+static uint64_t bucket_limit(size_t bucket)
+{
+    return bucket == 0 ? 0 : bucket == 64 ? UINT64_MAX : ((uint64_t)1 << bucket) - 1;
+}
 
-        if(cv.paths()[next.i] == 0) {
-            cv.distances()[next.i] = infinity;
-            for(Neighbor &w: ch.nodes[next.v].up_neighbors) {
-                if(ch.nodes[w.node].dist_index >= next.i) {
-                    Neighbor &x = UpNeighbor(ch, next.v, w.node);
-                    FlatCutIndex cw = ci.get_contraction_label(w.node).cut_index;
-                    distance_t dist = x.distance + cw.distances()[next.i];
-                    uint16_t path_count = x.path_count * cw.paths()[next.i];
-
-                    if(dist < cv.distances()[next.i]) {
-                        cv.distances()[next.i] = dist;
-                        cv.paths()[next.i] = path_count;
-                    } else if(dist == cv.distances()[next.i]) {
-                        cv.paths()[next.i] = cv.paths()[next.i] + path_count;
-                    }
-                }
+void write_json(ostream &os)
+{
+    os << "{\"phases\":{";
+    for (size_t i = 0; i < phase_count; i++)
+    {
+        uint64_t time = sum_shards([i](Shard &s) -> atomic<uint64_t>& { return s.phase_time[i]; });
+        uint64_t calls = sum_shards([i](Shard &s) -> atomic<uint64_t>& { return s.phase_calls[i]; });
+        os << (i ? "," : "") << "\"" << phase_names[i] << "\":{\"seconds\":" << time / 1e9 << ",\"calls\":" << calls << "}";
+    }
+    os << "},\"counters\":{";
+    for (size_t i = 0; i < counter_count; i++)
+        os << (i ? "," : "") << "\"" << counter_names[i] << "\":" << sum_shards([i](Shard &s) -> atomic<uint64_t>& { return s.counters[i]; });
+    os << "},\"histograms\":{";
+    for (size_t h = 0; h < histogram_count; h++)
+    {
+        vector<uint64_t> counts(histogram_buckets);
+        uint64_t total = 0;
+        for (size_t b = 0; b < histogram_buckets; b++)
+            total += counts[b] = sum_shards([h, b](Shard &s) -> atomic<uint64_t>& { return s.histograms[h][b]; });
+        // percentiles are reported as upper limit of bucket containing them
+        auto percentile = [&counts, total](double p) {
+            uint64_t rank = ceil(p * total), seen = 0;
+            for (size_t b = 0; b < histogram_buckets; b++)
+                if ((seen += counts[b]) >= rank && seen > 0)
+                    return bucket_limit(b);
+            return (uint64_t)0;
+        };
+        os << (h ? "," : "") << "\"" << histogram_names[h] << "\":{\"count\":" << total << ",\"p50_ns\":" << percentile(0.5)
+            << ",\"p90_ns\":" << percentile(0.9) << ",\"p99_ns\":" << percentile(0.99) << ",\"buckets\":[";
+        bool first = true;
+        for (size_t b = 0; b < histogram_buckets; b++)
+            if (counts[b] > 0)
+            {
+                os << (first ? "" : ",") << "{\"le_ns\":" << bucket_limit(b) << ",\"count\":" << counts[b] << "}";
+                first = false;
             }
-        }
+        os << "]}";
     }
+    os << "}}";
 }
 
-void Graph::contract_seq(ContractionIndex &ci, vector<pair<pair<distance_t,distance_t>, NodeID> >& contracted_updates) {
+PhaseTimer::PhaseTimer(Phase phase) : phase(phase), start(chrono::steady_clock::now())
+{
+}
 
-    // we start searches in order of original distance and cancel searches for nodes already updated
-    sort(contracted_updates.begin(), contracted_updates.end());
-    // search from each update using DFS
-    vector<SearchNode> stack;
-    for (auto& it: contracted_updates) {
-        // if already processed, distance offset has (probably) changed
-        if (it.first.first != ci.get_contraction_label(it.second).distance_offset)
-            continue;
-        stack.push_back(SearchNode(it.first.second, it.second));
-        while (!stack.empty()) {
-            SearchNode next = stack.back(); stack.pop_back();
+PhaseTimer::~PhaseTimer()
+{
+    add_time(phase, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+}
 
-            // update label
-            ci.update_distance_offset(next.node, next.distance);
-            // enqueue neighbors
-            for (Neighbor n : node_data[next.node].neighbors) {
-                if (ci.get_contraction_label(n.node).parent == next.node)
-                    stack.push_back(SearchNode(next.distance + n.distance, n.node));
-            }
-        }
-    }
+Tally::~Tally()
+{
+    Shard &shard = local_shard();
+    for (size_t i = 0; i < counter_count; i++)
+        if (values[i])
+            add_to(shard.counters[i], values[i]);
 }
 
+} // metrics
+
 //--------------------------- Graph debug ---------------------------
 
 bool Graph::is_consistent() const
@@ -3547,16 +6940,16 @@ bool Graph::is_undirected() const
 vector<pair<distance_t,distance_t>> Graph::distances() const
 {
     vector<pair<distance_t,distance_t>> d;
-    for (const Node &n : node_data)
-        d.push_back(pair(n.distance, n.outcopy_distance));
+    for (NodeID node = 0; node < node_data.size(); node++)
+        d.push_back(pair(node_data[node].distance, node_data[node].outcopy_distance));
     return d;
 }
 
 vector<pair<NodeID,NodeID>> Graph::flow() const
 {
     vector<pair<NodeID,NodeID>> f;
-    for (const Node &n : node_data)
-        f.push_back(pair(n.inflow, n.outflow));
+    for (NodeID node = 0; node < node_data.size(); node++)
+        f.push_back(pair(node_data[node].inflow, node_data[node].outflow));
     return f;
 }
 
@@ -3624,6 +7017,25 @@ void Graph::randomize()
         shuffle(node_data[node].neighbors.begin(), node_data[node].neighbors.end(), default_random_engine());
 }
 
+void Graph::renumber(const vector<NodeID> &new_id)
+{
+    size_t node_count = super_node_count();
+    assert(new_id.size() == node_count + 1);
+    vector<vector<Neighbor>> neighbors(node_count + 1);
+    for (NodeID node = 1; node <= node_count; node++)
+    {
+        vector<Neighbor> &renamed = neighbors[new_id[node]];
+        renamed.swap(node_data[node].neighbors);
+        for (Neighbor &n : renamed)
+            n.node = new_id[n.node];
+    }
+    for (NodeID node = 1; node <= node_count; node++)
+        node_data[node].neighbors.swap(neighbors[node]);
+    for (NodeID node = 1; node <= node_count; node++)
+        node_data[node].subgraph_id = NO_SUBGRAPH;
+    reset();
+}
+
 void print_graph(const Graph &g, ostream &os)
 {
     vector<Edge> edges;
@@ -3659,6 +7071,337 @@ void read_graph(Graph &g, istream &in)
     g.remove_isolated();
 }
 
+// binary graph files store node count followed by neighbor offsets, neighbors and distances (CSR format)
+static const uint64_t graph_magic = 0x48504152474e4400ull;
+static const uint32_t graph_version = 1;
+
+void Graph::write_binary(ostream &os) const
+{
+    // nodes 0 to node_count inclusive, excluding s & t
+    size_t node_count = super_node_count();
+    vector<uint64_t> offsets(node_count + 2, 0);
+    for (NodeID v = 0; v <= node_count; v++)
+        offsets[v + 1] = offsets[v] + node_data[v].neighbors.size();
+    vector<NodeID> neighbors;
+    vector<distance_t> distances;
+    neighbors.reserve(offsets.back());
+    distances.reserve(offsets.back());
+    for (NodeID v = 0; v <= node_count; v++)
+        for (const Neighbor &n : node_data[v].neighbors)
+        {
+            neighbors.push_back(n.node);
+            distances.push_back(n.distance);
+        }
+    os.write((char*)&graph_magic, sizeof(uint64_t));
+    os.write((char*)&graph_version, sizeof(uint32_t));
+    os.write((char*)&node_count, sizeof(size_t));
+    os.write((char*)offsets.data(), offsets.size() * sizeof(uint64_t));
+    os.write((char*)neighbors.data(), neighbors.size() * sizeof(NodeID));
+    os.write((char*)distances.data(), distances.size() * sizeof(distance_t));
+}
+
+bool Graph::read_binary(istream &is)
+{
+    uint64_t magic = 0;
+    uint32_t version = 0;
+    size_t node_count = 0;
+    is.read((char*)&magic, sizeof(uint64_t));
+    is.read((char*)&version, sizeof(uint32_t));
+    is.read((char*)&node_count, sizeof(size_t));
+    if (!is || magic != graph_magic || version != graph_version)
+        return false;
+    vector<uint64_t> offsets(node_count + 2);
+    is.read((char*)offsets.data(), offsets.size() * sizeof(uint64_t));
+    if (!is)
+        return false;
+    vector<NodeID> neighbors(offsets.back());
+    vector<distance_t> distances(offsets.back());
+    is.read((char*)neighbors.data(), neighbors.size() * sizeof(NodeID));
+    is.read((char*)distances.data(), distances.size() * sizeof(distance_t));
+    if (!is)
+        return false;
+    resize(node_count);
+    for (NodeID v = 0; v <= node_count; v++)
+    {
+        node_data[v].neighbors.reserve(offsets[v + 1] - offsets[v]);
+        for (size_t i = offsets[v]; i < offsets[v + 1]; i++)
+            node_data[v].neighbors.push_back(Neighbor(neighbors[i], distances[i]));
+    }
+    return true;
+}
+
+// DIMACS arcs and node count ('p' line) found within part of file
+struct DimacsChunk
+{
+    vector<Edge> arcs;
+    size_t node_count = 0;
+};
+
+static const char* parse_uint(const char *p, const char *end, uint32_t &value)
+{
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    value = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+        value = value * 10 + (*p++ - '0');
+    return p;
+}
+
+// parse lines starting within [begin, end)
+static void parse_dimacs(const char *begin, const char *end, const char *file_end, DimacsChunk &chunk)
+{
+    const char *p = begin;
+    while (p < end)
+    {
+        const char *line_end = static_cast<const char*>(memchr(p, '\n', file_end - p));
+        if (line_end == nullptr)
+            line_end = file_end;
+        while (p < line_end && (*p == ' ' || *p == '\t'))
+            p++;
+        if (p < line_end && *p == 'a')
+        {
+            uint32_t v, w, d;
+            p = parse_uint(parse_uint(parse_uint(p + 1, line_end, v), line_end, w), line_end, d);
+            chunk.arcs.push_back(Edge(v, w, d));
+        }
+        else if (p < line_end && *p == 'p')
+        {
+            // skip problem type
+            p++;
+            while (p < line_end && (*p == ' ' || *p == '\t'))
+                p++;
+            while (p < line_end && *p != ' ' && *p != '\t')
+                p++;
+            uint32_t v;
+            parse_uint(p, line_end, v);
+            chunk.node_count = v;
+        }
+        p = line_end + 1;
+    }
+}
+
+static bool is_newer(const string &a, const string &b)
+{
+    struct stat sa, sb;
+    if (stat(a.c_str(), &sa) != 0 || stat(b.c_str(), &sb) != 0)
+        return false;
+    return sa.st_mtim.tv_sec > sb.st_mtim.tv_sec || (sa.st_mtim.tv_sec == sb.st_mtim.tv_sec && sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec);
+}
+
+void read_graph(Graph &g, const string &filename, bool use_cache)
+{
+    string cache_name = filename + ".bin";
+    if (use_cache && is_newer(cache_name, filename))
+    {
+        ifstream cache(cache_name, ios::binary);
+        if (g.read_binary(cache))
+        {
+            g.remove_isolated();
+            return;
+        }
+        cerr << "ignoring invalid graph cache " << cache_name << endl;
+    }
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        cerr << "cannot open " << filename << endl;
+        exit(EXIT_FAILURE);
+    }
+    size_t file_size = st.st_size;
+    const char *data = file_size == 0 ? nullptr : static_cast<const char*>(mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0));
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        // not mappable (e.g. a pipe)
+        ifstream ifs(filename);
+        read_graph(g, ifs);
+        return;
+    }
+
+    // split file into chunks at line boundaries; each chunk handles lines starting within it
+    size_t chunk_count = file_size / (1 << 20) + 1;
+    vector<DimacsChunk> chunks(chunk_count);
+    vector<const char*> bounds(chunk_count + 1);
+    for (size_t i = 0; i <= chunk_count; i++)
+    {
+        size_t offset = file_size / chunk_count * i;
+        if (i == chunk_count)
+            offset = file_size;
+        else if (i > 0)
+        {
+            const char *line_end = static_cast<const char*>(memchr(data + offset - 1, '\n', file_size - offset + 1));
+            offset = line_end == nullptr ? file_size : line_end + 1 - data;
+        }
+        bounds[i] = data + offset;
+    }
+    util::ThreadPool::TaskGroup group;
+    for (size_t i = 0; i < chunk_count; i++)
+        thread_pool().run(group, [&chunks, &bounds, data, file_size, i] { parse_dimacs(bounds[i], max(bounds[i], bounds[i + 1]), data + file_size, chunks[i]); });
+    thread_pool().wait(group);
+    if (data != nullptr)
+        munmap(const_cast<char*>(data), file_size);
+
+    size_t node_count = 0, arc_count = 0;
+    for (const DimacsChunk &chunk : chunks)
+    {
+        node_count = max(node_count, chunk.node_count);
+        arc_count += chunk.arcs.size();
+    }
+    vector<Edge> arcs;
+    arcs.reserve(arc_count);
+    for (DimacsChunk &chunk : chunks)
+    {
+        arcs.insert(arcs.end(), chunk.arcs.begin(), chunk.arcs.end());
+        vector<Edge>().swap(chunk.arcs);
+    }
+    g.resize(node_count);
+    g.add_edges(arcs);
+
+    if (use_cache)
+    {
+        ofstream cache(cache_name, ios::binary);
+        if (cache)
+            g.write_binary(cache);
+    }
+    g.remove_isolated();
+}
+
+vector<NodeID> partition_order(const vector<CutIndex> &ci, const vector<Neighbor> &closest)
+{
+    assert(ci.size() == closest.size());
+    // contracted nodes are ordered after their root, by distance to it
+    const uint64_t no_labels = UINT64_MAX;
+    vector<tuple<uint64_t, distance_t, NodeID>> order;
+    for (NodeID node = 1; node < ci.size(); node++)
+    {
+        NodeID root = node;
+        distance_t distance = 0;
+        while (closest[root].node != NO_NODE && closest[root].node != root)
+        {
+            distance += closest[root].distance;
+            root = closest[root].node;
+        }
+        uint64_t key = closest[root].node == NO_NODE || ci[root].empty() ? no_labels : partition_tree_key(ci[root]);
+        order.push_back(make_tuple(key, distance, node));
+    }
+    sort(order.begin(), order.end());
+    vector<NodeID> new_id(ci.size(), 0);
+    for (size_t i = 0; i < order.size(); i++)
+        new_id[get<2>(order[i])] = i + 1;
+    return new_id;
+}
+
+void renumber(vector<CutIndex> &ci, vector<Neighbor> &closest, const vector<NodeID> &new_id)
+{
+    assert(ci.size() == new_id.size() && closest.size() == new_id.size());
+    vector<NodeID> old_id(new_id.size(), 0);
+    for (NodeID node = 1; node < new_id.size(); node++)
+        old_id[new_id[node]] = node;
+    // move construction keeps the arena allocator of label vectors, unlike move assignment into another vector
+    vector<CutIndex> renamed_ci;
+    renamed_ci.reserve(ci.size());
+    vector<Neighbor> renamed_closest;
+    renamed_closest.reserve(closest.size());
+    for (NodeID node = 0; node < old_id.size(); node++)
+    {
+        renamed_ci.push_back(std::move(ci[old_id[node]]));
+        Neighbor n = closest[old_id[node]];
+        if (n.node != NO_NODE)
+            n.node = new_id[n.node];
+        renamed_closest.push_back(n);
+    }
+    ci.swap(renamed_ci);
+    closest.swap(renamed_closest);
+}
+
+// renumbering files consist of a header with node count, followed by the new ID of each node (including unused node 0)
+static const uint64_t renumbering_magic = 0x4d554e4552444e00ull;
+
+void write_renumbering(ostream &os, const vector<NodeID> &new_id)
+{
+    FileHeader::current(renumbering_magic).write(os, new_id.size() - 1);
+    os.write((char*)new_id.data(), new_id.size() * sizeof(NodeID));
+}
+
+vector<NodeID> read_renumbering(const string &filename)
+{
+    ifstream is(filename);
+    if (!is)
+        return {};
+    FileHeader header(renumbering_magic);
+    size_t node_count = header.read(is);
+    vector<NodeID> new_id(node_count + 1);
+    is.read((char*)new_id.data(), new_id.size() * sizeof(NodeID));
+    if (header.version == 0 || !is)
+    {
+        cerr << "cannot read renumbering from " << filename << endl;
+        exit(EXIT_FAILURE);
+    }
+    return new_id;
+}
+
+//--------------------------- Sharding ------------------------------
+
+// shard map files consist of a header with node count, followed by the number of shard bits and the shard of each node
+// (including unused node 0)
+static const uint64_t shard_map_magic = 0x5344524148534e00ull;
+
+ShardMap::ShardMap() : bits(0)
+{
+}
+
+ShardMap::ShardMap(const ContractionIndex &ci, uint16_t bits) : bits(bits), shards(ci.labels.size(), ALL_SHARDS)
+{
+    if (bits >= 16)
+    {
+        cerr << "cannot split index into 2^" << bits << " shards" << endl;
+        exit(EXIT_FAILURE);
+    }
+    // contracted nodes share the label block, and thus the shard, of their root
+    for (NodeID node = 1; node < ci.labels.size(); node++)
+    {
+        FlatCutIndex fci = ci.labels[node].cut_index;
+        if (!fci.empty() && fci.cut_level() >= bits)
+            shards[node] = fci.partition() & ((1u << bits) - 1);
+    }
+}
+
+size_t ShardMap::shard_count() const
+{
+    return (size_t)1 << bits;
+}
+
+uint16_t ShardMap::operator[](NodeID v) const
+{
+    return shards[v];
+}
+
+void ShardMap::write(ostream &os) const
+{
+    FileHeader::current(shard_map_magic).write(os, shards.size() - 1);
+    os.write((char*)&bits, sizeof(uint16_t));
+    os.write((char*)shards.data(), shards.size() * sizeof(uint16_t));
+}
+
+ShardMap ShardMap::read(const string &filename)
+{
+    ifstream is(filename);
+    FileHeader header(shard_map_magic);
+    size_t node_count = is ? header.read(is) : 0;
+    ShardMap map;
+    is.read((char*)&map.bits, sizeof(uint16_t));
+    map.shards.resize(node_count + 1);
+    is.read((char*)map.shards.data(), map.shards.size() * sizeof(uint16_t));
+    if (header.version == 0 || !is)
+    {
+        cerr << "cannot read shard map from " << filename << endl;
+        exit(EXIT_FAILURE);
+    }
+    return map;
+}
+
 //--------------------------- ostream -------------------------------
 
 // for easy distance printing
@@ -3705,7 +7448,9 @@ ostream& operator<<(ostream& os, const FlatCutIndex &ci)
 {
     uint64_t partition_bitvector = *ci.partition_bitvector();
     vector<uint16_t> dist_index(ci.dist_index(), ci.dist_index() + ci.cut_level() + 1);
-    vector<distance_t> distances(ci.distances(), ci.distances() + ci.label_count());
+    vector<distance_t> distances;
+    for (size_t i = 0; i < ci.label_count(); i++)
+        distances.push_back(ci.distance_at(i));
     return os << "FCI(pb=" << BitString(partition_bitvector) << ",di=" << dist_index << ",d=" << distances << ")";
 }
 
@@ -3727,6 +7472,14 @@ ostream& operator<<(ostream& os, const Node &n)
     return os << "N(" << n.subgraph_id << "#" << n.neighbors << ")";
 }
 
+ostream& operator<<(ostream& os, const MultiThreadNodeData &nd)
+{
+    vector<Node> nodes;
+    for (size_t pos = 0; pos < nd.size(); pos++)
+        nodes.push_back(nd.node(pos));
+    return os << nodes;
+}
+
 ostream& operator<<(ostream& os, const Partition &p)
 {
     return os << "P(" << p.left << "|" << p.cut << "|" << p.right << ")";
@@ -1,7 +1,6 @@
 #pragma once
 
 //#define NDEBUG
-#define NPROFILE
 #define CHECK_CONSISTENT //assert(is_consistent())
 // algorithm config
 #define NO_SHORTCUTS // turns off shortcut computation, resulting in smaller indexes but slower local queries
@@ -10,9 +9,17 @@
 // use multi-threading for index construction
 #define MULTI_THREAD 32 // determines threshold for multi-threading
 #ifdef MULTI_THREAD
-    #define MULTI_THREAD_DISTANCES 4 // number of parallel threads for label & shortcut computation
+    #define MULTI_THREAD_DISTANCES 4 // number of distances computed in parallel per subgraph; also thread count for shortcut computation & parallel maintenance
 #endif
 
+// storage layout of distance & path count labels
+//#define LABEL_TILE 16 // store labels in tiles of given size (distances followed by path counts), rather than two separate arrays
+// representation of shortest-path counts
+#ifndef PATH_COUNT_BITS
+    #define PATH_COUNT_BITS 16 // width of path counts (16, 32 or 64); counts wrap around on overflow
+#endif
+//#define SATURATING_PATHS // counts saturate at their maximum value rather than wrapping around
+
 #include <cstdint>
 #include <climits>
 #include <vector>
@@ -22,23 +29,83 @@
 #include <unordered_map>
 #include <condition_variable>
 #include <mutex>
+#include <thread>
+#include <chrono>
+#include <memory>
 #include <queue>
 #include <map>
 #include <set>
 #include <fstream>
+#include <limits>
+#include <span>
+#include <array>
+#include <memory_resource>
 
 namespace road_network {
 
+// unsigned integer whose arithmetic saturates at its maximum value, which then is sticky under subtraction;
+// conversion to the underlying type must be explicit, so that accidental wrapping arithmetic does not compile
+template<typename T>
+struct saturating
+{
+    T value;
+
+    saturating() = default;
+    constexpr saturating(T value) : value(value) {}
+    constexpr explicit operator T() const { return value; }
+    static constexpr T max() { return std::numeric_limits<T>::max(); }
+    bool saturated() const { return value == max(); }
+
+    friend saturating operator+(saturating a, saturating b) { T r; return __builtin_add_overflow(a.value, b.value, &r) ? max() : r; }
+    friend saturating operator*(saturating a, saturating b) { T r; return __builtin_mul_overflow(a.value, b.value, &r) ? max() : r; }
+    friend saturating operator-(saturating a, saturating b) { return a.saturated() ? a : saturating(a.value - b.value); }
+    friend saturating operator|(saturating a, saturating b) { return a.value | b.value; }
+    friend saturating operator&(saturating a, saturating b) { return a.value & b.value; }
+    friend saturating operator~(saturating a) { return (T)~a.value; }
+    saturating& operator+=(saturating other) { return *this = *this + other; }
+    saturating& operator-=(saturating other) { return *this = *this - other; }
+    saturating& operator*=(saturating other) { return *this = *this * other; }
+    saturating& operator|=(saturating other) { return *this = *this | other; }
+    saturating& operator&=(saturating other) { return *this = *this & other; }
+    friend bool operator==(saturating a, saturating b) { return a.value == b.value; }
+    friend bool operator!=(saturating a, saturating b) { return a.value != b.value; }
+    friend bool operator<(saturating a, saturating b) { return a.value < b.value; }
+    friend bool operator>(saturating a, saturating b) { return a.value > b.value; }
+    friend bool operator<=(saturating a, saturating b) { return a.value <= b.value; }
+    friend bool operator>=(saturating a, saturating b) { return a.value >= b.value; }
+    friend std::ostream& operator<<(std::ostream& os, saturating s) { return os << (uint64_t)s.value; }
+};
+
+#if PATH_COUNT_BITS == 16
+typedef uint16_t path_base_t;
+#elif PATH_COUNT_BITS == 32
+typedef uint32_t path_base_t;
+#elif PATH_COUNT_BITS == 64
+typedef uint64_t path_base_t;
+#else
+#error "PATH_COUNT_BITS must be 16, 32 or 64"
+#endif
+#ifdef SATURATING_PATHS
+typedef saturating<path_base_t> path_t;
+#else
+typedef path_base_t path_t;
+#endif
+
 typedef uint32_t NodeID;
 typedef uint32_t SubgraphID;
 typedef uint32_t distance_t;
 typedef std::pair<NodeID, NodeID> edge_t;
-typedef std::pair<distance_t, uint16_t> edata_t;
+typedef std::pair<distance_t, path_t> edata_t;
 
 const distance_t infinity = UINT32_MAX >> 1;
+// highest bit of path counts, used by optimized maintenance to flag labels whose original values have been saved
+const path_t PATH_FLAG = (path_base_t)1 << (PATH_COUNT_BITS - 1);
 
 struct Neighbor;
+struct Edge;
 class Graph;
+class ContractionHierarchy;
+struct ShardMap;
 
 //--------------------------- CutIndex ------------------------------
 
@@ -46,9 +113,10 @@ struct CutIndex
 {
     uint64_t partition; // partition at level k is stored in k-lowest bit
     uint8_t cut_level; // level in the partition tree where vertex becomes cut-vertex (0=root, up to 58)
-    std::vector<uint16_t> dist_index; // sum of cut-sizes up to level k (indices into distances)
-    std::vector<distance_t> distances; // distance to cut vertices of all levels, up to (excluding) the point where vertex becomes cut vertex
-    std::vector<uint16_t> paths; // shortest-paths count to cut vertics of all levels
+    // label vectors are bump-allocated from a shared arena during index construction
+    std::pmr::vector<uint16_t> dist_index; // sum of cut-sizes up to level k (indices into distances)
+    std::pmr::vector<distance_t> distances; // distance to cut vertices of all levels, up to (excluding) the point where vertex becomes cut vertex
+    std::pmr::vector<path_t> paths; // shortest-paths count to cut vertics of all levels
 #ifdef PRUNING
     // track number of labels that could be or are pruned
     size_t pruning_2hop, pruning_3hop, pruning_tail;
@@ -82,21 +150,30 @@ namespace PBV
 class FlatCutIndex
 {
     char* data; // stores partition bitvector, dist_index and distances
+    // start of distance & path count labels
+    char* labels() const;
+    // copy index data with labels stored using given tile size (0 = separate arrays) to target, converting labels
+    // into layout of this build; target must provide size() bytes
+    void convert_layout(size_t from_tile, char *target) const;
 public:
     FlatCutIndex();
-    FlatCutIndex(const CutIndex &ci);
+    // copy cut index into data, which must provide size(ci) bytes of zeroed memory
+    FlatCutIndex(const CutIndex &ci, char *data);
+    // number of bytes required for index data of cut index
+    static size_t size(const CutIndex &ci);
 
     bool operator==(FlatCutIndex other) const;
 
-    // return pointers to partition bitvector, dist_index and distances array
+    // return pointers to partition bitvector and dist_index array
     uint64_t* partition_bitvector();
     const uint64_t* partition_bitvector() const;
     uint16_t* dist_index();
     const uint16_t* dist_index() const;
-    distance_t* distances();
-    const distance_t* distances() const;
-    uint16_t* paths();
-    const uint16_t* paths() const;
+    // access distance and path count label by index; labels are contiguous in memory within groups of LABEL_TILE
+    distance_t& distance_at(size_t i);
+    const distance_t& distance_at(size_t i) const;
+    path_t& paths_at(size_t i);
+    const path_t& paths_at(size_t i) const;
     // split partition_bitvector into components
     uint64_t partition() const;
     uint16_t cut_level() const;
@@ -112,17 +189,9 @@ public:
     // returns whether index data has been allocated
     bool empty() const;
 
-    // start of distance labels for given cut level
-    const distance_t* cl_begin(size_t cl) const;
-    // end of distance labels for given cut level
-    const distance_t* cl_end(size_t cl) const;
-
-    const uint16_t* pl_begin(size_t cl) const;
-    const uint16_t* pl_end(size_t cl) const;
-
     // returns labels in list-of-list format
     std::vector<std::vector<distance_t> > unflatten() const;
-    std::vector<std::vector<std::pair<distance_t, uint16_t> > > unflatten_spc() const;
+    std::vector<std::vector<std::pair<distance_t, path_t> > > unflatten_spc() const;
 
     friend class ContractionIndex;
 };
@@ -145,27 +214,101 @@ std::ostream& operator<<(std::ostream& os, const ContractionLabel &ci);
 class ContractionIndex
 {
     std::vector<ContractionLabel> labels;
+    // single block holding all label data, except for blocks copied on write or read from legacy files
+    char* label_data = nullptr;
+    size_t label_data_size = 0;
+    bool label_data_mapped = false;
+    // read label data following file header, in the format given by version
+    void read_labels(std::istream& is, size_t node_count, uint32_t version, uint32_t from_tile);
+    // point labels into data block, using offset table of contiguous format
+    void assign_labels(const char* table, char* data, size_t node_count);
+    // flatten labels of core nodes (non-empty cut indexes) into label_data, in partition tree order
+    void flatten_labels(std::vector<CutIndex> &ci);
+
+    // copy-on-write versioning used by UpdatePipeline: while another version of the index shares label blocks with
+    // this one, blocks are copied before their first modification, so the other version remains unchanged
+    bool owns_blocks = true; // shared copies don't release blocks on destruction
+    bool copy_on_write = false;
+    std::vector<uint8_t> block_copied; // per node, accessed atomically
+    std::vector<NodeID> changed_nodes; // nodes whose label changed since last catch_up
+    std::mutex copy_mutex;
+    // nodes contracted into each root, in CSR format
+    std::vector<size_t> tree_offsets;
+    std::vector<NodeID> tree_nodes;
+    // shallow copy sharing label blocks of other index, which retains ownership
+    explicit ContractionIndex(const ContractionIndex *other);
+    // whether block was allocated individually rather than within label_data
+    bool owns_block(const char* data) const;
+    void index_trees();
+    // make labels match source index, which must have evolved from the same state, releasing replaced blocks and
+    // invalidating cached results computed from them
+    void catch_up(ContractionIndex &source);
 
     static distance_t get_cut_level_distance(FlatCutIndex a, FlatCutIndex b, size_t cut_level);
     static distance_t get_distance(FlatCutIndex a, FlatCutIndex b);
-    static uint16_t get_paths(FlatCutIndex a, FlatCutIndex b);
+    static path_t get_paths(FlatCutIndex a, FlatCutIndex b);
+    // also computes distance between a and b
+    static path_t get_paths(FlatCutIndex a, FlatCutIndex b, distance_t &distance);
     static size_t get_cut_level_hoplinks(FlatCutIndex a, FlatCutIndex b, size_t cut_level);
     static size_t get_hoplinks(FlatCutIndex a, FlatCutIndex b);
+
+    // compressed labels store deltas to a per-cut-level base and path counts using the smallest sufficient byte
+    // width; partition bitvector and dist_index keep their position, so only label access needs to be decoded
+    bool compressed = false;
+    static size_t compressed_size(FlatCutIndex ci);
+    static void compress_labels(FlatCutIndex ci, char *target);
+    // decode labels of compressed blocks a and b needed for a query between them into thread-local scratch blocks
+    static void decompress_labels(FlatCutIndex &a, FlatCutIndex &b);
+
+    // delta checkpoints: while tracking changes, label blocks and distance offsets are saved before their first
+    // modification, so write_delta only needs to store label slots and offsets that differ from their saved values
+    bool tracking = false;
+    std::vector<uint8_t> block_saved; // per node, accessed atomically
+    std::vector<std::pair<NodeID, char*>> saved_blocks;
+    std::vector<uint8_t> offset_saved;
+    std::vector<std::pair<NodeID, distance_t>> saved_offsets;
+    void save_block(NodeID v);
+    // release saved values, starting a new checkpoint
+    void clear_saved();
+    bool apply_delta(std::istream& is, ContractionHierarchy *ch, Graph *g, std::vector<Edge> *weights_out);
+
+    // optional cache of query results between label-owning nodes
+    struct ResultCache;
+    std::unique_ptr<ResultCache> cache;
+    // distance between labels (excluding distance offsets) and path count between v and w, whose labels are a and b
+    edata_t cached_query(NodeID v, NodeID w, FlatCutIndex a, FlatCutIndex b) const;
+    // write index, with label data only for label-owning nodes accepted by keep
+    template<typename F>
+    void write(std::ostream& os, F keep) const;
 public:
     // populate from ci and closest, draining ci in the process
     ContractionIndex(std::vector<CutIndex> &ci, std::vector<Neighbor> &closest);
     // populate from binary source
     ContractionIndex(std::istream& is);
+    // populate from binary file; files in contiguous format are memory-mapped (copy-on-write) rather than read
+    explicit ContractionIndex(const std::string& filename);
     // wrapper when not contracting
     explicit ContractionIndex(std::vector<CutIndex> &ci);
     ~ContractionIndex();
 
     // compute distance between v and w
     distance_t get_distance(NodeID v, NodeID w) const;
-    // compute distance between v and w
-    uint16_t get_spc(NodeID v, NodeID w) const;
-    // verify correctness of distance computed via index for a particular query
+    // compute number of shortest paths between v and w
+    path_t get_spc(NodeID v, NodeID w) const;
+    // compute distance and number of shortest paths between v and w in a single label scan
+    edata_t get_distance_spc(NodeID v, NodeID w) const;
+    // answer batch of path count (and optionally distance) queries using given number of pool tasks (at most
+    // Graph::set_thread_count threads run them); queries are processed grouped by source node, so the source labels stay in cache
+    void batch_spc(std::span<const std::pair<NodeID,NodeID>> queries, std::span<path_t> paths, size_t threads = 1, std::span<distance_t> distances = {}) const;
+    // compute table of path counts (and optionally distances) from all sources to all targets, stored row by row
+    void spc_table(std::span<const NodeID> sources, std::span<const NodeID> targets, std::span<path_t> paths, size_t threads = 1, std::span<distance_t> distances = {}) const;
+    void spc_table(NodeID source, std::span<const NodeID> targets, std::span<path_t> paths, std::span<distance_t> distances = {}) const;
+    // verify correctness of distance and path count computed via index for a particular query
     bool check_query(std::pair<NodeID,NodeID> query, Graph &g) const;
+    // switch between SIMD kernels (chosen at runtime based on CPU support) and scalar reference kernels for label scans
+    static void use_simd(bool state);
+    // name of kernel currently used for label scans
+    static const char* label_kernel();
 
     // check whether node had its labels pruned during contraction
     bool is_contracted(NodeID node) const;
@@ -180,6 +323,15 @@ public:
     double avg_hoplinks(const std::vector<std::pair<NodeID,NodeID>> &queries) const;
     // index size in bytes
     size_t size() const;
+    // re-encode labels in compressed format, decoded on the fly during queries; compressed indexes are read-only, but
+    // get written and loaded in compressed format
+    void compress();
+    // decode compressed labels into regular blocks, so they can be updated
+    void decompress();
+    bool is_compressed() const;
+    // move label data into memory interleaved across NUMA nodes, so query threads on all nodes see the same average
+    // latency rather than those on the loading thread's node being favored; blocks copied on write stay in place
+    void interleave_labels();
     double avg_cut_size() const;
     size_t max_cut_size() const;
     size_t height() const;
@@ -189,14 +341,55 @@ public:
     size_t non_empty_cuts() const;
 
     ContractionLabel get_contraction_label(NodeID v) const;
+    // cut index of core node v for modification of label slot (and possibly higher ones); blocks shared with another
+    // index version get copied first
+    FlatCutIndex get_mutable_cut_index(NodeID v, uint16_t slot);
     void update_distance_offset(NodeID n, distance_t d);
+    // replace labels of core node v (shared by nodes contracted into it) with those of given cut index, or remove them
+    // (nullptr), releasing the old block; used by localized rebuilds, where label sizes change with the decomposition
+    void replace_labels(NodeID v, const CutIndex *ci);
+
+    // how cached results are invalidated: precise invalidation drops results if labels they were computed from have
+    // changed, epoch invalidation drops all results whenever labels get updated
+    enum class CacheInvalidation { precise, epoch };
+    // answer get_spc and get_distance queries through a concurrent cache of results using about the given number of
+    // bytes (0 disables caching); queries must not run concurrently with updates, as for the index itself
+    void enable_cache(size_t bytes, CacheInvalidation mode = CacheInvalidation::precise);
+    // start new update epoch; called by label maintenance before modifying labels
+    void next_epoch();
 
     // generate random query
     std::pair<NodeID,NodeID> random_query() const;
-    // write index in binary format
+    // write index in binary format, storing label data contiguously for memory-mapping; compressed labels stay compressed
     void write(std::ostream& os) const;
     // write index in json format
     void write_json(std::ostream& os) const;
+    // write index holding only the labels of nodes in given shard and of replicated nodes; distance offsets and parents
+    // are kept for all nodes
+    void write_shard(std::ostream& os, const ShardMap &shards, uint16_t shard) const;
+    // labels of v truncated to the cut levels above the shard level, preceded by the distance offset of v; they suffice
+    // for answering queries between v and nodes of other shards
+    std::vector<char> label_prefix(NodeID v, uint16_t shard_bits) const;
+    // distance and path count between the node whose label prefix is given and w, which lies in a different shard
+    edata_t query_prefix(std::span<const char> prefix, NodeID w) const;
+    // start (or stop) tracking changes of index and shortcut graph for delta checkpoints; the current state becomes
+    // the checkpoint that deltas are relative to; compressed labels get decompressed
+    void track_changes(ContractionHierarchy &ch, bool state = true);
+    // write label slots, distance offsets and shortcut edges changed since last checkpoint, then start a new checkpoint;
+    // weights lists the current weights of graph edges changed since the checkpoint, which get stored as well
+    void write_delta(std::ostream& os, ContractionHierarchy &ch, const std::vector<Edge> &weights = {});
+    // apply delta to index (and shortcut graph and graph), which must be in the state of the checkpoint the delta was
+    // written for; without shortcut graph only the label changes are applied, which suffices for answering queries;
+    // compressed labels get decompressed
+    void apply_delta(std::istream& is);
+    void apply_delta(std::istream& is, ContractionHierarchy &ch);
+    void apply_delta(std::istream& is, ContractionHierarchy &ch, Graph &g);
+    // apply delta to index and shortcut graph, appending the graph weights it stores to weights rather than applying
+    // them; returns false if the delta was written before graph weights were stored
+    bool apply_delta(std::istream& is, ContractionHierarchy &ch, std::vector<Edge> &weights);
+
+    friend class UpdatePipeline;
+    friend struct ShardMap;
 };
 
 // Thread-safe queue
@@ -221,25 +414,51 @@ public:
 
 //--------------------------- ContractionHierarchy ------------------
 
-struct CHNode
-{
-    uint16_t dist_index;
-    std::vector<Neighbor> up_neighbors;
-    std::vector<NodeID> down_neighbors;
-};
-
+// shortcut graph in compressed sparse row format; edges of node v are stored at [offsets[v], offsets[v+1]),
+// with up edges sorted by decreasing dist_index of neighbor and down edges by node ID
 class ContractionHierarchy
 {
+    std::vector<size_t> up_offsets, down_offsets;
+    std::vector<Neighbor> up_edges;
+    std::vector<NodeID> down_edges;
+    // edges changed since last delta checkpoint, recorded while tracking changes
+    bool tracking = false;
+    std::vector<edge_t> changed_edges;
 public:
-    std::vector<CHNode> nodes;
+    // position of node in distance labels, or 65535 for contracted nodes
+    std::vector<uint16_t> dist_index;
 
     ContractionHierarchy();
     ContractionHierarchy(std::istream &is);
     void write(std::ostream &os);
+    size_t node_count() const;
     size_t edge_count() const;
     size_t size() const;
+    // replaces edges with given adjacency lists (one per node), which are released
+    void assign(std::vector<std::vector<Neighbor>> &up, std::vector<std::vector<NodeID>> &down);
+    // edges are frozen, but their distances & path counts can be updated in place
+    std::span<Neighbor> up_neighbors(NodeID v);
+    std::span<const Neighbor> up_neighbors(NodeID v) const;
+    std::span<const NodeID> down_neighbors(NodeID v) const;
+    // returns upward edge from v to w, or nullptr if no such edge exists
+    Neighbor* up_neighbor(NodeID v, NodeID w);
+    const Neighbor* up_neighbor(NodeID v, NodeID w) const;
+    // record edges changed by shortcut graph maintenance, if tracking changes
+    void record_changes(const std::vector<std::pair<edge_t, edata_t>> &C);
+
+    friend class ContractionIndex;
 };
 
+// merge delta files (in the order they were written) into the index stored as index_prefix_cl and index_prefix_gs,
+// writing the result as target_prefix_cl and target_prefix_gs; as only files are accessed, compaction can run on a
+// background thread while a loaded index is kept up to date, and target may replace the base files
+// the graph file stays unchanged, so the graph weights stored in the deltas (and in index_prefix_w) are merged into
+// target_prefix_w, which read_weights applies to the graph loaded along with the merged index
+void compact_index(const std::string &index_prefix, const std::vector<std::string> &delta_files, const std::string &target_prefix);
+// apply graph weights merged by compact_index into filename (index_prefix_w) to g; does nothing if file does not
+// exist (index not compacted)
+void read_weights(Graph &g, const std::string &filename);
+
 //--------------------------- Graph ---------------------------------
 
 SubgraphID next_subgraph_id(bool reset = false);
@@ -248,9 +467,9 @@ struct Neighbor
 {
     NodeID node;
     distance_t distance;
-    size_t path_count;
+    path_t path_count;
     Neighbor(NodeID node, distance_t distance);
-    Neighbor(NodeID node, distance_t distance, size_t spc);
+    Neighbor(NodeID node, distance_t distance, path_t spc);
     bool operator<(const Neighbor &other) const;
 };
 
@@ -265,7 +484,7 @@ struct Node
 private:
     // temporary data used by algorithms
     distance_t distance, outcopy_distance;
-    uint16_t path_count;
+    path_t path_count;
 #ifdef MULTI_THREAD_DISTANCES
     distance_t distances[MULTI_THREAD_DISTANCES];
 #endif
@@ -273,20 +492,73 @@ private:
     uint16_t landmark_level;
 
     friend class Graph;
+    friend struct NodeRef;
+    friend class MultiThreadNodeData;
 };
 
 std::ostream& operator<<(std::ostream& os, const Node &n);
 
+// reference to the fields of a node, which may be spread across multiple arrays
+struct NodeRef
+{
+    std::vector<Neighbor> &neighbors;
+    SubgraphID &subgraph_id;
+    NodeRef(Node &n);
+private:
+    distance_t &distance, &outcopy_distance;
+    path_t &path_count;
+#ifdef MULTI_THREAD_DISTANCES
+    distance_t *distances;
+#endif
+    NodeID &inflow, &outflow;
+    uint16_t &landmark_level;
+
+    NodeRef(std::vector<Neighbor> &neighbors, SubgraphID &subgraph_id, distance_t &distance, distance_t &outcopy_distance, path_t &path_count,
+#ifdef MULTI_THREAD_DISTANCES
+        distance_t *distances,
+#endif
+        NodeID &inflow, NodeID &outflow, uint16_t &landmark_level);
+    friend class Graph;
+    friend class MultiThreadNodeData;
+};
+
+// node data stored as structure of arrays, so searches only touch the fields they use;
 // multi-threading requires thread-local data for s & t nodes
-class MultiThreadNodeData : public std::vector<Node>
+class MultiThreadNodeData
 {
+    struct DistanceData
+    {
+        distance_t distance, outcopy_distance;
+        path_t path_count;
+        uint16_t landmark_level;
+    };
+    struct FlowData
+    {
+        NodeID inflow, outflow;
+    };
+    // topology
+    std::vector<std::vector<Neighbor>> neighbors;
+    std::vector<SubgraphID> subgraph_ids;
+    // temporary data used by algorithms
+    std::vector<DistanceData> distance_data;
+#ifdef MULTI_THREAD_DISTANCES
+    std::vector<std::array<distance_t, MULTI_THREAD_DISTANCES>> parallel_distances;
+#endif
+    std::vector<FlowData> flow_data;
     thread_local static Node s_data, t_data;
 public:
-    Node& operator[](size_type pos);
-    const Node& operator[](size_type pos) const;
+    typedef size_t size_type;
+    NodeRef operator[](size_type pos);
+    // copy of node data; for s & t the values last stored by normalize
+    Node node(size_type pos) const;
+    size_type size() const;
+    void clear();
+    void resize(size_type count, const Node &value);
     void normalize();
 };
 
+std::ostream& operator<<(std::ostream& os, const MultiThreadNodeData &nd);
+
 struct Partition
 {
     std::vector<NodeID> left, right, cut;
@@ -376,6 +648,14 @@ class Graph
 #endif
     // run BFS from node v, storing distance results in node_data
     void run_bfs(NodeID v);
+#ifdef MULTI_THREAD
+    // run BFS from node v, expanding large BFS levels in parallel
+    void run_bfs_par(NodeID v);
+#endif
+#ifdef MULTI_THREAD_DISTANCES
+    // run BFS from multiple nodes in parallel
+    void run_bfs_par(const std::vector<NodeID> &vertices);
+#endif
     // run BFS from s (forward) or t (backward) on the residual graph, storing distance results in node_data
     void run_flow_bfs_from_s();
     void run_flow_bfs_from_t();
@@ -412,6 +692,9 @@ class Graph
 public:
     // turn progress tracking on/off
     static void show_progress(bool state);
+    // set number of threads used for index construction, including calling thread (default: hardware concurrency);
+    // refuses (returning false) while tasks are running on the current pool
+    static bool set_thread_count(size_t threads);
     // number of nodes in the top-level graph
     static size_t super_node_count();
 
@@ -422,10 +705,14 @@ public:
     void resize(size_t node_count);
     // insert edge from v to w into global graph
     void add_edge(NodeID v, NodeID w, distance_t distance, bool add_reverse);
+    // insert edges (and their reverses) into global graph in bulk; same result as calling add_edge for each in order
+    void add_edges(const std::vector<Edge> &edges);
     // remove edge between v and w from global graph
     void remove_edge(NodeID v, NodeID w);
     // change the weight of the edge between v and w in global graph
     void update_edge(NodeID v, NodeID w, distance_t d);
+    // weight of the edge from v to w in global graph, or infinity if there is no such edge
+    distance_t edge_weight(NodeID v, NodeID w) const;
     std::pair<distance_t, std::pair<NodeID, NodeID> > random_update();
     // remove isolated nodes from subgraph
     void remove_isolated();
@@ -441,17 +728,27 @@ public:
     const std::vector<NodeID>& get_nodes() const;
     // returns list of all edges (one per undirected edge)
     void get_edges(std::vector<Edge> &edges) const;
+    // write global graph in binary (CSR) format
+    void write_binary(std::ostream &os) const;
+    // read global graph from binary format into empty graph; returns false if stream holds no valid binary graph
+    bool read_binary(std::istream &is);
 
     // returns distance between u and v in subgraph
     distance_t get_distance(NodeID v, NodeID w, bool weighted);
     // returns paths count between u and v in subgraph
-    distance_t get_path_count(NodeID v, NodeID w, bool weighted);
+    path_t get_path_count(NodeID v, NodeID w, bool weighted);
     // decompose graph into connected components
     void get_connected_components(std::vector<std::vector<NodeID>> &cc);
     // computed rough partition with wide separator, returned in p; returns if rough partition is already a partition
     bool get_rough_partition(Partition &p, double balance, bool disconnected);
+    // computes rough partition from distances to extreme points, consuming diff; returns as get_rough_partition
+    bool diff_to_rough_partition(Partition &p, double balance, std::vector<DiffData> &diff);
+    // turn rough partition into partition using minimal cut
+    void rough_to_partition(Partition &p);
     // partition graph into balanced subgraphs using minimal cut
     void create_partition(Partition &p, double balance);
+    // create one candidate partition per element of candidates, from random starting points; searches for rough partitions run in parallel
+    void create_partitions(std::vector<Partition> &candidates, double balance);
     // decompose graph and construct cut index; returns number of shortcuts used
     size_t create_cut_index(std::vector<CutIndex> &ci, double balance);
     // returns edges that don't affect distances between nodes
@@ -467,17 +764,42 @@ public:
     void GS_Inc(ContractionHierarchy &ch, std::vector<std::pair<std::pair<distance_t, distance_t>, std::pair<NodeID, NodeID> > >& updates, std::vector<std::pair<edge_t, edata_t> > &C);
     void DCL_Dec(ContractionHierarchy &ch, ContractionIndex &ci, std::vector<std::pair<std::pair<distance_t, distance_t>, std::pair<NodeID, NodeID> > >& updates);
     void DCL_Inc(ContractionHierarchy &ch, ContractionIndex &ci, std::vector<std::pair<std::pair<distance_t, distance_t>, std::pair<NodeID, NodeID> > >& updates);
+    // label propagation of DCL_Dec / DCL_Inc, for shortcut changes C computed by GS_Dec / GS_Inc; descendants without
+    // labels (held by other shards) are skipped, so shards can update their labels from the changes of their nodes
+    void DCL_Dec_Labels(ContractionHierarchy &ch, ContractionIndex &ci, const std::vector<std::pair<edge_t, edata_t> > &C);
+    void DCL_Inc_Labels(ContractionHierarchy &ch, ContractionIndex &ci, const std::vector<std::pair<edge_t, edata_t> > &C);
 
     // Parallel
+    void GS_Dec_Par(ContractionHierarchy &ch, std::vector<std::pair<std::pair<distance_t, distance_t>, std::pair<NodeID, NodeID> > >& updates, std::vector<std::pair<edge_t, edata_t > > &C);
+    void GS_Inc_Par(ContractionHierarchy &ch, std::vector<std::pair<std::pair<distance_t, distance_t>, std::pair<NodeID, NodeID> > >& updates, std::vector<std::pair<edge_t, edata_t> > &C);
     void DCL_Inc_Par(ContractionHierarchy &ch, ContractionIndex &ci, std::vector<std::pair<std::pair<distance_t, distance_t>, std::pair<NodeID, NodeID> > >& updates);
     void DCL_Dec_Par(ContractionHierarchy &ch, ContractionIndex &ci, std::vector<std::pair<std::pair<distance_t, distance_t>, std::pair<NodeID, NodeID> > >& updates);
 
     // Optimized
-    void EnqueAndUpdate_d(ContractionHierarchy &ch, ContractionIndex &ci, NodeID v, uint16_t i, distance_t dist, uint16_t path_count);
-    void EnqueAndUpdate_i(ContractionHierarchy &ch, ContractionIndex &ci, NodeID v, uint16_t i, uint16_t path_count);
+    void EnqueAndUpdate_d(ContractionHierarchy &ch, ContractionIndex &ci, NodeID v, uint16_t i, distance_t dist, path_t path_count);
+    void EnqueAndUpdate_i(ContractionHierarchy &ch, ContractionIndex &ci, NodeID v, uint16_t i, path_t path_count);
     void DCL_Dec_Opt(ContractionHierarchy &ch, ContractionIndex &ci, std::vector<std::pair<std::pair<distance_t, distance_t>, std::pair<NodeID, NodeID> > >& updates);
     void DCL_Inc_Opt(ContractionHierarchy &ch, ContractionIndex &ci, std::vector<std::pair<std::pair<distance_t, distance_t>, std::pair<NodeID, NodeID> > >& updates);
 
+    // apply mixed weight changes (edges with new weights) of undirected edges to graph and index; repeated updates
+    // of the same edge are coalesced (last one wins), then decreases and increases are applied as separate batches
+    void apply_updates(ContractionHierarchy &ch, ContractionIndex &ci, const std::vector<Edge> &updates, bool parallel = false);
+
+    // Localized rebuild
+    // rebuild decomposition, shortcut graph and labels of the partition subtree identified by bitvector (as for
+    // ContractionIndex::in_partition_subgraph) from the current graph, keeping the cuts above it fixed; graph edges
+    // changed since the index was last consistent must lie within the subtree (both endpoints in the subtree or its
+    // ancestor cuts, at least one in the subtree); shortcuts between ancestors are recomputed and their changes
+    // propagated via DCL_Inc_Labels / DCL_Dec_Labels; not supported while tracking changes or on compressed indexes
+    void rebuild_subtree(ContractionHierarchy &ch, ContractionIndex &ci, uint64_t partition_bitvector, double balance = 0.2);
+    // apply changes of undirected edges to graph and index: edges get the given weight, with missing edges added and
+    // edges of weight infinity removed; repeated changes of the same edge are coalesced (last one wins); changes are
+    // grouped by the smallest partition subtree containing both endpoints, and each group is either maintained (as by
+    // apply_updates) or rebuilt (rebuild_subtree), whichever is estimated to be cheaper; groups with added or removed
+    // edges are always rebuilt; structural changes involving contracted nodes or nodes without labels are not supported
+    // and get skipped
+    void apply_changes(ContractionHierarchy &ch, ContractionIndex &ci, const std::vector<Edge> &changes, double balance = 0.2, bool parallel = false);
+
     Neighbor& UpNeighbor(ContractionHierarchy &ch, NodeID v, NodeID w);
     void merge_edges(std::vector<std::pair<edge_t,edata_t> > &v);
     void contract_seq(ContractionIndex &ci, std::vector<std::pair<std::pair<distance_t,distance_t>, NodeID> >& contracted_updates);
@@ -490,6 +812,8 @@ public:
     void random_pairs(std::vector<std::vector<std::pair<NodeID,NodeID>>> &buckets, distance_t min_dist, size_t bucket_size, const ContractionIndex &ci);
     // randomize order of nodes and neighbors
     void randomize();
+    // rename nodes of global graph to new_id[node], keeping the order of neighbors; resets graph
+    void renumber(const std::vector<NodeID> &new_id);
 
     friend std::ostream& operator<<(std::ostream& os, const Graph &g);
     friend MultiThreadNodeData;
@@ -499,6 +823,157 @@ public:
 void print_graph(const Graph &g, std::ostream &os);
 // read graph in DIMACS format
 void read_graph(Graph &g, std::istream &in);
+// read graph from DIMACS file, parsed in parallel; the graph gets cached in binary format (as filename.bin), which is
+// loaded instead while it is newer than the DIMACS file
+void read_graph(Graph &g, const std::string &filename, bool use_cache = true);
+
+// optional renumbering of nodes after decomposition, so that nodes close in the partition tree get close IDs; labels,
+// shortcut graph and graph data accessed together during queries and maintenance are then close in memory; IDs given
+// in graph, query and update files remain unchanged and get translated via the renumbering stored with the index
+
+// new ID of each node (indexed by old ID) in pre-order of the partition tree of ci, with nodes contracted into a core
+// node following it, and nodes without labels last
+std::vector<NodeID> partition_order(const std::vector<CutIndex> &ci, const std::vector<Neighbor> &closest);
+// rename nodes of cut index and contraction data (as produced by Graph::contract) to new_id[node]
+void renumber(std::vector<CutIndex> &ci, std::vector<Neighbor> &closest, const std::vector<NodeID> &new_id);
+void write_renumbering(std::ostream &os, const std::vector<NodeID> &new_id);
+// read renumbering written by write_renumbering; returns empty vector if file does not exist (nodes not renumbered)
+std::vector<NodeID> read_renumbering(const std::string &filename);
+
+//--------------------------- Sharding ------------------------------
+
+// labels can be split into 2^bits shards by the partition bits of the top levels of the partition tree, with contracted
+// nodes following their root; cut vertices above the shard level are replicated to all shards
+// the lowest common ancestor of nodes in different shards lies above the shard level, so queries between them can be
+// answered by the shard of one node from the label prefix of the other (ContractionIndex::label_prefix)
+// label maintenance changes labels of descendants of the lower node of changed shortcuts only, so update batches need
+// to reach only the shards of these nodes (all shards if replicated)
+struct ShardMap
+{
+    static const uint16_t ALL_SHARDS = UINT16_MAX; // shard of replicated nodes and nodes without labels
+    uint16_t bits;
+    std::vector<uint16_t> shards; // per node
+
+    ShardMap();
+    ShardMap(const ContractionIndex &ci, uint16_t bits);
+    size_t shard_count() const;
+    uint16_t operator[](NodeID v) const;
+    void write(std::ostream &os) const;
+    // read shard map written by write; exits if file cannot be read
+    static ShardMap read(const std::string &filename);
+};
+
+//--------------------------- UpdatePipeline ------------------------
+
+// long-running service applying a stream of weight changes in batches; updates are collected for a time window
+// after the first one arrives, then applied via Graph::apply_updates in a background thread
+// readers query snapshots: batches are applied to a second version of the index, which shares all label blocks not
+// modified by the batch (copy-on-write), and which replaces the published version atomically once complete
+class UpdatePipeline
+{
+    Graph &g;
+    ContractionHierarchy &ch;
+    const std::chrono::steady_clock::duration window;
+    const bool parallel;
+
+    // pending updates, protected by queue_mutex
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv, applied_cv;
+    std::vector<Edge> pending;
+    std::chrono::steady_clock::time_point pending_since;
+    // number of updates queued / applied / requested to be flushed
+    uint64_t queued = 0, applied = 0, flush_target = 0;
+    bool stopping = false;
+
+    // the given index and its shared copy take turns being published; protected by version_mutex
+    struct Version
+    {
+        ContractionIndex *ci;
+        size_t readers = 0;
+    };
+    std::unique_ptr<ContractionIndex> shadow;
+    mutable Version versions[2];
+    size_t published = 0;
+    uint64_t m_version = 0;
+    mutable std::mutex version_mutex;
+    mutable std::condition_variable released_cv;
+
+    std::thread worker;
+    void run();
+    void apply(std::vector<Edge> &batch);
+public:
+    // read access to the index version published at creation; unaffected by batches applied while held
+    class Snapshot
+    {
+        const UpdatePipeline &pipeline;
+        Version *current;
+        uint64_t m_version;
+    public:
+        Snapshot(const UpdatePipeline &pipeline);
+        ~Snapshot();
+        Snapshot(const Snapshot&) = delete;
+        Snapshot& operator=(const Snapshot&) = delete;
+        const ContractionIndex& index() const;
+        const ContractionIndex* operator->() const;
+        // number of batches reflected in snapshot
+        uint64_t version() const;
+    };
+
+    // window given in seconds; parallel selects DCL_Dec_Par/DCL_Inc_Par over sequential maintenance;
+    // ci must only be queried through snapshots while the pipeline exists; only snapshots of ci use its result cache
+    UpdatePipeline(Graph &g, ContractionHierarchy &ch, ContractionIndex &ci, double window = 1.0, bool parallel = false);
+    // applies pending updates before returning, leaving ci up to date; no snapshots may be held
+    ~UpdatePipeline();
+    // queue new weight of undirected edge (a,b); thread-safe
+    void push(NodeID a, NodeID b, distance_t weight);
+    // apply all updates queued so far and wait until they are visible to new snapshots
+    void flush();
+    Snapshot snapshot() const;
+    // number of batches published
+    uint64_t version() const;
+};
+
+// runtime metrics of index construction, queries and updates, always collected; values are recorded into shards of
+// the calling thread and summed up when read, so recording never contends with other threads
+namespace metrics
+{
+    // phase times add up over threads, so phases running in parallel may report more than wall-clock time
+    enum class Phase { contract, create_cut_index, partition, shortcuts, create_sc_graph, labels,
+        GS_Dec, GS_Inc, GS_Dec_Par, GS_Inc_Par, DCL_Dec, DCL_Inc, DCL_Dec_Par, DCL_Inc_Par, DCL_Dec_Opt, DCL_Inc_Opt, contract_seq, apply_updates, rebuild_subtree, batch_spc, COUNT };
+    enum class Counter { queue_pushes, queue_pops, labels_touched, updates, queries, hoplinks, cache_hits, cache_misses, rebuilt_nodes, COUNT };
+    // latencies in nanoseconds, collected in buckets of powers of two
+    enum class Histogram { query_latency, update_latency, COUNT };
+
+    void add_time(Phase phase, uint64_t nanoseconds);
+    void add(Counter counter, uint64_t value = 1);
+    void record(Histogram histogram, uint64_t nanoseconds);
+    uint64_t get(Counter counter);
+    // nanoseconds spent in phase
+    uint64_t get(Phase phase);
+    // reset all metrics; values recorded concurrently may get lost
+    void reset();
+    // write all metrics as JSON object
+    void write_json(std::ostream &os);
+
+    // records time between construction and destruction as one call of phase
+    class PhaseTimer
+    {
+        Phase phase;
+        std::chrono::steady_clock::time_point start;
+    public:
+        explicit PhaseTimer(Phase phase);
+        ~PhaseTimer();
+    };
+
+    // counters to be incremented within hot loops, which get added on destruction
+    class Tally
+    {
+        std::array<uint64_t, static_cast<size_t>(Counter::COUNT)> values = {};
+    public:
+        uint64_t& operator[](Counter counter) { return values[static_cast<size_t>(counter)]; }
+        ~Tally();
+    };
+}
 
 } // road_network
 
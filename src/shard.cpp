@@ -0,0 +1,707 @@
+#include "road_network.h"
+#include "util.h"
+
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace road_network;
+
+typedef vector<pair<pair<distance_t, distance_t>, pair<NodeID, NodeID> > > CoreUpdates;
+typedef vector<pair<pair<distance_t,distance_t>, NodeID> > ContractedUpdates;
+
+// messages between client and shard servers consist of a header followed by a payload holding count records; servers
+// answer each message with one of the same type; all machines must share the byte order and build configuration
+enum class MessageType : uint32_t { query = 1, prefix = 2, query_prefix = 3, update = 4, state = 5 };
+
+struct MessageHeader
+{
+    MessageType type;
+    uint32_t count;
+    uint64_t bytes; // payload size
+};
+
+// query: pairs of node IDs, answered by count distances followed by count path counts
+// prefix: node IDs, answered by their label prefixes
+// query_prefix: label prefixes with target nodes in the server's shard, answered as query
+// label prefixes are preceded by their target (or 0) and size, and padded to 8 bytes so they stay aligned in the payload
+struct PrefixRecord
+{
+    NodeID target;
+    uint32_t size;
+};
+
+// update: whether weights decrease and the number of batches applied before, then count changed shortcuts (with the
+// values computed by the client), followed by contracted updates and the graph edges they involve; answered by the
+// number of batches applied afterwards, which stays unchanged if the batch was rejected
+// state: no payload, answered by the number of update batches applied since the server loaded its shard
+struct ShortcutChange
+{
+    NodeID v, w; // lower and upper node
+    distance_t distance, gs_distance; // new distance of shortcut, and distance recorded by GS_Dec / GS_Inc
+    path_t path_count, gs_path_count;
+};
+
+struct UpdateCounts
+{
+    uint64_t batch;
+    uint32_t decrease;
+    uint32_t changes, contracted, edges;
+};
+
+struct ContractedUpdate
+{
+    distance_t old_offset, new_offset;
+    NodeID node;
+};
+
+template<typename T>
+static void append(vector<char> &payload, const T *data, size_t count = 1)
+{
+    payload.insert(payload.end(), (const char*)data, (const char*)(data + count));
+}
+
+template<typename T>
+static const T* consume(const vector<char> &payload, size_t &pos, size_t count = 1)
+{
+    const T *data = (const T*)(payload.data() + pos);
+    pos += count * sizeof(T);
+    if (pos > payload.size())
+    {
+        cerr << "malformed message" << endl;
+        exit(EXIT_FAILURE);
+    }
+    return data;
+}
+
+static void append_prefix(vector<char> &payload, NodeID target, const vector<char> &prefix)
+{
+    PrefixRecord record { target, (uint32_t)prefix.size() };
+    append(payload, &record);
+    append(payload, prefix.data(), prefix.size());
+    payload.resize((payload.size() + 7) & ~(size_t)7, 0);
+}
+
+static span<const char> consume_prefix(const vector<char> &payload, size_t &pos, NodeID &target)
+{
+    const PrefixRecord *record = consume<PrefixRecord>(payload, pos);
+    target = record->target;
+    span<const char> prefix(consume<char>(payload, pos, (record->size + 7) & ~(uint32_t)7), record->size);
+    return prefix;
+}
+
+//--------------------------- network -------------------------------
+
+static bool send_all(int fd, const char *data, size_t bytes)
+{
+    while (bytes > 0)
+    {
+        ssize_t sent = send(fd, data, bytes, MSG_NOSIGNAL);
+        if (sent <= 0)
+            return false;
+        data += sent;
+        bytes -= sent;
+    }
+    return true;
+}
+
+static bool receive_all(int fd, char *data, size_t bytes)
+{
+    while (bytes > 0)
+    {
+        ssize_t received = recv(fd, data, bytes, 0);
+        if (received <= 0)
+            return false;
+        data += received;
+        bytes -= received;
+    }
+    return true;
+}
+
+static bool send_message(int fd, MessageType type, uint32_t count, const vector<char> &payload)
+{
+    MessageHeader header { type, count, payload.size() };
+    return send_all(fd, (const char*)&header, sizeof(header)) && send_all(fd, payload.data(), payload.size());
+}
+
+// payload is allocated by vector, so records within it are aligned as in the sender's payload
+static bool receive_message(int fd, MessageHeader &header, vector<char> &payload)
+{
+    if (!receive_all(fd, (char*)&header, sizeof(header)))
+        return false;
+    payload.resize(header.bytes);
+    return receive_all(fd, payload.data(), payload.size());
+}
+
+static int connect_to(const string &address)
+{
+    size_t colon = address.rfind(':');
+    string host = address.substr(0, colon), port = colon == string::npos ? "" : address.substr(colon + 1);
+    addrinfo hints = {}, *result;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (colon == string::npos || getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0)
+    {
+        cerr << "cannot resolve " << address << endl;
+        exit(EXIT_FAILURE);
+    }
+    int fd = -1;
+    for (addrinfo *ai = result; ai != nullptr && fd < 0; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(result);
+    if (fd < 0)
+    {
+        cerr << "cannot connect to " << address << endl;
+        exit(EXIT_FAILURE);
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// connect to servers of all shards, given in order of their shard number
+static vector<int> connect_shards(const string &addresses, const ShardMap &shards)
+{
+    vector<int> fds;
+    for (const string &address : util::split(addresses))
+        fds.push_back(connect_to(address));
+    if (fds.size() != shards.shard_count())
+    {
+        cerr << "index is split into " << shards.shard_count() << " shards, but " << fds.size() << " servers are given" << endl;
+        exit(EXIT_FAILURE);
+    }
+    return fds;
+}
+
+// read answer to message sent to shard server, exiting if the connection fails
+static void receive_answer(int fd, MessageType type, MessageHeader &header, vector<char> &payload)
+{
+    if (!receive_message(fd, header, payload) || header.type != type)
+    {
+        cerr << "shard server failed to answer" << endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+//--------------------------- split ---------------------------------
+
+static int split_index(const string &index_prefix, uint16_t bits)
+{
+    ContractionIndex con_index(index_prefix + string("_cl"));
+    ShardMap shards(con_index, bits);
+    ofstream ofs(index_prefix + string("_shards"));
+    shards.write(ofs);
+    ofs.close();
+    vector<size_t> owned(shards.shard_count(), 0);
+    size_t replicated = 0;
+    for (NodeID node = 1; node < shards.shards.size(); node++)
+        if (shards[node] == ShardMap::ALL_SHARDS)
+            replicated++;
+        else
+            owned[shards[node]]++;
+    for (uint16_t shard = 0; shard < shards.shard_count(); shard++)
+    {
+        ofs.open(index_prefix + string("_shard") + to_string(shard) + string("_cl"));
+        con_index.write_shard(ofs, shards, shard);
+        ofs.close();
+        cout << "shard " << shard << ": " << owned[shard] << " nodes" << endl;
+    }
+    cout << replicated << " nodes replicated to all shards" << endl;
+    return 0;
+}
+
+//--------------------------- serve ---------------------------------
+
+struct Server
+{
+    Graph g;
+    ContractionHierarchy ch;
+    unique_ptr<ContractionIndex> con_index;
+    ShardMap shards;
+    size_t threads = 1;
+    // update batches applied since loading, as shortcut changes are only valid for the state they were computed from
+    uint64_t batches = 0;
+
+    void answer_queries(const vector<pair<NodeID,NodeID>> &queries, vector<char> &payload) const;
+    // handle message, returning answer payload
+    vector<char> handle(MessageType type, uint32_t count, const vector<char> &payload);
+};
+
+void Server::answer_queries(const vector<pair<NodeID,NodeID>> &queries, vector<char> &payload) const
+{
+    vector<path_t> paths(queries.size());
+    vector<distance_t> distances(queries.size());
+    con_index->batch_spc(queries, paths, threads, distances);
+    append(payload, distances.data(), distances.size());
+    append(payload, paths.data(), paths.size());
+}
+
+vector<char> Server::handle(MessageType type, uint32_t count, const vector<char> &payload)
+{
+    vector<char> answer;
+    size_t pos = 0;
+    if (type == MessageType::query)
+    {
+        const pair<NodeID,NodeID> *queries = consume<pair<NodeID,NodeID>>(payload, pos, count);
+        answer_queries(vector<pair<NodeID,NodeID>>(queries, queries + count), answer);
+    }
+    else if (type == MessageType::prefix)
+    {
+        const NodeID *nodes = consume<NodeID>(payload, pos, count);
+        for (uint32_t i = 0; i < count; i++)
+            append_prefix(answer, 0, con_index->label_prefix(nodes[i], shards.bits));
+    }
+    else if (type == MessageType::query_prefix)
+    {
+        vector<path_t> paths(count);
+        vector<distance_t> distances(count);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            NodeID w;
+            span<const char> prefix = consume_prefix(payload, pos, w);
+            edata_t result = con_index->query_prefix(prefix, w);
+            distances[i] = result.first;
+            paths[i] = result.second;
+        }
+        metrics::add(metrics::Counter::queries, count);
+        append(answer, distances.data(), distances.size());
+        append(answer, paths.data(), paths.size());
+    }
+    else if (type == MessageType::update)
+    {
+        const UpdateCounts *counts = consume<UpdateCounts>(payload, pos);
+        const ShortcutChange *changes = consume<ShortcutChange>(payload, pos, counts->changes);
+        const ContractedUpdate *contracted = consume<ContractedUpdate>(payload, pos, counts->contracted);
+        const Edge *edges = consume<Edge>(payload, pos, counts->edges);
+        if (counts->batch != batches)
+        {
+            cerr << "rejected update batch " << counts->batch << ", having applied " << batches << endl;
+            append(answer, &batches);
+            return answer;
+        }
+        util::start_timer();
+        for (uint32_t i = 0; i < counts->edges; i++)
+        {
+            g.update_edge(edges[i].a, edges[i].b, edges[i].d);
+            g.update_edge(edges[i].b, edges[i].a, edges[i].d);
+        }
+        // shortcut graph gets the values computed by the client, labels are then updated from the changes
+        vector<pair<edge_t, edata_t>> C;
+        for (uint32_t i = 0; i < counts->changes; i++)
+        {
+            const ShortcutChange &c = changes[i];
+            Neighbor *n = ch.up_neighbor(c.v, c.w);
+            assert(n != nullptr);
+            n->distance = c.distance;
+            n->path_count = c.path_count;
+            C.push_back(make_pair(make_pair(c.v, c.w), make_pair(c.gs_distance, c.gs_path_count)));
+        }
+        if (counts->decrease)
+            g.DCL_Dec_Labels(ch, *con_index, C);
+        else
+            g.DCL_Inc_Labels(ch, *con_index, C);
+        ContractedUpdates contracted_updates;
+        for (uint32_t i = 0; i < counts->contracted; i++)
+            contracted_updates.push_back(make_pair(make_pair(contracted[i].old_offset, contracted[i].new_offset), contracted[i].node));
+        g.contract_seq(*con_index, contracted_updates);
+        metrics::record(metrics::Histogram::update_latency, util::stop_timer() * 1e9);
+        metrics::add(metrics::Counter::updates, counts->changes + counts->contracted);
+        batches++;
+        append(answer, &batches);
+    }
+    else if (type == MessageType::state)
+        append(answer, &batches);
+    else
+    {
+        cerr << "unknown message type " << (uint32_t)type << endl;
+        exit(EXIT_FAILURE);
+    }
+    return answer;
+}
+
+static int serve(const string &graph_file, const string &index_prefix, uint16_t shard, uint16_t port, size_t threads, const string &metrics_file)
+{
+    Server server;
+    server.threads = threads;
+    server.shards = ShardMap::read(index_prefix + string("_shards"));
+    if (shard >= server.shards.shard_count())
+    {
+        cerr << "index is split into " << server.shards.shard_count() << " shards only" << endl;
+        return 1;
+    }
+    // graph is needed for updating distance offsets of contracted nodes
+    read_graph(server.g, graph_file);
+    vector<NodeID> new_id = read_renumbering(index_prefix + string("_id"));
+    if (!new_id.empty())
+        server.g.renumber(new_id);
+    read_weights(server.g, index_prefix + string("_w"));
+    server.con_index = make_unique<ContractionIndex>(index_prefix + string("_shard") + to_string(shard) + string("_cl"));
+    // labels get updated in place, so compressed shards are decoded
+    server.con_index->decompress();
+    ifstream ifs(index_prefix + string("_gs"));
+    server.ch = ContractionHierarchy(ifs);
+    ifs.close();
+
+    int listener = socket(AF_INET6, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in6 address = {};
+    address.sin6_family = AF_INET6;
+    address.sin6_addr = in6addr_any;
+    address.sin6_port = htons(port);
+    if (listener < 0 || bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 16) != 0)
+    {
+        cerr << "cannot listen on port " << port << endl;
+        return 1;
+    }
+    cout << "serving shard " << shard << " of " << server.shards.shard_count() << " on port " << port << endl;
+    // clients are served one at a time, as queries must not run concurrently with updates
+    while (true)
+    {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0)
+            continue;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        MessageHeader header;
+        vector<char> payload;
+        while (receive_message(fd, header, payload))
+            if (!send_message(fd, header.type, 0, server.handle(header.type, header.count, payload)))
+                break;
+        close(fd);
+        if (!metrics_file.empty())
+        {
+            ofstream mfs(metrics_file);
+            metrics::write_json(mfs);
+            mfs << endl;
+        }
+    }
+}
+
+//--------------------------- query ---------------------------------
+
+// answer batch of queries through shard servers: queries within a shard (or involving only replicated nodes) are sent
+// to that shard, for others the label prefix of the source is fetched from its shard and sent to the shard of the target
+static void run_batch(const vector<int> &fds, const ShardMap &shards, span<const pair<NodeID,NodeID>> queries, span<distance_t> distances, span<path_t> paths)
+{
+    size_t shard_count = fds.size();
+    // queries answered locally by each shard, and cross-shard queries grouped by shard of source
+    vector<vector<size_t>> local(shard_count), cross(shard_count);
+    for (size_t i = 0; i < queries.size(); i++)
+    {
+        uint16_t sv = shards[queries[i].first], sw = shards[queries[i].second];
+        if (sv == ShardMap::ALL_SHARDS && sw == ShardMap::ALL_SHARDS)
+            local[i % shard_count].push_back(i);
+        else if (sv == ShardMap::ALL_SHARDS || sw == ShardMap::ALL_SHARDS || sv == sw)
+            local[sv == ShardMap::ALL_SHARDS ? sw : sv].push_back(i);
+        else
+            cross[sv].push_back(i);
+    }
+    // all messages of a round are sent before any answer is read, so shards work in parallel
+    auto read_results = [&](int fd, const vector<size_t> &indices) {
+        MessageHeader header;
+        vector<char> payload;
+        receive_answer(fd, MessageType::query, header, payload);
+        size_t pos = 0;
+        const distance_t *d = consume<distance_t>(payload, pos, indices.size());
+        const path_t *p = consume<path_t>(payload, pos, indices.size());
+        for (size_t k = 0; k < indices.size(); k++)
+        {
+            distances[indices[k]] = d[k];
+            paths[indices[k]] = p[k];
+        }
+    };
+    for (size_t s = 0; s < shard_count; s++)
+    {
+        vector<char> payload;
+        for (size_t i : local[s])
+            append(payload, &queries[i]);
+        if (!local[s].empty())
+            send_message(fds[s], MessageType::query, local[s].size(), payload);
+        payload.clear();
+        for (size_t i : cross[s])
+            append(payload, &queries[i].first);
+        if (!cross[s].empty())
+            send_message(fds[s], MessageType::prefix, cross[s].size(), payload);
+    }
+    // forward prefixes to shards of targets
+    vector<vector<size_t>> forwarded(shard_count);
+    vector<vector<char>> forwarded_payloads(shard_count);
+    for (size_t s = 0; s < shard_count; s++)
+    {
+        if (!local[s].empty())
+            read_results(fds[s], local[s]);
+        if (cross[s].empty())
+            continue;
+        MessageHeader header;
+        vector<char> payload;
+        receive_answer(fds[s], MessageType::prefix, header, payload);
+        size_t pos = 0;
+        for (size_t i : cross[s])
+        {
+            NodeID unused;
+            span<const char> prefix = consume_prefix(payload, pos, unused);
+            uint16_t sw = shards[queries[i].second];
+            forwarded[sw].push_back(i);
+            PrefixRecord record { queries[i].second, (uint32_t)prefix.size() };
+            append(forwarded_payloads[sw], &record);
+            append(forwarded_payloads[sw], prefix.data(), prefix.size());
+            forwarded_payloads[sw].resize((forwarded_payloads[sw].size() + 7) & ~(size_t)7, 0);
+        }
+    }
+    for (size_t s = 0; s < shard_count; s++)
+        if (!forwarded[s].empty())
+            send_message(fds[s], MessageType::query_prefix, forwarded[s].size(), forwarded_payloads[s]);
+    for (size_t s = 0; s < shard_count; s++)
+        if (!forwarded[s].empty())
+        {
+            // answers have the format of query answers
+            MessageHeader header;
+            vector<char> payload;
+            receive_answer(fds[s], MessageType::query_prefix, header, payload);
+            size_t pos = 0;
+            const distance_t *d = consume<distance_t>(payload, pos, forwarded[s].size());
+            const path_t *p = consume<path_t>(payload, pos, forwarded[s].size());
+            for (size_t k = 0; k < forwarded[s].size(); k++)
+            {
+                distances[forwarded[s][k]] = d[k];
+                paths[forwarded[s][k]] = p[k];
+            }
+        }
+}
+
+static int query(const string &index_prefix, const string &query_file, const string &addresses, size_t batch_size, const string &result_file)
+{
+    ShardMap shards = ShardMap::read(index_prefix + string("_shards"));
+    // node IDs of query file need translating if index was built with renumbered nodes
+    vector<NodeID> new_id = read_renumbering(index_prefix + string("_id"));
+    vector<pair<NodeID, NodeID> > queries;
+    NodeID a, b;
+    ifstream ifs(query_file);
+    while (ifs >> a >> b)
+        queries.push_back(new_id.empty() ? make_pair(a, b) : make_pair(new_id[a], new_id[b]));
+    ifs.close();
+    vector<int> fds = connect_shards(addresses, shards);
+
+    size_t cross_shard = 0;
+    for (pair<NodeID,NodeID> q : queries)
+        cross_shard += shards[q.first] != shards[q.second] && shards[q.first] != ShardMap::ALL_SHARDS && shards[q.second] != ShardMap::ALL_SHARDS;
+    vector<distance_t> distances(queries.size());
+    vector<path_t> paths(queries.size());
+    util::start_timer();
+    for (size_t begin = 0; begin < queries.size(); begin += batch_size)
+    {
+        size_t size = min(batch_size, queries.size() - begin);
+        run_batch(fds, shards, span(queries).subspan(begin, size), span(distances).subspan(begin, size), span(paths).subspan(begin, size));
+    }
+    double duration = util::stop_timer();
+    cout << "ran " << queries.size() << " random queries (" << cross_shard << " cross-shard) on " << fds.size() << " shards in "
+        << duration << "s (" << queries.size() / duration << " queries/s)" << endl;
+    for (int fd : fds)
+        close(fd);
+    if (!result_file.empty())
+    {
+        ofstream ofs(result_file);
+        for (size_t i = 0; i < queries.size(); i++)
+            ofs << distances[i] << " " << paths[i] << endl;
+    }
+    return 0;
+}
+
+//--------------------------- update --------------------------------
+
+// number of update batches applied by shard server, exiting if the connection fails
+static uint64_t applied_batches(int fd)
+{
+    MessageHeader header;
+    vector<char> payload;
+    receive_answer(fd, MessageType::state, header, payload);
+    size_t pos = 0;
+    return *consume<uint64_t>(payload, pos);
+}
+
+// compute shortcut changes of update batch, and send them to the shards whose labels they may change; the client's
+// graph, shortcut graph and distance offsets are kept as a sequence of delta files, one per batch, appended to
+// index_prefix_coordinator, so later batches start from the state the servers have reached
+static int update(const string &graph_file, const string &index_prefix, const string &update_file, bool decrease, const string &addresses)
+{
+    ShardMap shards = ShardMap::read(index_prefix + string("_shards"));
+    Graph g;
+    read_graph(g, graph_file);
+    vector<NodeID> new_id = read_renumbering(index_prefix + string("_id"));
+    if (!new_id.empty())
+        g.renumber(new_id);
+    read_weights(g, index_prefix + string("_w"));
+    auto internal = [&new_id](NodeID node) { return new_id.empty() ? node : new_id[node]; };
+    // every shard file holds distance offsets and parents of all nodes, which suffice for routing contracted updates
+    ContractionIndex con_index(index_prefix + string("_shard0_cl"));
+    ifstream ifs(index_prefix + string("_gs"));
+    ContractionHierarchy ch(ifs);
+    ifs.close();
+    string state_file = index_prefix + string("_coordinator");
+    uint64_t batch = 0;
+    ifs.open(state_file);
+    while (ifs && ifs.peek() != EOF)
+    {
+        con_index.apply_delta(ifs, ch, g);
+        batch++;
+    }
+    ifs.close();
+    con_index.track_changes(ch);
+    vector<int> fds = connect_shards(addresses, shards);
+    size_t shard_count = fds.size();
+    // servers that were restarted, or updated by a client with other state, would get changes for the wrong state
+    for (int fd : fds)
+        send_message(fd, MessageType::state, 0, vector<char>());
+    for (size_t s = 0; s < shard_count; s++)
+        if (uint64_t applied = applied_batches(fds[s]); applied != batch)
+        {
+            cerr << "shard " << s << " has applied " << applied << " update batches, but " << state_file << " holds " << batch << endl;
+            return 1;
+        }
+
+    // split updates into updates of core and contracted nodes as update does
+    CoreUpdates updates;
+    ContractedUpdates contracted_updates;
+    vector<Edge> contracted_edges;
+    // graph edges changed by updates, whose new weights get stored in the state file
+    vector<pair<NodeID,NodeID>> changed_edges;
+    NodeID a, b; distance_t weight;
+    ifs.open(update_file);
+    while (ifs >> a >> b >> weight)
+    {
+        a = internal(a), b = internal(b);
+        distance_t new_weight = decrease ? weight * 0.5 : weight * 1.5;
+        g.update_edge(a, b, new_weight);
+        g.update_edge(b, a, new_weight);
+        changed_edges.push_back(make_pair(min(a, b), max(a, b)));
+        ContractionLabel x = con_index.get_contraction_label(a), y = con_index.get_contraction_label(b);
+        if (con_index.is_contracted(a) || con_index.is_contracted(b))
+        {
+            contracted_edges.push_back(Edge(a, b, new_weight));
+            if (x.distance_offset > y.distance_offset)
+                contracted_updates.push_back(make_pair(make_pair(x.distance_offset, y.distance_offset + new_weight), a));
+            else if (x.distance_offset < y.distance_offset)
+                contracted_updates.push_back(make_pair(make_pair(y.distance_offset, x.distance_offset + new_weight), b));
+            continue;
+        }
+        updates.push_back(make_pair(make_pair(weight, new_weight), make_pair(a, b)));
+    }
+    ifs.close();
+
+    util::start_timer();
+    vector<pair<edge_t, edata_t>> C;
+    if (decrease)
+        g.GS_Dec(ch, updates, C);
+    else
+        g.GS_Inc(ch, updates, C);
+    // keep distance offsets current for routing later batches
+    ContractedUpdates routed_contracted = contracted_updates;
+    g.contract_seq(con_index, routed_contracted);
+
+    // labels changed by a shortcut change are those of the lower node and its descendants, which lie in its shard
+    vector<vector<ShortcutChange>> changes(shard_count);
+    vector<ShortcutChange> replicated;
+    for (const pair<edge_t, edata_t> &c : C)
+    {
+        const Neighbor *n = ch.up_neighbor(c.first.first, c.first.second);
+        assert(n != nullptr);
+        ShortcutChange change { c.first.first, c.first.second, n->distance, c.second.first, n->path_count, c.second.second };
+        uint16_t shard = shards[c.first.first];
+        (shard == ShardMap::ALL_SHARDS ? replicated : changes[shard]).push_back(change);
+    }
+    // contracted updates only change offsets within the contraction tree of their root
+    vector<vector<ContractedUpdate>> contracted(shard_count);
+    vector<vector<Edge>> edges(shard_count);
+    auto route = [shard_count](uint16_t shard, auto &lists, const auto &item) {
+        for (size_t s = 0; s < shard_count; s++)
+            if (shard == ShardMap::ALL_SHARDS || shard == s)
+                lists[s].push_back(item);
+    };
+    for (const auto &u : contracted_updates)
+        route(shards[u.second], contracted, ContractedUpdate { u.first.first, u.first.second, u.second });
+    for (const Edge &e : contracted_edges)
+        route(shards[e.a], edges, e);
+
+    // every shard receives the batch, even if empty for it, so all servers count the same batches
+    size_t routed = 0;
+    for (size_t s = 0; s < shard_count; s++)
+    {
+        changes[s].insert(changes[s].end(), replicated.begin(), replicated.end());
+        if (!changes[s].empty() || !contracted[s].empty() || !edges[s].empty())
+            routed++;
+        UpdateCounts counts { batch, decrease, (uint32_t)changes[s].size(), (uint32_t)contracted[s].size(), (uint32_t)edges[s].size() };
+        vector<char> payload;
+        append(payload, &counts);
+        append(payload, changes[s].data(), changes[s].size());
+        append(payload, contracted[s].data(), contracted[s].size());
+        append(payload, edges[s].data(), edges[s].size());
+        send_message(fds[s], MessageType::update, 0, payload);
+    }
+    bool rejected = false;
+    for (size_t s = 0; s < shard_count; s++)
+    {
+        MessageHeader header;
+        vector<char> payload;
+        receive_answer(fds[s], MessageType::update, header, payload);
+        size_t pos = 0;
+        if (*consume<uint64_t>(payload, pos) != batch + 1)
+        {
+            cerr << "shard " << s << " rejected update batch" << endl;
+            rejected = true;
+        }
+    }
+    if (rejected)
+        return 1;
+    // record new state only once all servers have applied the batch
+    util::make_set(changed_edges);
+    vector<Edge> weights;
+    for (pair<NodeID,NodeID> e : changed_edges)
+        if (g.edge_weight(e.first, e.second) != infinity)
+            weights.push_back(Edge(e.first, e.second, g.edge_weight(e.first, e.second)));
+    ofstream ofs(state_file, ios::app);
+    con_index.write_delta(ofs, ch, weights);
+    ofs.close();
+    double update_time = util::stop_timer();
+    cout << "ran " << updates.size() + contracted_updates.size() << " random updates (" << C.size() << " shortcut changes, "
+        << replicated.size() << " of replicated nodes) on " << routed << " of " << shard_count << " shards in " << update_time << "s" << endl;
+    for (int fd : fds)
+        close(fd);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    // optional file receiving metrics of servers in JSON format, written whenever a client disconnects
+    string metrics_file = util::take_option(argc, argv, "metrics");
+    string threads_option = util::take_option(argc, argv, "threads");
+    string batch_option = util::take_option(argc, argv, "batch");
+    // optional file receiving distance and path count of each query
+    string result_file = util::take_option(argc, argv, "results");
+    string mode = argc > 1 ? argv[1] : "";
+    if (mode == "split" && argc == 4)
+        return split_index(argv[2], stoul(argv[3]));
+    if (mode == "serve" && argc == 6)
+        return serve(argv[2], argv[3], stoul(argv[4]), stoul(argv[5]), threads_option.empty() ? 1 : stoul(threads_option), metrics_file);
+    if (mode == "query" && argc == 5)
+        return query(argv[2], argv[3], argv[4], batch_option.empty() ? 100000 : stoul(batch_option), result_file);
+    if (mode == "update" && argc == 7 && (argv[5][0] == 'd' || argv[5][0] == 'i'))
+        return update(argv[2], argv[3], argv[4], argv[5][0] == 'd', argv[6]);
+    cerr << "usage: " << argv[0] << " split index_file shard_bits" << endl
+        << "       " << argv[0] << " serve graph_file index_file shard port [--threads=1] [--metrics=file]" << endl
+        << "       " << argv[0] << " query index_file query_file host:port,... [--batch=100000] [--results=file]" << endl
+        << "       " << argv[0] << " update graph_file index_file update_file d|i host:port,..." << endl;
+    return 1;
+}
@@ -9,17 +9,100 @@ using namespace road_network;
 
 int main(int argc, char** argv)
 {
-    ifstream ifs(argv[1]);
+    // optional file receiving metrics in JSON format
+    string metrics_file = util::take_option(argc, argv, "metrics");
+    // optional delta files applied on top of the index, in the order written
+    vector<string> delta_files = util::split(util::take_option(argc, argv, "deltas"));
+    // optional file receiving changes made by updates, rather than leaving index files unchanged
+    string delta_file = util::take_option(argc, argv, "delta");
+    // optional target for merging the index with its delta files, done in the background while updates run
+    string compact_target = util::take_option(argc, argv, "compact");
+    // delta files store label slots in place, which rebuilt subtrees don't keep
+    if (argv[4][0] == 'r' && !delta_file.empty())
+    {
+        cerr << "updates with rebuilds cannot be written as delta files" << endl;
+        return 1;
+    }
+
     Graph g;
-    read_graph(g, ifs);
-    ifs.close();
+    read_graph(g, argv[1]);
+    // node IDs of graph and update file need translating if index was built with renumbered nodes
+    vector<NodeID> new_id = read_renumbering(string(argv[2]) + string("_id"));
+    if (!new_id.empty())
+        g.renumber(new_id);
+    // compacted indexes store the graph weights of the deltas merged into them
+    read_weights(g, string(argv[2]) + string("_w"));
+    auto internal = [&new_id](NodeID node) { return new_id.empty() ? node : new_id[node]; };
 
-    ifs.open(string(argv[2]) + string("_cl"));
+    ifstream ifs(string(argv[2]) + string("_cl"));
     ContractionIndex con_index(ifs);
     ifs.close();
+    // maintenance changes labels in place, so compressed labels are decoded
+    con_index.decompress();
     ifs.open(string(argv[2]) + string("_gs"));
     ContractionHierarchy ch(ifs);
     ifs.close();
+    // deltas also bring the graph weights up to date, so maintenance starts from the current graph
+    for (const string &file : delta_files)
+    {
+        ifs.open(file);
+        con_index.apply_delta(ifs, ch, g);
+        ifs.close();
+    }
+    thread compaction;
+    if (!compact_target.empty())
+        compaction = thread(compact_index, string(argv[2]), delta_files, compact_target);
+    if (!delta_file.empty())
+        con_index.track_changes(ch);
+    // graph edges changed by updates, whose new weights get stored in the delta file
+    vector<pair<NodeID,NodeID>> changed_edges;
+    auto record_change = [&changed_edges](NodeID a, NodeID b) { changed_edges.push_back(make_pair(min(a, b), max(a, b))); };
+    // persist changes and wait for background compaction
+    auto finish = [&]() {
+        if (!delta_file.empty())
+        {
+            util::make_set(changed_edges);
+            vector<Edge> weights;
+            for (pair<NodeID,NodeID> e : changed_edges)
+                if (g.edge_weight(e.first, e.second) != infinity)
+                    weights.push_back(Edge(e.first, e.second, g.edge_weight(e.first, e.second)));
+            ofstream dfs(delta_file);
+            con_index.write_delta(dfs, ch, weights);
+        }
+        if (compaction.joinable())
+            compaction.join();
+        if (!metrics_file.empty())
+        {
+            ofstream mfs(metrics_file);
+            metrics::write_json(mfs);
+            mfs << endl;
+        }
+    };
+
+    if(argv[4][0] == 'm' || argv[4][0] == 'r') {
+        // mixed updates: update file lists new edge weights; with rebuilds, missing edges get added and edges of
+        // weight 0 removed
+        bool rebuild = argv[4][0] == 'r';
+        vector<Edge> mixed_updates;
+        NodeID a, b; distance_t weight;
+        ifs.open(argv[3]);
+        while(ifs >> a >> b >> weight)
+        {
+            mixed_updates.push_back(Edge(internal(a), internal(b), rebuild && weight == 0 ? infinity : weight));
+            record_change(internal(a), internal(b));
+        }
+        ifs.close();
+
+        util::start_timer();
+        if (rebuild)
+            g.apply_changes(ch, con_index, mixed_updates);
+        else
+            g.apply_updates(ch, con_index, mixed_updates);
+        double mixed_update_time = util::stop_timer();
+        cout << "ran " << mixed_updates.size() << " mixed updates in " << mixed_update_time << endl;
+        finish();
+        return 0;
+    }
 
     vector<pair<pair<distance_t,distance_t>, NodeID> > contracted_updates;
     vector<pair<pair<distance_t, distance_t>, pair<NodeID, NodeID> > > updates;
@@ -27,6 +110,7 @@ int main(int argc, char** argv)
 
     ifs.open(argv[3]);
     while(ifs >> a >> b >> weight) {
+        a = internal(a), b = internal(b);
 
         distance_t new_weight;
         if(argv[4][0] == 'd')
@@ -36,6 +120,7 @@ int main(int argc, char** argv)
 
         g.update_edge(a, b, new_weight);
         g.update_edge(b, a, new_weight);
+        record_change(a, b);
 
         ContractionLabel x = con_index.get_contraction_label(a), y = con_index.get_contraction_label(b);
         if (con_index.is_contracted(a) || con_index.is_contracted(b)) {
@@ -68,7 +153,10 @@ int main(int argc, char** argv)
     g.contract_seq(con_index, contracted_updates);
 
     double random_update_time = util::stop_timer();
+    metrics::add(metrics::Counter::updates, updates.size() + contracted_updates.size());
+    metrics::record(metrics::Histogram::update_latency, random_update_time * 1e9);
     cout << "ran " << updates.size() << " random updates in " << random_update_time << endl;
-    
+    finish();
+
     return 0;
 }
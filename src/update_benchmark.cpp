@@ -0,0 +1,231 @@
+#include "road_network.h"
+#include "util.h"
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+using namespace road_network;
+
+typedef vector<pair<pair<distance_t, distance_t>, pair<NodeID, NodeID> > > CoreUpdates;
+typedef vector<pair<pair<distance_t,distance_t>, NodeID> > ContractedUpdates;
+
+enum class Variant { seq, opt, par, pipe };
+
+static const char* variant_name(Variant v)
+{
+    return v == Variant::seq ? "seq" : v == Variant::opt ? "opt" : v == Variant::par ? "par" : "pipe";
+}
+
+// parse comma-separated list of values
+static vector<size_t> parse_list(const string &s, const string &fallback)
+{
+    vector<size_t> values;
+    stringstream ss(s.empty() ? fallback : s);
+    string item;
+    while (getline(ss, item, ','))
+        values.push_back(stoul(item));
+    return values;
+}
+
+static vector<Variant> parse_variants(const string &s)
+{
+    vector<Variant> variants;
+    stringstream ss(s.empty() ? "seq,opt,par" : s);
+    string item;
+    while (getline(ss, item, ','))
+    {
+        if (item == "seq")
+            variants.push_back(Variant::seq);
+        else if (item == "opt")
+            variants.push_back(Variant::opt);
+        else if (item == "par")
+            variants.push_back(Variant::par);
+        else if (item == "pipe")
+            variants.push_back(Variant::pipe);
+        else
+            cerr << "ignoring unknown variant " << item << endl;
+    }
+    return variants;
+}
+
+// apply batch of weight changes to graph, splitting them into updates of core and contracted nodes as update does;
+// changes not in the direction of the update type are skipped
+static void prepare_batch(Graph &g, const ContractionIndex &ci, span<const Edge> batch, bool decrease, CoreUpdates &core, ContractedUpdates &contracted)
+{
+    for (const Edge &e : batch)
+    {
+        distance_t old_weight = g.edge_weight(e.a, e.b);
+        if (old_weight == infinity || (decrease ? e.d >= old_weight : e.d <= old_weight))
+            continue;
+        g.update_edge(e.a, e.b, e.d);
+        g.update_edge(e.b, e.a, e.d);
+        if (ci.is_contracted(e.a) || ci.is_contracted(e.b))
+        {
+            ContractionLabel x = ci.get_contraction_label(e.a), y = ci.get_contraction_label(e.b);
+            if (x.distance_offset > y.distance_offset)
+                contracted.push_back(make_pair(make_pair(x.distance_offset, y.distance_offset + e.d), e.a));
+            else if (x.distance_offset < y.distance_offset)
+                contracted.push_back(make_pair(make_pair(y.distance_offset, x.distance_offset + e.d), e.b));
+            continue;
+        }
+        core.push_back(make_pair(make_pair(old_weight, e.d), make_pair(e.a, e.b)));
+    }
+}
+
+// queue batch of weight changes to update pipeline and wait until applied; changes not in the direction of the update
+// type (relative to earlier changes in the batch) are skipped as by prepare_batch, returning the number queued
+static size_t run_pipeline(const Graph &g, UpdatePipeline &pipeline, span<const Edge> batch, bool decrease)
+{
+    // the pipeline only touches the graph once flushed, so weights can be read while queueing
+    unordered_map<pair<NodeID,NodeID>, distance_t, boost::hash<pair<NodeID,NodeID>>> weights;
+    size_t queued = 0;
+    for (const Edge &e : batch)
+    {
+        pair<NodeID,NodeID> key(min(e.a, e.b), max(e.a, e.b));
+        auto known = weights.find(key);
+        distance_t old_weight = known != weights.end() ? known->second : g.edge_weight(e.a, e.b);
+        if (old_weight == infinity || (decrease ? e.d >= old_weight : e.d <= old_weight))
+            continue;
+        weights[key] = e.d;
+        pipeline.push(e.a, e.b, e.d);
+        queued++;
+    }
+    pipeline.flush();
+    return queued;
+}
+
+static void run_variant(Graph &g, ContractionHierarchy &ch, ContractionIndex &ci, Variant v, bool decrease, CoreUpdates &core)
+{
+    if (core.empty())
+        return;
+    if (v == Variant::seq)
+        decrease ? g.DCL_Dec(ch, ci, core) : g.DCL_Inc(ch, ci, core);
+    else if (v == Variant::opt)
+        decrease ? g.DCL_Dec_Opt(ch, ci, core) : g.DCL_Inc_Opt(ch, ci, core);
+    else
+        decrease ? g.DCL_Dec_Par(ch, ci, core) : g.DCL_Inc_Par(ch, ci, core);
+}
+
+int main(int argc, char** argv)
+{
+    string batch_option = util::take_option(argc, argv, "batch-sizes");
+    string thread_option = util::take_option(argc, argv, "threads");
+    string variant_option = util::take_option(argc, argv, "variants");
+    string update_option = util::take_option(argc, argv, "updates");
+    string check_option = util::take_option(argc, argv, "checks");
+    string seed_option = util::take_option(argc, argv, "seed");
+    // pin workers of parallel maintenance to NUMA nodes
+    util::numa::set_pinning(util::take_flag(argc, argv, "pin"));
+    if (argc < 5 || (argv[4][0] != 'd' && argv[4][0] != 'i'))
+    {
+        cerr << "usage: " << argv[0] << " graph_file index_file update_file d|i [--variants=seq,opt,par] [--batch-sizes=100,1000]"
+            << " [--threads=1,2,4] [--updates=all] [--checks=1000] [--seed=1] [--pin]" << endl;
+        return 1;
+    }
+    bool decrease = argv[4][0] == 'd';
+    vector<size_t> batch_sizes = parse_list(batch_option, "100,1000");
+    vector<size_t> thread_counts = parse_list(thread_option, "1,2,4");
+    vector<Variant> variants = parse_variants(variant_option);
+    size_t check_count = check_option.empty() ? 1000 : stoul(check_option);
+    unsigned seed = seed_option.empty() ? 1 : stoul(seed_option);
+    // stop checking a run after this many failed queries, as each failure gets reported in detail
+    const size_t max_failures = 10;
+
+    // same new weights as update (halved for decreases, increased by half for increases), except that weights stay
+    // positive, as zero-weight edges make shortest path counts ill-defined
+    vector<Edge> changes;
+    ifstream ifs(argv[3]);
+    NodeID a, b; distance_t weight;
+    while (ifs >> a >> b >> weight)
+        changes.push_back(Edge(a, b, decrease ? max<distance_t>(1, weight * 0.5) : weight * 1.5));
+    ifs.close();
+    // node IDs of graph and update file need translating if index was built with renumbered nodes
+    vector<NodeID> new_id = read_renumbering(string(argv[2]) + string("_id"));
+    if (!new_id.empty())
+        for (Edge &e : changes)
+        {
+            e.a = new_id[e.a];
+            e.b = new_id[e.b];
+        }
+    if (!update_option.empty())
+        changes.erase(changes.begin() + min<size_t>(changes.size(), stoul(update_option)), changes.end());
+
+    cout << left << setw(8) << "variant" << right << setw(8) << "batch" << setw(8) << "threads" << setw(9) << "updates"
+        << setw(11) << "total_s" << setw(12) << "us/update" << setw(10) << "GS_s" << setw(10) << "prop_s" << setw(12) << "contract_s"
+        << setw(12) << "pushes" << setw(12) << "pops" << setw(12) << "touched" << setw(8) << "checks" << setw(8) << "failed" << endl;
+    size_t total_failures = 0;
+    for (Variant v : variants)
+        for (size_t batch_size : batch_sizes)
+            // thread counts only affect the parallel variant
+            for (size_t threads : v == Variant::par ? thread_counts : vector<size_t>(1, 1))
+            {
+                Graph::set_thread_count(threads);
+                // every run starts from the unmodified graph and index
+                Graph g;
+                read_graph(g, argv[1]);
+                if (!new_id.empty())
+                    g.renumber(new_id);
+                read_weights(g, string(argv[2]) + string("_w"));
+                ContractionIndex ci(string(argv[2]) + string("_cl"));
+                ifstream chs(string(argv[2]) + string("_gs"));
+                ContractionHierarchy ch(chs);
+                chs.close();
+
+                metrics::reset();
+                size_t applied = 0;
+                double seconds = 0;
+                // batches are applied by the pipeline thread once flushed, with window long enough never to close first
+                unique_ptr<UpdatePipeline> pipeline;
+                if (v == Variant::pipe)
+                    pipeline = make_unique<UpdatePipeline>(g, ch, ci, 3600.0);
+                for (size_t begin = 0; begin < changes.size(); begin += max<size_t>(batch_size, 1))
+                {
+                    span<const Edge> batch(changes.data() + begin, min(batch_size, changes.size() - begin));
+                    if (pipeline)
+                    {
+                        util::start_timer();
+                        applied += run_pipeline(g, *pipeline, batch, decrease);
+                        seconds += util::stop_timer();
+                        continue;
+                    }
+                    CoreUpdates core;
+                    ContractedUpdates contracted;
+                    prepare_batch(g, ci, batch, decrease, core, contracted);
+                    applied += core.size() + contracted.size();
+                    util::start_timer();
+                    run_variant(g, ch, ci, v, decrease, core);
+                    g.contract_seq(ci, contracted);
+                    seconds += util::stop_timer();
+                }
+                // leaves ci up to date for checking
+                pipeline.reset();
+                using metrics::Phase;
+                double gs = (metrics::get(Phase::GS_Dec) + metrics::get(Phase::GS_Inc) + metrics::get(Phase::GS_Dec_Par) + metrics::get(Phase::GS_Inc_Par)) / 1e9;
+                double dcl = (metrics::get(Phase::DCL_Dec) + metrics::get(Phase::DCL_Inc) + metrics::get(Phase::DCL_Dec_Par) + metrics::get(Phase::DCL_Inc_Par)
+                    + metrics::get(Phase::DCL_Dec_Opt) + metrics::get(Phase::DCL_Inc_Opt)) / 1e9;
+                double contract = metrics::get(Phase::contract_seq) / 1e9;
+
+                // compare sampled queries against Dijkstra on updated graph, using the same queries for all runs
+                srand(seed);
+                size_t checked = 0, failed = 0;
+                for (; checked < check_count && failed < max_failures; checked++)
+                {
+                    pair<NodeID,NodeID> q(g.random_node(), g.random_node());
+                    if (!ci.check_query(q, g))
+                        failed++;
+                }
+                total_failures += failed;
+
+                cout << left << setw(8) << variant_name(v) << right << setw(8) << batch_size << setw(8) << threads << setw(9) << applied
+                    << fixed << setprecision(4) << setw(11) << seconds << setprecision(2) << setw(12) << seconds * 1e6 / max<size_t>(applied, 1)
+                    << setprecision(4) << setw(10) << gs << setw(10) << dcl - gs << setw(12) << contract << defaultfloat
+                    << setw(12) << metrics::get(metrics::Counter::queue_pushes) << setw(12) << metrics::get(metrics::Counter::queue_pops)
+                    << setw(12) << metrics::get(metrics::Counter::labels_touched) << setw(8) << checked << setw(8) << failed << endl;
+            }
+    if (total_failures > 0)
+        cerr << total_failures << " sampled queries were answered incorrectly" << endl;
+    return total_failures > 0;
+}
@@ -1,6 +1,15 @@
 #include "util.h"
 
 #include <chrono>
+#include <cstring>
+#include <mutex>
+#include <condition_variable>
+#include <fstream>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 
 using namespace std;
 
@@ -22,11 +31,415 @@ double stop_timer()
     return diff_nano / 1.e9;
 }
 
+string take_option(int &argc, char **argv, const string &name)
+{
+    string prefix = "--" + name + "=";
+    for (int i = 1; i < argc; i++)
+        if (string(argv[i]).starts_with(prefix))
+        {
+            string value = argv[i] + prefix.size();
+            copy(argv + i + 1, argv + argc + 1, argv + i);
+            argc--;
+            return value;
+        }
+    return "";
+}
+
+bool take_flag(int &argc, char **argv, const string &name)
+{
+    string flag = "--" + name;
+    for (int i = 1; i < argc; i++)
+        if (argv[i] == flag)
+        {
+            copy(argv + i + 1, argv + argc + 1, argv + i);
+            argc--;
+            return true;
+        }
+    return false;
+}
+
+vector<string> split(const string &s, char separator)
+{
+    vector<string> parts;
+    if (s.empty())
+        return parts;
+    size_t begin = 0, end;
+    while ((end = s.find(separator, begin)) != string::npos)
+    {
+        parts.push_back(s.substr(begin, end - begin));
+        begin = end + 1;
+    }
+    parts.push_back(s.substr(begin));
+    return parts;
+}
+
+uint64_t checksum(const void *data, size_t size)
+{
+    static const uint64_t prime1 = 0x9e3779b97f4a7c15ull, prime2 = 0xc2b2ae3d27d4eb4full;
+    const char *p = static_cast<const char*>(data);
+    uint64_t h = size * prime1;
+    for (; size >= sizeof(uint64_t); p += sizeof(uint64_t), size -= sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, p, sizeof(uint64_t));
+        h = rotl(h ^ (word * prime2), 31) * prime1;
+    }
+    // remaining bytes form a zero-padded word
+    uint64_t word = 0;
+    memcpy(&word, p, size);
+    h = rotl(h ^ (word * prime2), 31) * prime1;
+    // final mix, so all input bits affect all output bits
+    h ^= h >> 33;
+    h *= prime2;
+    h ^= h >> 29;
+    return h;
+}
+
 Summary Summary::operator*(double x) const
 {
     return { min * x, max * x, avg * x  };
 }
 
+bump_arena::~bump_arena()
+{
+    release();
+}
+
+char* bump_arena::new_slab(size_t bytes)
+{
+    char *slab = static_cast<char*>(::operator new(slab_header + bytes, align_val_t(slab_size)));
+    *reinterpret_cast<bump_arena**>(slab) = this;
+    slabs.push_back(slab);
+    return slab + slab_header;
+}
+
+bump_arena* bump_arena::owner(void *p)
+{
+    return *reinterpret_cast<bump_arena**>(reinterpret_cast<uintptr_t>(p) & ~(slab_size - 1));
+}
+
+void* bump_arena::do_allocate(size_t bytes, size_t alignment)
+{
+    assert(alignment <= alignof(max_align_t));
+    lock_guard<mutex> lock(m_mutex);
+    live++;
+    // large blocks get a slab of their own, keeping the current slab for small ones
+    if (bytes > slab_size / 4)
+        return new_slab(bytes);
+    // small blocks are rounded up, so they can be reused for any alignment
+    bytes = (bytes + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+    auto reusable = free_blocks.find(bytes);
+    if (reusable != free_blocks.end() && !reusable->second.empty())
+    {
+        void *p = reusable->second.back();
+        reusable->second.pop_back();
+        return p;
+    }
+    if (next == nullptr || next + bytes > end)
+    {
+        next = new_slab(slab_size - slab_header);
+        end = next + slab_size - slab_header;
+    }
+    char *p = next;
+    next = p + bytes;
+    return p;
+}
+
+void bump_arena::do_deallocate(void *p, size_t bytes, size_t)
+{
+    lock_guard<mutex> lock(m_mutex);
+    if (--live == 0)
+        release();
+    else if (bytes <= slab_size / 4)
+        free_blocks[(bytes + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1)].push_back(p);
+}
+
+bool bump_arena::do_is_equal(const std::pmr::memory_resource &other) const noexcept
+{
+    return this == &other;
+}
+
+void bump_arena::release()
+{
+    for (char *slab : slabs)
+        ::operator delete(slab, align_val_t(slab_size));
+    slabs.clear();
+    free_blocks.clear();
+    next = end = nullptr;
+}
+
+// arenas are never destroyed, as blocks allocated by a thread may be returned after it finished
+static mutex arenas_mutex;
+static vector<unique_ptr<bump_arena>> arenas;
+static vector<bump_arena*> unused_arenas;
+
+static bump_arena* local_arena()
+{
+    struct LocalArena
+    {
+        bump_arena *arena;
+        LocalArena()
+        {
+            lock_guard<mutex> lock(arenas_mutex);
+            if (unused_arenas.empty())
+                unused_arenas.push_back(arenas.emplace_back(make_unique<bump_arena>()).get());
+            arena = unused_arenas.back();
+            unused_arenas.pop_back();
+        }
+        ~LocalArena()
+        {
+            lock_guard<mutex> lock(arenas_mutex);
+            unused_arenas.push_back(arena);
+        }
+    };
+    thread_local LocalArena local;
+    return local.arena;
+}
+
+void* thread_arena::do_allocate(size_t bytes, size_t alignment)
+{
+    return local_arena()->allocate(bytes, alignment);
+}
+
+void thread_arena::do_deallocate(void *p, size_t bytes, size_t alignment)
+{
+    bump_arena::owner(p)->deallocate(p, bytes, alignment);
+}
+
+bool thread_arena::do_is_equal(const std::pmr::memory_resource &other) const noexcept
+{
+    return this == &other;
+}
+
+namespace numa
+{
+
+// parse list of ranges such as "0-3,8,10-11", as used by sysfs
+static vector<int> parse_range_list(const string &list)
+{
+    vector<int> values;
+    for (const string &range : split(list))
+    {
+        size_t dash = range.find('-');
+        int first = stoi(range), last = dash == string::npos ? first : stoi(range.substr(dash + 1));
+        for (int v = first; v <= last; v++)
+            values.push_back(v);
+    }
+    return values;
+}
+
+struct Topology
+{
+    vector<int> nodes; // IDs of nodes with CPUs
+    vector<vector<int>> cpus; // per node
+    Topology();
+};
+
+Topology::Topology()
+{
+    string list;
+    ifstream online("/sys/devices/system/node/online");
+    if (online >> list)
+        for (int node : parse_range_list(list))
+        {
+            ifstream cpulist("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+            string cpu_list;
+            if (cpulist >> cpu_list)
+            {
+                nodes.push_back(node);
+                cpus.push_back(parse_range_list(cpu_list));
+            }
+        }
+    if (nodes.empty())
+    {
+        nodes.push_back(0);
+        cpus.push_back({});
+        for (unsigned cpu = 0; cpu < thread::hardware_concurrency(); cpu++)
+            cpus.back().push_back(cpu);
+    }
+}
+
+static const Topology& topology()
+{
+    static const Topology t;
+    return t;
+}
+
+static atomic<bool> pin_threads = false;
+
+size_t node_count()
+{
+    return topology().nodes.size();
+}
+
+const vector<int>& node_cpus(size_t node)
+{
+    return topology().cpus[node];
+}
+
+bool interleave(void *addr, size_t bytes)
+{
+    const size_t mask_bits = 8 * sizeof(unsigned long);
+    vector<unsigned long> mask(1);
+    for (int node : topology().nodes)
+    {
+        if ((size_t)node / mask_bits >= mask.size())
+            mask.resize(node / mask_bits + 1, 0);
+        mask[node / mask_bits] |= 1ul << (node % mask_bits);
+    }
+    // called directly, so libnuma is not needed
+    return syscall(SYS_mbind, addr, bytes, MPOL_INTERLEAVE, mask.data(), mask.size() * mask_bits + 1, 0) == 0;
+}
+
+void set_pinning(bool state)
+{
+    pin_threads = state;
+}
+
+bool pinning()
+{
+    return pin_threads;
+}
+
+void pin_thread(size_t thread_number)
+{
+    if (!pin_threads)
+        return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : node_cpus(thread_number % node_count()))
+        CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        cerr << "cannot pin thread to NUMA node " << topology().nodes[thread_number % node_count()] << endl;
+}
+
+}
+
+// pool and deque index of current thread, when it is a pool worker
+thread_local static const ThreadPool *current_pool = nullptr;
+thread_local static size_t current_deque = 0;
+
+ThreadPool::ThreadPool(size_t worker_count)
+{
+    for (size_t i = 0; i <= worker_count; i++)
+        deques.push_back(make_unique<TaskDeque>());
+    for (size_t i = 0; i < worker_count; i++)
+        workers.push_back(thread(&ThreadPool::work, this, i));
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> lock(idle_mutex);
+        stopping = true;
+    }
+    idle_cv.notify_all();
+    for (thread &worker : workers)
+        worker.join();
+}
+
+size_t ThreadPool::worker_count() const
+{
+    return workers.size();
+}
+
+bool ThreadPool::busy() const
+{
+    return active > 0;
+}
+
+size_t ThreadPool::own_deque() const
+{
+    return current_pool == this ? current_deque : workers.size();
+}
+
+void ThreadPool::run(TaskGroup &group, function<void()> task)
+{
+    group.pending++;
+    active++;
+    queued++;
+    TaskDeque &d = *deques[own_deque()];
+    {
+        lock_guard<mutex> lock(d.m_mutex);
+        d.tasks.push_back(Task { move(task), &group });
+    }
+    {
+        // avoid lost wake-ups of threads about to wait
+        lock_guard<mutex> lock(idle_mutex);
+    }
+    idle_cv.notify_one();
+}
+
+bool ThreadPool::run_next(size_t deque)
+{
+    Task task;
+    bool found = false;
+    // own tasks last-in first-out, stolen ones first-in first-out
+    for (size_t i = 0; i < deques.size() && !found; i++)
+    {
+        TaskDeque &d = *deques[(deque + i) % deques.size()];
+        lock_guard<mutex> lock(d.m_mutex);
+        if (d.tasks.empty())
+            continue;
+        if (i == 0)
+        {
+            task = move(d.tasks.back());
+            d.tasks.pop_back();
+        }
+        else
+        {
+            task = move(d.tasks.front());
+            d.tasks.pop_front();
+        }
+        found = true;
+    }
+    if (!found)
+        return false;
+    queued--;
+    task.run();
+    active--;
+    if (--task.group->pending == 0)
+        wake_all();
+    return true;
+}
+
+void ThreadPool::wake_all()
+{
+    {
+        lock_guard<mutex> lock(idle_mutex);
+    }
+    idle_cv.notify_all();
+}
+
+void ThreadPool::work(size_t id)
+{
+    current_pool = this;
+    current_deque = id;
+    // calling thread takes part in executing tasks, so workers start on the next node
+    numa::pin_thread(id + 1);
+    while (true)
+    {
+        if (run_next(id))
+            continue;
+        unique_lock<mutex> lock(idle_mutex);
+        idle_cv.wait(lock, [this] { return stopping || queued > 0; });
+        if (stopping && queued == 0)
+            return;
+    }
+}
+
+void ThreadPool::wait(TaskGroup &group)
+{
+    size_t deque = own_deque();
+    while (group.pending > 0)
+    {
+        if (run_next(deque))
+            continue;
+        unique_lock<mutex> lock(idle_mutex);
+        idle_cv.wait(lock, [this, &group] { return group.pending == 0 || queued > 0; });
+    }
+}
+
 }
 
 namespace std {
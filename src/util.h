@@ -3,8 +3,18 @@
 #include <vector>
 #include <algorithm>
 #include <iostream>
-#include <barrier>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <atomic>
 #include <cassert>
+#include <memory_resource>
+#include <mutex>
+#include <array>
+#include <bit>
+#include <string>
+#include <unordered_map>
 
 
 #include "road_network.h"
@@ -16,6 +26,15 @@ void start_timer();
 // returns time in seconds since last unconsumed start_timer call and consumes it
 double stop_timer();
 
+// remove command line argument of the form --name=value, returning value (empty if not given)
+std::string take_option(int &argc, char **argv, const std::string &name);
+// remove command line argument --name, returning whether it was given
+bool take_flag(int &argc, char **argv, const std::string &name);
+// split string at separator, returning no elements for the empty string
+std::vector<std::string> split(const std::string &s, char separator = ',');
+// 64-bit checksum of byte range, processing 8-byte words; not cryptographic
+uint64_t checksum(const void *data, size_t size);
+
 // sort vector and remove duplicate elements
 template<typename T>
 void make_set(std::vector<T> &v)
@@ -156,120 +175,237 @@ public:
     }
 };
 
-template<typename T, size_t threads>
-class par_max_bucket_list
+// monotone min-queue keyed by unsigned member T::distance; pushed keys must not be smaller than the last popped one
+template<typename T>
+class radix_heap
 {
-    std::vector<std::vector<T> > buckets;
-    size_t current_bucket = 0, next_in_bucket = 0;
-    std::barrier<> sync_point;
-    std::mutex m_mutex;
-    bool is_empty = true;
-    void on_complete()
+    typedef decltype(T::distance) key_t;
+    // bucket i holds keys whose highest bit differing from last popped key is i-1
+    std::array<std::vector<T>, sizeof(key_t) * 8 + 1> buckets;
+    key_t last = 0;
+    size_t count = 0;
+    size_t bucket(key_t key) const
     {
-        assert(!is_empty);
-        if (current_bucket == buckets.size() - 1)
-        {
-            is_empty = true;
-            return;
-        }
-        next_in_bucket = 0;
-        // advance to next non-empty bucket
-        while (buckets[++current_bucket].empty())
-            if (current_bucket == buckets.size() - 1)
-            {
-                is_empty = true;
-                return;
-            }
+        return std::bit_width(static_cast<key_t>(key ^ last));
     }
 public:
-    par_max_bucket_list(size_t max_bucket) : sync_point(threads)
+    void push(T value)
     {
-        // prevent re-allocation which could cause syncronization issues
-        buckets.reserve(max_bucket + 1);
+        assert(value.distance >= last);
+        buckets[bucket(value.distance)].push_back(value);
+        count++;
     }
-    void push(T value, size_t bucket)
+    bool empty() const
     {
-        if (buckets.size() <= bucket)
+        return count == 0;
+    }
+    T pop()
+    {
+        assert(!empty());
+        if (buckets[0].empty())
         {
-            buckets.resize(bucket + 1);
+            // redistribute smallest non-empty bucket around its minimum
+            size_t i = 1;
+            while (buckets[i].empty())
+                i++;
+            last = std::min_element(buckets[i].begin(), buckets[i].end(), [](const T &a, const T &b) { return a.distance < b.distance; })->distance;
+            for (const T &value : buckets[i])
+                buckets[bucket(value.distance)].push_back(value);
+            buckets[i].clear();
         }
-        buckets[bucket].push_back(value);
-        is_empty = false;
+        T top = buckets[0].back();
+        buckets[0].pop_back();
+        count--;
+        return top;
+    }
+    // empty queue, keeping allocated memory for reuse
+    void clear()
+    {
+        for (std::vector<T> &b : buckets)
+            b.clear();
+        last = 0;
+        count = 0;
+    }
+    size_t size() const
+    {
+        return count;
     }
+};
 
-    bool next(T& value, size_t thread)
+// processes items sorted by level in parallel, where items may only depend on items of lower levels; threads claim
+// chunks of up to grain items through an atomic counter and wait only until all items of lower levels are done,
+// with runs of small levels merged into a single chunk that one thread processes in order
+template<typename T>
+class par_level_list
+{
+    struct Chunk
+    {
+        size_t begin, end;
+        size_t wait_for; // number of items to be done before chunk can be processed
+    };
+    std::vector<T> items;
+    std::vector<Chunk> chunks;
+    std::atomic<size_t> next_chunk = 0, done = 0;
+public:
+    // level must be non-decreasing over items
+    template<typename LevelOf>
+    par_level_list(std::vector<T> &&items, LevelOf level, size_t grain) : items(std::move(items))
     {
-        while (true)
+        assert(grain > 0);
+        const std::vector<T> &v = this->items;
+        auto level_end = [&v, &level](size_t begin) {
+            size_t end = begin + 1;
+            while (end < v.size() && level(v[end]) == level(v[begin]))
+                end++;
+            return end;
+        };
+        size_t begin = 0;
+        while (begin < v.size())
         {
-            if (is_empty)
-                return false;
+            size_t end = level_end(begin);
+            if (end - begin >= grain)
             {
-                // if there's a value available in current bucket, simply return it
-                std::lock_guard<std::mutex> lock(m_mutex);
-                if (next_in_bucket < buckets[current_bucket].size()) {
-                    value = buckets[current_bucket][next_in_bucket++];
-                    return true;
+                for (size_t b = begin; b < end; b += grain)
+                    chunks.push_back(Chunk { b, std::min(b + grain, end), begin });
+            }
+            else
+            {
+                // merge following small levels
+                while (end < v.size() && end - begin < grain)
+                {
+                    size_t next_end = level_end(end);
+                    if (next_end - end >= grain)
+                        break;
+                    end = next_end;
                 }
+                chunks.push_back(Chunk { begin, end, begin });
             }
-            sync_point.arrive_and_wait();
-            // ugly workaround for barrier template fuckery
-            if (thread == 0)
-                on_complete();
-            sync_point.arrive_and_wait();
+            begin = end;
         }
     }
-    void reset()
+    // call f for all items, using given number of threads (including the calling one)
+    template<typename F>
+    void run(size_t thread_count, F f)
     {
-        current_bucket = buckets.empty() ? 0 : buckets.size() - 1;
-        next_in_bucket = 0;
-        is_empty = false;
+        auto work = [this, &f]() {
+            for (size_t c = next_chunk++; c < chunks.size(); c = next_chunk++)
+            {
+                const Chunk &chunk = chunks[c];
+                while (done.load(std::memory_order_acquire) < chunk.wait_for)
+                    std::this_thread::yield();
+                for (size_t i = chunk.begin; i < chunk.end; i++)
+                    f(items[i]);
+                done.fetch_add(chunk.end - chunk.begin, std::memory_order_release);
+            }
+        };
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < std::min(thread_count, chunks.size()); i++)
+            threads.push_back(std::thread(work));
+        work();
+        for (std::thread &t : threads)
+            t.join();
     }
 };
 
-// thread-safe queue of buckets
-template <typename T>
-class TSBucketQueue {
-private:
-    // underlying data structure
-    std::vector<std::vector<T> > buckets;
-    // minimum non-empty bucket
-    size_t min_bucket;
-    // mutex for thread synchronization
+// thread-safe bump allocator handing out memory from large slabs; returned small blocks are kept in free lists by
+// size and handed out again (e.g. to vectors growing to the size another vector grew from), and slabs get released
+// once all blocks have been returned; slabs are aligned to their size and start with a pointer to their arena
+class bump_arena : public std::pmr::memory_resource
+{
+    static constexpr size_t slab_size = 1 << 22;
+    static constexpr size_t slab_header = alignof(std::max_align_t);
     std::mutex m_mutex;
+    std::vector<char*> slabs;
+    char *next = nullptr, *end = nullptr;
+    size_t live = 0; // number of blocks not yet returned
+    std::unordered_map<size_t, std::vector<void*>> free_blocks; // by size, rounded to alignment of max_align_t
+    char* new_slab(size_t bytes);
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override;
+    void release();
+public:
+    ~bump_arena();
+    // arena a block was allocated from
+    static bump_arena* owner(void *p);
+};
 
-    bool empty() const
-    {
-        return min_bucket >= buckets.size();
-    }
+// memory resource allocating from a bump_arena of the calling thread, so concurrent allocations don't contend;
+// blocks may be returned by any thread and go back to their arena, and arenas of finished threads get reused
+class thread_arena : public std::pmr::memory_resource
+{
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override;
+};
+
+// NUMA topology (read from sysfs) and placement; systems without NUMA support behave as having a single node
+namespace numa
+{
+    // number of NUMA nodes with CPUs, at least 1
+    size_t node_count();
+    // CPUs of given node
+    const std::vector<int>& node_cpus(size_t node);
+    // interleave pages of memory range (page-aligned, not yet touched) across all nodes; returns whether successful
+    bool interleave(void *addr, size_t bytes);
+    // enable pinning of pool worker threads (which also run batched queries) to NUMA nodes; affects pool workers
+    // started afterwards, i.e. after the next Graph::set_thread_count
+    void set_pinning(bool state);
+    bool pinning();
+    // pin calling thread to CPUs of NUMA node thread_number % node_count(), if pinning is enabled
+    void pin_thread(size_t thread_number);
+}
+
+// persistent pool of worker threads executing (possibly nested) tasks; each worker keeps its own deque of tasks,
+// runs the most recently queued task first, and steals the oldest tasks of other workers when idle
+class ThreadPool
+{
 public:
-    // pushes an element to a given bucket in the queue (NOT thread-safe)
-    void push(T item, size_t bucket)
+    // set of tasks which can be waited for together
+    class TaskGroup
     {
-        //std::lock_guard<std::mutex> lock(m_mutex);
-        if (empty() || min_bucket > bucket)
-            min_bucket = bucket;
-        if (buckets.size() <= bucket)
-            buckets.resize(bucket + 1);
-        buckets[bucket].push_back(item);
-    }
-    // pops next non-empty bucket off the queue, along with its bucket number; returns whether successful (thread-safe)
-    bool next_bucket(std::vector<T>& items, size_t &bucket)
+        std::atomic<size_t> pending = 0;
+        friend class ThreadPool;
+    };
+private:
+    struct Task
     {
-        // restrict mutex lock to critical block (delay copy)
-        {
-            std::lock_guard<std::mutex> lock(m_mutex);
-            if (empty())
-                return false;
-            bucket = min_bucket++;
-            // skip empty buckets
-            while (min_bucket < buckets.size() && buckets[min_bucket].empty())
-                min_bucket++;
-        }
-        // copy bucket content
-        items = buckets[bucket];
-        buckets[bucket].clear();
-        return true;
-    }
+        std::function<void()> run;
+        TaskGroup *group;
+    };
+    struct TaskDeque
+    {
+        std::mutex m_mutex;
+        std::deque<Task> tasks;
+    };
+    // one deque per worker, plus a shared one for tasks queued by other threads
+    std::vector<std::unique_ptr<TaskDeque>> deques;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> queued = 0;
+    // tasks queued or running
+    std::atomic<size_t> active = 0;
+    bool stopping = false;
+    // idle threads wait for tasks to be queued or groups to complete
+    std::mutex idle_mutex;
+    std::condition_variable idle_cv;
+
+    // deque owned by calling thread
+    size_t own_deque() const;
+    // run a single queued task, preferring the given deque; returns whether successful
+    bool run_next(size_t deque);
+    void wake_all();
+    void work(size_t id);
+public:
+    // calling threads take part in executing tasks while waiting, so a pool without workers runs tasks in wait()
+    explicit ThreadPool(size_t worker_count);
+    ~ThreadPool();
+    size_t worker_count() const;
+    // whether any tasks are queued or running
+    bool busy() const;
+    // queue task as part of group; thread-safe
+    void run(TaskGroup &group, std::function<void()> task);
+    // wait for all tasks of group to finish, executing queued tasks meanwhile
+    void wait(TaskGroup &group);
 };
 
 } // util
@@ -281,8 +417,8 @@ enum class ListFormat { plain, indexed };
 void set_list_format(ListFormat format);
 ListFormat get_list_format();
 
-template <typename T>
-std::ostream& operator<<(std::ostream& os, const std::vector<T> &v)
+template <typename T, typename Alloc>
+std::ostream& operator<<(std::ostream& os, const std::vector<T, Alloc> &v)
 {
     if (v.empty())
         return os << "[]";